@@ -0,0 +1,34 @@
+#ifndef clox_alloctrace_h
+#define clox_alloctrace_h
+
+#include <stdio.h>
+
+#include "common.h"
+
+// allocation budgets, for tests that guard allocation free code: a budget
+// (allocBudget / allocCheck in scripts) fails when more objects or bytes
+// (object cells and what reallocate grows) are allocated while it is open
+// than it allows, counted from the gc statistics every build keeps;
+// with vm.allocTrace (--alloc-trace) every allocation is also counted by
+// where it was made, the running instruction and its source line, which a
+// failing budget names and printAllocSites reports
+
+#define ALLOC_MAX_BUDGETS 16
+
+// from allocateObject with the object's type and reallocate with -1
+void traceAllocation (int otype, size_t size);
+
+// negative limits are no limit, false when too many budgets are open
+bool openAllocBudget (double maxObjects, double maxBytes);
+// closes the innermost one, false with the error raised if it went over
+bool closeAllocBudget ();
+// an exception caught by a handler of the frame at index frame, for the code
+// from start to end, drops the budgets opened in what it unwinds; frame -1
+// drops them all
+void dropAllocBudgets (int frame, int start, int end);
+
+// the sites by bytes allocated, the biggest first
+void printAllocSites (FILE* out);
+void freeAllocTrace ();
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef clox_aot_h
+#define clox_aot_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+// ahead-of-time translation: 'clox --emit-c script' writes every function
+// of the compiled script as a C function with one label per jump target,
+// running on the same runtime (objects, gc, natives, call frames)
+//
+// build the output together with every file in src/ except main.c:
+//   cc -O2 -I include -o script script.c $(ls src/*.c | grep -v main.c) -lm -pthread
+
+typedef enum {
+    AOT_NIL,
+    AOT_BOOL,
+    AOT_NUMBER,
+    AOT_INT,
+    AOT_STRING,
+    AOT_FUNCTION,
+} AotConstantType;
+
+typedef struct {
+    AotConstantType ctype;
+    double number; // also the bool
+    const char* chars;
+    int length; // of chars, the function index for AOT_FUNCTION
+    long long integer; // AOT_INT, left out of the other rows
+} AotConstant;
+
+// everything needed to rebuild an ObjFunction, nested functions come
+// before the functions using them and the script is the last one
+typedef struct {
+    const char* name; // NULL for the script
+    int arity;
+    int upvalueCount;
+    const uint8_t* code;
+    const int* lines;
+    int count;
+    const AotConstant* constants;
+    int constantCount;
+    const ExceptionHandler* handlers;
+    int handlerCount;
+    AotFn body;
+} AotFunction;
+
+void emitC (ObjFunction* script, FILE* out);
+
+// main of the emitted program
+InterpretResult aotInterpret (const AotFunction* functions, int count);
+
+// ========= Emitted code helpers =========
+
+// push without the call into vm.c
+#define AOT_PUSH(value) (*vm.stackTop++ = (value))
+
+// isFalsey without the call, bools first
+#define AOT_FALSEY(value) \
+    (IS_BOOL(value) ? !AS_BOOL(value) : \
+     IS_NUMBER(value) ? AS_NUMBER(value) == 0 : \
+     IS_INT(value) ? AS_INT(value) == 0 : IS_NIL(value))
+
+
+#define AOT_NUMBER_OP(valueType, op) \
+    do { \
+        double b = AS_NUMBER(vm.stackTop[-1]); \
+        double a = AS_NUMBER(vm.stackTop[-2]); \
+        vm.stackTop--; \
+        vm.stackTop[-1] = valueType(a op b); \
+    } while (false)
+
+// doubles and ints inline, everything else (errors, strings, mixed) through aotBinary
+#define AOT_BINARY(valueType, op, opcode) \
+    do { \
+        if (IS_NUMBER(vm.stackTop[-1]) && IS_NUMBER(vm.stackTop[-2])) { \
+            AOT_NUMBER_OP(valueType, op); \
+        } else if ((opcode) != OP_DIVIDE && IS_INT(vm.stackTop[-1]) && IS_INT(vm.stackTop[-2])) { \
+            vm.stackTop--; \
+            vm.stackTop[-1] = INT_OP_##valueType(AS_INT(vm.stackTop[-1]), op, AS_INT(vm.stackTop[0])); \
+        } else if (!aotBinary(opcode)) { \
+            goto unwind; \
+        } \
+    } while (false)
+
+#define AOT_REGISTER(valueType, op, opcode, dst, a, b) \
+    do { \
+        Value left = (a); \
+        Value right = (b); \
+        if (IS_NUMBER(left) && IS_NUMBER(right)) { \
+            Value result = valueType(AS_NUMBER(left) op AS_NUMBER(right)); \
+            if ((dst) == REG_STACK) AOT_PUSH(result); \
+            else frame -> slots[(dst)] = result; \
+        } else if ((opcode) != OP_DIVIDE_RR && (opcode) != OP_DIVIDE_RK \
+                   && IS_INT(left) && IS_INT(right)) { \
+            Value result = INT_OP_##valueType(AS_INT(left), op, AS_INT(right)); \
+            if ((dst) == REG_STACK) AOT_PUSH(result); \
+            else frame -> slots[(dst)] = result; \
+        } else if (!aotRegister(frame, opcode, dst, left, right)) { \
+            goto unwind; \
+        } \
+    } while (false)
+
+// runtime helpers, the ones returning bool return false after raising a
+// runtime error, the emitted code then unwinds to its handlers
+bool aotBinary (uint8_t op);
+bool aotRegister (CallFrame* frame, uint8_t op, uint8_t dst, Value a, Value b);
+bool aotNegate ();
+bool aotCheckNum (Value* value);
+void aotEqual ();
+void aotPrint ();
+void aotDefineGlobal (Value name);
+bool aotGetGlobal (Value name);
+bool aotSetGlobal (Value name);
+bool aotGetProperty (Value name);
+bool aotSetProperty (Value name);
+bool aotGetSuper (Value name);
+bool aotInherit ();
+void aotMethod (Value name);
+void aotClosure (CallFrame* frame, Value function, const uint8_t* operands);
+bool aotCall (int argCount);
+bool aotCallGlobal (Value name, int argCount);
+bool aotInvoke (Value name, int argCount);
+bool aotSuperInvoke (Value name, int argCount);
+bool aotReturn (CallFrame* frame);
+
+#endif
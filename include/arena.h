@@ -0,0 +1,23 @@
+#ifndef clox_arena_h
+#define clox_arena_h
+
+#include "common.h"
+
+// bump allocation for data that dies all at once, outside the gc's books:
+// nothing in an arena is counted by vm.bytesAlocated or collects garbage
+typedef struct ArenaBlock ArenaBlock;
+
+typedef struct Arena {
+    ArenaBlock* blocks;
+    char* next;
+    char* end;
+    void* last; // most recent allocation, grows in place
+} Arena;
+
+void initArena (Arena* arena);
+void* arenaAllocate (Arena* arena, size_t size);
+// pointer's contents in a block of newSize bytes, the old block is left behind
+void* arenaGrow (Arena* arena, void* pointer, size_t oldSize, size_t newSize);
+void freeArena (Arena* arena);
+
+#endif
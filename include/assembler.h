@@ -0,0 +1,549 @@
+#ifndef clox_assembler_h
+#define clox_assembler_h
+
+// x86-64 encoder shared by the method jit and the trace compiler, every
+// helper is static inline so each tier gets its own private copy
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "jit.h"
+#include "memory.h"
+#include "value.h"
+#include "vm.h"
+
+// x86-64 registers
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBX 3
+#define RSP 4
+#define RBP 5
+#define RSI 6
+#define RDI 7
+#define R12 12
+#define R13 13
+#define R14 14
+#define R15 15
+
+// condition codes
+#define CC_B 0x2
+#define CC_E 0x4
+#define CC_NE 0x5
+#define CC_A 0x7
+#define CC_L 0xc
+#define CC_G 0xf
+
+// register state kept while inside jitted code:
+//  r12 - cached vm.stackTop
+//  r13 - frame -> slots
+//  r14 - the CallFrame
+#define STACK_TOP R12
+#define SLOTS R13
+#define FRAME R14
+
+#define VALUE_SIZE ((int32_t) sizeof(Value))
+#define TAG ((int32_t) offsetof(Value, vtype))
+#define PAYLOAD ((int32_t) offsetof(Value, as))
+
+// n-th value from the top of the stack (1 is the top)
+#define SLOT(n) (-VALUE_SIZE * (n))
+
+typedef struct {
+    int offset; // of the rel32 to patch
+    int target; // bytecode offset, resolved by the owner of the assembler
+} JumpFixup;
+
+typedef struct {
+    uint8_t* code;
+    int count;
+    int capacity;
+
+    JumpFixup* fixups;
+    int fixupCount;
+    int fixupCapacity;
+} Assembler;
+
+// ========= Encoding =========
+
+static inline void emit8 (Assembler* as, uint8_t byte) {
+    if (as -> capacity < as -> count + 1) {
+        as -> capacity = GROW_CAPACITY(as -> capacity);
+        as -> code = (uint8_t*)realloc(as -> code, as -> capacity);
+        if (as -> code == NULL) exit(1);
+    }
+    as -> code[as -> count++] = byte;
+}
+
+static inline void emit32 (Assembler* as, uint32_t value) {
+    for (int i = 0; i < 4; i++) emit8(as, (value >> (8 * i)) & 0xff);
+}
+
+static inline void emit64 (Assembler* as, uint64_t value) {
+    for (int i = 0; i < 8; i++) emit8(as, (value >> (8 * i)) & 0xff);
+}
+
+static inline void rex (Assembler* as, bool wide, int reg, int base) {
+    emit8(as, 0x40 | (wide ? 8 : 0) | ((reg >> 3) << 2) | (base >> 3));
+}
+
+// [base + disp32], always the long form so r12 / r13 need no special cases
+static inline void modrmMem (Assembler* as, int reg, int base, int32_t disp) {
+    emit8(as, 0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP) emit8(as, 0x24); // sib for rsp / r12
+    emit32(as, (uint32_t) disp);
+}
+
+static inline void modrmReg (Assembler* as, int reg, int rm) {
+    emit8(as, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+static inline void movLoad (Assembler* as, int dst, int base, int32_t disp) {
+    rex(as, true, dst, base);
+    emit8(as, 0x8b);
+    modrmMem(as, dst, base, disp);
+}
+
+static inline void movStore (Assembler* as, int base, int32_t disp, int src) {
+    rex(as, true, src, base);
+    emit8(as, 0x89);
+    modrmMem(as, src, base, disp);
+}
+
+static inline void movReg (Assembler* as, int dst, int src) {
+    rex(as, true, src, dst);
+    emit8(as, 0x89);
+    modrmReg(as, src, dst);
+}
+
+static inline void movImm64 (Assembler* as, int dst, uint64_t imm) {
+    rex(as, true, 0, dst);
+    emit8(as, 0xb8 | (dst & 7));
+    emit64(as, imm);
+}
+
+static inline void addImm (Assembler* as, int reg, int32_t imm) {
+    rex(as, true, 0, reg);
+    emit8(as, 0x81);
+    modrmReg(as, 0, reg);
+    emit32(as, (uint32_t) imm);
+}
+
+static inline void subImm (Assembler* as, int reg, int32_t imm) {
+    rex(as, true, 0, reg);
+    emit8(as, 0x81);
+    modrmReg(as, 5, reg);
+    emit32(as, (uint32_t) imm);
+}
+
+static inline void lea (Assembler* as, int dst, int base, int32_t disp) {
+    rex(as, true, dst, base);
+    emit8(as, 0x8d);
+    modrmMem(as, dst, base, disp);
+}
+
+// sse op with a memory operand, prefix 0 for none
+static inline void sse (Assembler* as, uint8_t prefix, uint8_t op, int xmm, int base, int32_t disp) {
+    if (prefix != 0) emit8(as, prefix);
+    rex(as, false, xmm, base);
+    emit8(as, 0x0f);
+    emit8(as, op);
+    modrmMem(as, xmm, base, disp);
+}
+
+#define MOVUPS_LOAD 0x10
+#define MOVUPS_STORE 0x11
+#define MOVSD_LOAD 0x10
+#define MOVSD_STORE 0x11
+#define ADDSD 0x58
+#define MULSD 0x59
+#define SUBSD 0x5c
+#define DIVSD 0x5e
+#define UCOMISD 0x2e
+
+// rax op qword [mem]
+#define INT_ADD 0x03
+#define INT_SUB 0x2b
+#define INT_CMP 0x3b
+#define INT_IMUL 0xaf // behind 0x0f
+
+static inline void intOp (Assembler* as, uint8_t op, int base, int32_t disp) {
+    rex(as, true, RAX, base);
+    if (op == INT_IMUL) emit8(as, 0x0f);
+    emit8(as, op);
+    modrmMem(as, RAX, base, disp);
+}
+
+static inline void cmpTag (Assembler* as, int base, int32_t disp, ValueType vtype) {
+    rex(as, false, 0, base);
+    emit8(as, 0x81);
+    modrmMem(as, 7, base, disp + TAG);
+    emit32(as, (uint32_t) vtype);
+}
+
+static inline void storeTag (Assembler* as, int base, int32_t disp, ValueType vtype) {
+    rex(as, false, 0, base);
+    emit8(as, 0xc7);
+    modrmMem(as, 0, base, disp + TAG);
+    emit32(as, (uint32_t) vtype);
+}
+
+static inline void storePayloadImm (Assembler* as, int base, int32_t disp, int32_t imm) {
+    rex(as, true, 0, base);
+    emit8(as, 0xc7);
+    modrmMem(as, 0, base, disp + PAYLOAD);
+    emit32(as, (uint32_t) imm);
+}
+
+// copy a whole Value through xmm0
+static inline void copyValue (Assembler* as, int dstBase, int32_t dst, int srcBase, int32_t src) {
+    sse(as, 0, MOVUPS_LOAD, 0, srcBase, src);
+    sse(as, 0, MOVUPS_STORE, 0, dstBase, dst);
+}
+
+static inline void callHelper (Assembler* as, void* helper) {
+    movImm64(as, RAX, (uint64_t)(uintptr_t) helper);
+    emit8(as, 0xff);
+    emit8(as, 0xd0); // call rax
+}
+
+static inline void testAl (Assembler* as) {
+    emit8(as, 0x84);
+    emit8(as, 0xc0);
+}
+
+// setcc al; movzx eax, al
+static inline void setccEax (Assembler* as, int cc) {
+    emit8(as, 0x0f);
+    emit8(as, 0x90 | cc);
+    emit8(as, 0xc0);
+    emit8(as, 0x0f);
+    emit8(as, 0xb6);
+    emit8(as, 0xc0);
+}
+
+// forward jump inside the current instruction, patched with patchHere
+static inline int jccForward (Assembler* as, int cc) {
+    emit8(as, 0x0f);
+    emit8(as, 0x80 | cc);
+    emit32(as, 0);
+    return as -> count - 4;
+}
+
+static inline int jmpForward (Assembler* as) {
+    emit8(as, 0xe9);
+    emit32(as, 0);
+    return as -> count - 4;
+}
+
+static inline void patchHere (Assembler* as, int at) {
+    uint32_t rel = (uint32_t)(as -> count - (at + 4));
+    memcpy(as -> code + at, &rel, 4);
+}
+
+static inline void addFixup (Assembler* as, int target) {
+    if (as -> fixupCapacity < as -> fixupCount + 1) {
+        as -> fixupCapacity = GROW_CAPACITY(as -> fixupCapacity);
+        as -> fixups = (JumpFixup*)realloc(as -> fixups, as -> fixupCapacity * sizeof(JumpFixup));
+        if (as -> fixups == NULL) exit(1);
+    }
+    as -> fixups[as -> fixupCount].offset = as -> count - 4;
+    as -> fixups[as -> fixupCount].target = target;
+    as -> fixupCount++;
+}
+
+// jump to the native code of a bytecode offset, cc -1 for unconditional
+static inline void jumpTo (Assembler* as, int cc, int target) {
+    if (cc < 0) {
+        emit8(as, 0xe9);
+    } else {
+        emit8(as, 0x0f);
+        emit8(as, 0x80 | cc);
+    }
+    emit32(as, 0);
+    addFixup(as, target);
+}
+
+// ========= Frame plumbing =========
+
+static inline void storeStackTop (Assembler* as) {
+    movImm64(as, RCX, (uint64_t)(uintptr_t) &vm.stackTop);
+    movStore(as, RCX, 0, STACK_TOP);
+}
+
+static inline void loadStackTop (Assembler* as) {
+    movImm64(as, RCX, (uint64_t)(uintptr_t) &vm.stackTop);
+    movLoad(as, STACK_TOP, RCX, 0);
+}
+
+static inline void emitPrologue (Assembler* as) {
+    emit8(as, 0x55); // push rbp
+    emit8(as, 0x53); // push rbx
+    emit8(as, 0x41); emit8(as, 0x54); // push r12
+    emit8(as, 0x41); emit8(as, 0x55); // push r13
+    emit8(as, 0x41); emit8(as, 0x56); // push r14
+    emit8(as, 0x41); emit8(as, 0x57); // push r15
+    emit8(as, 0x48); emit8(as, 0x83); emit8(as, 0xec); emit8(as, 0x08); // sub rsp, 8 - keep 16 byte alignment for helper calls
+
+    movReg(as, FRAME, RDI);
+    movLoad(as, SLOTS, FRAME, (int32_t) offsetof(CallFrame, slots));
+    loadStackTop(as);
+
+    emit8(as, 0xff); emit8(as, 0xe6); // jmp rsi
+}
+
+static inline void emitEpilogue (Assembler* as) {
+    emit8(as, 0x48); emit8(as, 0x83); emit8(as, 0xc4); emit8(as, 0x08); // add rsp, 8
+    emit8(as, 0x41); emit8(as, 0x5f); // pop r15
+    emit8(as, 0x41); emit8(as, 0x5e); // pop r14
+    emit8(as, 0x41); emit8(as, 0x5d); // pop r13
+    emit8(as, 0x41); emit8(as, 0x5c); // pop r12
+    emit8(as, 0x5b); // pop rbx
+    emit8(as, 0x5d); // pop rbp
+    emit8(as, 0xc3); // ret
+}
+
+// hand the instruction at ip back to the interpreter
+static inline void emitExit (Assembler* as, uint8_t* ip) {
+    movImm64(as, RAX, (uint64_t)(uintptr_t) ip);
+    movStore(as, FRAME, (int32_t) offsetof(CallFrame, ip), RAX);
+    storeStackTop(as);
+    emitEpilogue(as);
+}
+
+// back edges: exit at ip, where run's governor takes over, when vm.fuel is
+// 0, else burn one
+static inline void emitFuel (Assembler* as, uint8_t* ip) {
+    movImm64(as, RAX, (uint64_t)(uintptr_t) &vm.fuel);
+    rex(as, true, 0, RAX);
+    emit8(as, 0x83);
+    modrmMem(as, 7, RAX, 0);
+    emit8(as, 0); // cmp qword [rax], 0
+    int left = jccForward(as, CC_NE);
+    emitExit(as, ip);
+    patchHere(as, left);
+    rex(as, true, 0, RAX);
+    emit8(as, 0x83);
+    modrmMem(as, 5, RAX, 0);
+    emit8(as, 1); // sub qword [rax], 1
+}
+
+// call a helper that works on vm.stackTop, exit at ip when it returns false
+static inline void emitStackHelper (Assembler* as, void* helper, bool canFail, uint8_t* ip) {
+    storeStackTop(as);
+    callHelper(as, helper);
+    loadStackTop(as);
+
+    if (canFail) {
+        testAl(as);
+        int done = jccForward(as, CC_NE);
+        emitExit(as, ip);
+        patchHere(as, done);
+    }
+}
+
+// ========= Value templates =========
+
+// exit at ip unless the value at [base + disp] has the given type
+static inline void guardTag (Assembler* as, int base, int32_t disp, ValueType vtype, uint8_t* ip) {
+    cmpTag(as, base, disp, vtype);
+    int ok = jccForward(as, CC_E);
+    emitExit(as, ip);
+    patchHere(as, ok);
+}
+
+// second = second op top, both already known to be numbers
+static inline void emitNumberOp (Assembler* as, uint8_t op) {
+    sse(as, 0xf2, MOVSD_LOAD, 0, STACK_TOP, SLOT(2) + PAYLOAD);
+    sse(as, 0xf2, op, 0, STACK_TOP, SLOT(1) + PAYLOAD);
+    sse(as, 0xf2, MOVSD_STORE, 0, STACK_TOP, SLOT(2) + PAYLOAD);
+    subImm(as, STACK_TOP, VALUE_SIZE);
+}
+
+static inline void emitNumberCompare (Assembler* as, bool greater) {
+    // 'a > b' and 'b > a' both through seta so NaN compares false
+    if (greater) {
+        sse(as, 0xf2, MOVSD_LOAD, 0, STACK_TOP, SLOT(2) + PAYLOAD);
+        sse(as, 0x66, UCOMISD, 0, STACK_TOP, SLOT(1) + PAYLOAD);
+    } else {
+        sse(as, 0xf2, MOVSD_LOAD, 0, STACK_TOP, SLOT(1) + PAYLOAD);
+        sse(as, 0x66, UCOMISD, 0, STACK_TOP, SLOT(2) + PAYLOAD);
+    }
+    setccEax(as, CC_A);
+    storeTag(as, STACK_TOP, SLOT(2), VAL_BOOL);
+    movStore(as, STACK_TOP, SLOT(2) + PAYLOAD, RAX);
+    subImm(as, STACK_TOP, VALUE_SIZE);
+}
+
+// second = second op top, both already known to be ints, wrapping like numericOp
+static inline void emitIntOp (Assembler* as, uint8_t op) {
+    movLoad(as, RAX, STACK_TOP, SLOT(2) + PAYLOAD);
+    intOp(as, op, STACK_TOP, SLOT(1) + PAYLOAD);
+    movStore(as, STACK_TOP, SLOT(2) + PAYLOAD, RAX);
+    subImm(as, STACK_TOP, VALUE_SIZE);
+}
+
+static inline void emitIntCompare (Assembler* as, bool greater) {
+    movLoad(as, RAX, STACK_TOP, SLOT(2) + PAYLOAD);
+    intOp(as, INT_CMP, STACK_TOP, SLOT(1) + PAYLOAD);
+    setccEax(as, greater ? CC_G : CC_L);
+    storeTag(as, STACK_TOP, SLOT(2), VAL_BOOL);
+    movStore(as, STACK_TOP, SLOT(2) + PAYLOAD, RAX);
+    subImm(as, STACK_TOP, VALUE_SIZE);
+}
+
+static inline void emitIntNegate (Assembler* as) {
+    // neg qword [r12 - 8]
+    rex(as, true, 0, STACK_TOP);
+    emit8(as, 0xf7);
+    modrmMem(as, 3, STACK_TOP, SLOT(1) + PAYLOAD);
+}
+
+static inline void emitNegate (Assembler* as) {
+    // btc qword [r12 - 8], 63 flips the sign bit
+    rex(as, true, 0, STACK_TOP);
+    emit8(as, 0x0f);
+    emit8(as, 0xba);
+    modrmMem(as, 7, STACK_TOP, SLOT(1) + PAYLOAD);
+    emit8(as, 63);
+}
+
+static inline void emitUpvalueLocation (Assembler* as, int slot) {
+    movLoad(as, RAX, FRAME, (int32_t) offsetof(CallFrame, closure));
+    movLoad(as, RAX, RAX, (int32_t) offsetof(ObjClosure, upvalues));
+    movLoad(as, RAX, RAX, (int32_t)(slot * sizeof(ObjUpvalue*)));
+    movLoad(as, RAX, RAX, (int32_t) offsetof(ObjUpvalue, location));
+}
+
+// the write barriers of the upvalue run before the store
+static inline void emitSetUpvalue (Assembler* as, int slot) {
+    movLoad(as, RAX, FRAME, (int32_t) offsetof(CallFrame, closure));
+    movLoad(as, RAX, RAX, (int32_t) offsetof(ObjClosure, upvalues));
+    movLoad(as, RDI, RAX, (int32_t)(slot * sizeof(ObjUpvalue*)));
+    callHelper(as, (void*) jitWriteBarrier);
+    emitUpvalueLocation(as, slot);
+    copyValue(as, RAX, 0, STACK_TOP, SLOT(1));
+}
+
+static inline void emitNot (Assembler* as) {
+    lea(as, RDI, STACK_TOP, SLOT(1));
+    callHelper(as, (void*) jitFalsey);
+    emit8(as, 0x0f); emit8(as, 0xb6); emit8(as, 0xc0); // movzx eax, al
+    storeTag(as, STACK_TOP, SLOT(1), VAL_BOOL);
+    movStore(as, STACK_TOP, SLOT(1) + PAYLOAD, RAX);
+}
+
+// register instruction at ip with operands (dst, a, b): push copies for the
+// stack templates; constant is the constant b for the _RK forms, NULL when
+// b is a slot
+static inline void loadRegisterOperands (Assembler* as, uint8_t* ip, Value* constant) {
+    if (constant == NULL) {
+        copyValue(as, STACK_TOP, VALUE_SIZE, SLOTS, ip[3] * VALUE_SIZE);
+    } else {
+        movImm64(as, RAX, (uint64_t)(uintptr_t) constant);
+        copyValue(as, STACK_TOP, VALUE_SIZE, RAX, 0);
+    }
+    copyValue(as, STACK_TOP, 0, SLOTS, ip[2] * VALUE_SIZE);
+    addImm(as, STACK_TOP, 2 * VALUE_SIZE);
+}
+
+static inline void storeRegisterResult (Assembler* as, uint8_t dst) {
+    if (dst == REG_STACK) return;
+    copyValue(as, SLOTS, dst * VALUE_SIZE, STACK_TOP, SLOT(1));
+    subImm(as, STACK_TOP, VALUE_SIZE);
+}
+
+// jcc to patch when the register operand in slot isn't of vtype
+static inline int registerOperandMiss (Assembler* as, uint8_t slot, ValueType vtype) {
+    cmpTag(as, SLOTS, slot * VALUE_SIZE, vtype);
+    return jccForward(as, CC_NE);
+}
+
+// the stack template behind a register opcode for operands of vtype
+static inline void emitTypedRegisterOp (Assembler* as, uint8_t* ip, Value* constant, ValueType vtype) {
+    loadRegisterOperands(as, ip, constant);
+    bool ints = vtype == VAL_INT;
+    switch (*ip) {
+        case OP_ADD_RR: case OP_ADD_RK:
+            if (ints) emitIntOp(as, INT_ADD); else emitNumberOp(as, ADDSD);
+            break;
+        case OP_SUBTRACT_RR: case OP_SUBTRACT_RK:
+            if (ints) emitIntOp(as, INT_SUB); else emitNumberOp(as, SUBSD);
+            break;
+        case OP_MULTIPLY_RR: case OP_MULTIPLY_RK:
+            if (ints) emitIntOp(as, INT_IMUL); else emitNumberOp(as, MULSD);
+            break;
+        case OP_DIVIDE_RR: case OP_DIVIDE_RK: emitNumberOp(as, DIVSD); break;
+        case OP_GREATER_RR: case OP_GREATER_RK:
+            if (ints) emitIntCompare(as, true); else emitNumberCompare(as, true);
+            break;
+        default:
+            if (ints) emitIntCompare(as, false); else emitNumberCompare(as, false);
+            break;
+    }
+    storeRegisterResult(as, ip[1]);
+}
+
+// two doubles or two ints (but no int division) inline, anything else exits
+// at ip before touching the stack
+static inline void emitRegisterOp (Assembler* as, uint8_t* ip, Value* constant) {
+    bool divide = *ip == OP_DIVIDE_RR || *ip == OP_DIVIDE_RK;
+    ValueType types[2] = {VAL_NUMBER, VAL_INT};
+    int done[2];
+    int doneCount = 0;
+
+    for (int i = 0; i < 2; i++) {
+        ValueType vtype = types[i];
+        if (vtype == VAL_INT && divide) continue;
+        if (constant != NULL && constant -> vtype != vtype) continue;
+
+        int missA = registerOperandMiss(as, ip[2], vtype);
+        int missB = constant == NULL ? registerOperandMiss(as, ip[3], vtype) : -1;
+        emitTypedRegisterOp(as, ip, constant, vtype);
+        done[doneCount++] = jmpForward(as);
+        patchHere(as, missA);
+        if (missB >= 0) patchHere(as, missB);
+    }
+
+    emitExit(as, ip);
+    for (int i = 0; i < doneCount; i++) patchHere(as, done[i]);
+}
+
+static inline void initAssembler (Assembler* as) {
+    as -> code = NULL;
+    as -> count = 0;
+    as -> capacity = 0;
+    as -> fixups = NULL;
+    as -> fixupCount = 0;
+    as -> fixupCapacity = 0;
+}
+
+static inline void freeAssembler (Assembler* as) {
+    free(as -> code);
+    free(as -> fixups);
+    initAssembler(as);
+}
+
+// copy the assembled code into a fresh executable mapping, NULL on failure
+static inline uint8_t* finishCode (Assembler* as, size_t* size) {
+    long pageSize = sysconf(_SC_PAGESIZE);
+    *size = ((size_t) as -> count + pageSize - 1) / pageSize * pageSize;
+
+    uint8_t* code = (uint8_t*)mmap(NULL, *size, PROT_READ | PROT_WRITE,
+                                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) return NULL;
+
+    memcpy(code, as -> code, as -> count);
+
+    if (mprotect(code, *size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(code, *size);
+        return NULL;
+    }
+    return code;
+}
+
+#endif
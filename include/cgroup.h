@@ -0,0 +1,19 @@
+#ifndef clox_cgroup_h
+#define clox_cgroup_h
+
+#include "common.h"
+
+// the memory limit of the control group the process runs in (a container),
+// or of the tightest group above it, read from cgroup v2 files (memory.max,
+// memory.current, memory.pressure) or the v1 memory controller's
+
+typedef struct {
+    size_t limit; // bytes the group with the least room left may use
+    size_t usage; // bytes it uses now, this process and everything else in it
+    double pressure; // % of the last 10 seconds tasks stalled on memory, 0 without PSI
+} MemoryStatus;
+
+// false outside a group with a memory limit
+bool readMemoryStatus (MemoryStatus* status);
+
+#endif
@@ -32,6 +32,46 @@ typedef enum {
     OP_SUBTRACT,
     OP_MULTIPLY,
     OP_DIVIDE,
+    OP_MODULO,
+
+    // integers only
+    OP_BIT_AND,
+    OP_BIT_OR,
+    OP_BIT_XOR,
+    OP_SHIFT_LEFT,
+    OP_SHIFT_RIGHT,
+
+    // unchecked numeric ops - emitted only when both operands are known
+    // to be numbers through 'num' annotations
+    OP_ADD_NUM,
+    OP_SUBTRACT_NUM,
+    OP_MULTIPLY_NUM,
+    OP_DIVIDE_NUM,
+    OP_NEGATE_NUM,
+    OP_GREATER_NUM,
+    OP_LESS_NUM,
+
+    // type guards at annotation boundaries
+    OP_CHECK_NUM, // top of the stack
+    OP_CHECK_NUM_LOCAL, // takes as operand one byte: the local slot
+
+    // register instructions - three-address forms reading the frame slots
+    // directly, only emitted when compiling register code
+    // operands: dst slot (REG_STACK to push), slot a, slot / constant b
+    OP_ADD_RR,
+    OP_SUBTRACT_RR,
+    OP_MULTIPLY_RR,
+    OP_DIVIDE_RR,
+    OP_GREATER_RR,
+    OP_LESS_RR,
+    OP_ADD_RK,
+    OP_SUBTRACT_RK,
+    OP_MULTIPLY_RK,
+    OP_DIVIDE_RK,
+    OP_GREATER_RK,
+    OP_LESS_RK,
+    OP_MOVE, // dst slot, src slot
+    OP_LOAD_CONSTANT, // dst slot, constant
 
     // TODO: Add support for
     OP_CONSTANT_LONG,
@@ -75,21 +115,55 @@ typedef enum {
     // optimalisations
     OP_INVOKE,
     OP_SUPER_INVOKE,
+    OP_INTRINSIC, // name constant, nr of arguments, Intrinsic
+
+    // exceptions
+    OP_THROW,
+
+    // pushes the slot of a region block, which is closed like a captured local
+    OP_REGION,
 
 } OpCode;
 
+// dst operand of a register instruction that leaves its result on the stack
+#define REG_STACK UINT8_MAX
+
+// a try block covers the code in [start, end), an exception thrown in there
+// resets the frame to stackDepth slots, pushes the exception and jumps to
+// handler; entering the block costs nothing at run time
+typedef struct {
+    int start;
+    int end;
+    int handler;
+    int stackDepth;
+} ExceptionHandler;
+
 typedef struct {
     int count;
     int capacity;
     uint8_t* code;
     int* lines;
     ValueArray constants;
+
+    // innermost try blocks first
+    ExceptionHandler* handlers;
+    int handlerCount;
+    int handlerCapacity;
+
+    // while compiling the arrays grow in the compiler's arena, finishChunk
+    // moves them to the heap
+    struct Arena* arena;
 } Chunk;
 
 void initChunk (Chunk* chunk);
 void writeChunk (Chunk* chunk, uint8_t byte, int line);
 void freeChunk (Chunk* chunk);
+void finishChunk (Chunk* chunk);
+
+// the opcode's byte and its operands
+int instructionLength (Chunk* chunk, int offset);
 
 int addConstant (Chunk* chunk, Value value);
+void addHandler (Chunk* chunk, ExceptionHandler handler);
 
 #endif
@@ -9,6 +9,30 @@
 // #define DEBUG_TRACE_EXECUTION
 // #define DEBUG_PRINT_CODE
 
+// compile to register instructions by default (--registers at run time)
+// #define REGISTER_CODE
+
+// mark on a background thread by default (--concurrent-gc at run time)
+// #define CONCURRENT_GC
+
+// mark full collections with this many threads by default (--gc-threads N at run time)
+// #define GC_THREADS 4
+
+// references between objects as 32-bit offsets into a 4GB heap cage (build
+// time only, it changes the object layout)
+// #define COMPRESSED_REFS
+
+// evacuate sparse heap pages once the heap gets fragmented by default (--compact at run time)
+// #define GC_COMPACT
+
+// resource limits by default (--heap-limit MB and --fuel N at run time): a
+// ceiling on the heap in bytes, and how many back edges and calls run takes
+// #define HEAP_LIMIT (256 * 1024 * 1024)
+// #define FUEL 100000000
+
+// count every allocation by instruction and line by default (--alloc-trace at run time)
+// #define ALLOC_TRACE
+
 // #define DEBUG_STRESS_GC
 // #define DEBUG_LOG_GC
 //
@@ -5,5 +5,6 @@
 
 void disassembleChunk (Chunk* chunk, const char* name);
 int disassembleInstruction (Chunk* chink, int offset);
+const char* opcodeName (uint8_t opcode);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,125 @@
+#ifndef clox_heap_h
+#define clox_heap_h
+
+#include "common.h"
+
+// objects live in cells carved out of aligned pages, one cell size per page,
+// the collector's bits (mark, old, scan state) are bitmaps in the page header
+// with a bit per granule: an object's page is its address rounded down, and
+// collecting never writes into the objects themselves
+
+#define HEAP_PAGE_SIZE (64 * 1024)
+#ifdef COMPRESSED_REFS
+#define HEAP_GRANULE 8 // objects are 8 bytes smaller, rounding to 16 would undo it
+#else
+#define HEAP_GRANULE 16
+#endif
+#define HEAP_MAX_CELL 512 // bigger objects get a page of their own
+#define HEAP_CLASSES (HEAP_MAX_CELL / HEAP_GRANULE)
+#define HEAP_BITMAP_WORDS (HEAP_PAGE_SIZE / HEAP_GRANULE / 64)
+// blocks (what reallocate hands out) above HEAP_MAX_CELL double up to this
+#define HEAP_MAX_BLOCK (16 * 1024)
+#define HEAP_BLOCK_CLASSES (HEAP_CLASSES + 5)
+
+typedef struct HeapPage {
+    struct HeapPage* prev; // heap.pages
+    struct HeapPage* next;
+    struct HeapPage* nextAvailable; // heap.available
+    struct HeapPage* nextYoung; // heap.young
+    struct HeapPage* nextUnswept; // heap.unswept
+
+    size_t size;
+    size_t cellSize;
+    bool isAvailable;
+    bool hasYoung; // allocated into since its last sweep
+    bool isEvacuating; // compaction is moving its objects out
+    bool isRegion; // taken by a region, only regions allocate into it
+
+    void* freeCells; // linked through their first word
+    char* bump; // cells from here to end were never used
+    char* end;
+
+    uint64_t live[HEAP_BITMAP_WORDS]; // first granule of every allocated cell
+    uint64_t marks[HEAP_BITMAP_WORDS];
+    uint64_t old[HEAP_BITMAP_WORDS]; // survived a collection
+    uint64_t scanClaimed[HEAP_BITMAP_WORDS]; // concurrent marking: SCAN_BUSY or SCAN_DONE
+    uint64_t scanDone[HEAP_BITMAP_WORDS];
+} HeapPage;
+
+typedef struct {
+    HeapPage* pages; // all of them
+    HeapPage* available[HEAP_CLASSES]; // pages with free cells, by cell size
+    HeapPage* young; // pages allocated into since the last minor collection
+    HeapPage* unswept; // pages the last cycle has yet to sweep
+    struct BlockPage* blocks[HEAP_BLOCK_CLASSES]; // block pages with free cells, by size class
+    bool inRegion; // allocations go to region pages
+    HeapPage* regionAvailable[HEAP_CLASSES]; // region pages with free cells, by cell size
+#ifdef COMPRESSED_REFS
+    char* cage; // where every page is, 4GB aligned to its size
+#endif
+} Heap;
+
+extern Heap heap;
+
+// what an allocation of size takes up
+static inline size_t heapCellSize (size_t size) {
+    return (size + HEAP_GRANULE - 1) & ~(size_t)(HEAP_GRANULE - 1);
+}
+
+#ifdef COMPRESSED_REFS
+// a reference is the offset of the object in the cage, the low half of its
+// address; no object is at offset 0, which stays the null reference
+static inline uint32_t compressRef (void* obj) {
+    return (uint32_t)(uintptr_t) obj;
+}
+
+static inline void* expandRef (uint32_t ref) {
+    return ref == 0 ? NULL : heap.cage + ref;
+}
+#endif
+
+// a cell of heapCellSize(size) bytes, uninitialized
+void* heapAllocate (size_t size);
+void heapFreeCell (HeapPage* page, void* cell);
+// puts a page with free cells back on its class's list, or gives an empty one back
+void heapPageSwept (HeapPage* page);
+void heapReleasePage (HeapPage* page);
+// cells the page holds when full
+int heapPageCapacity (HeapPage* page);
+
+// while a region is open allocations go to pages of their own, what a
+// request leaves behind never shares a page with what lives on outside it;
+// the region pages a closed region allocated into wait for their sweep
+void heapOpenRegion ();
+void heapCloseRegion ();
+
+// realloc for everything else, a block's page knows its size
+void* heapReallocate (void* pointer, size_t oldSize, size_t newSize);
+
+static inline HeapPage* pageOf (const void* cell) {
+    return (HeapPage*)((uintptr_t) cell & ~(uintptr_t)(HEAP_PAGE_SIZE - 1));
+}
+
+static inline size_t granuleOf (const void* cell) {
+    return ((uintptr_t) cell & (HEAP_PAGE_SIZE - 1)) / HEAP_GRANULE;
+}
+
+static inline void* cellAt (HeapPage* page, int word, int bit) {
+    return (char*) page + ((size_t) word * 64 + bit) * HEAP_GRANULE;
+}
+
+#define HEAP_WORD(bitmap, cell) (&pageOf(cell)->bitmap[granuleOf(cell) / 64])
+#define HEAP_BIT(cell) ((uint64_t) 1 << (granuleOf(cell) % 64))
+
+// marks and scan bits are shared with the marker threads
+
+static inline bool heapTest (uint64_t* word, uint64_t bit) {
+    return (__atomic_load_n(word, __ATOMIC_ACQUIRE) & bit) != 0;
+}
+
+// true if it was set already
+static inline bool heapSet (uint64_t* word, uint64_t bit) {
+    return (__atomic_fetch_or(word, bit, __ATOMIC_ACQ_REL) & bit) != 0;
+}
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef clox_intrinsics_h
+#define clox_intrinsics_h
+
+#include <math.h>
+
+#include "common.h"
+#include "object.h"
+
+// math builtins: plain natives in vm.globals, but a call through the global
+// of the same name compiles to OP_INTRINSIC which skips the global lookup
+// and the native call as long as the global still holds the builtin
+typedef enum {
+    INTRINSIC_SQRT,
+    INTRINSIC_ABS,
+    INTRINSIC_FLOOR,
+    INTRINSIC_CEIL,
+    INTRINSIC_ROUND,
+    INTRINSIC_SIN,
+    INTRINSIC_COS,
+    INTRINSIC_TAN,
+    INTRINSIC_ATAN,
+    INTRINSIC_EXP,
+    INTRINSIC_LOG,
+    INTRINSIC_MIN,
+    INTRINSIC_MAX,
+    INTRINSIC_POW,
+    INTRINSIC_ATAN2,
+    INTRINSIC_COUNT,
+} Intrinsic;
+
+// ObjString.intrinsic of names that aren't builtins
+#define NO_INTRINSIC INTRINSIC_COUNT
+
+typedef struct {
+    const char* name;
+    int arity;
+    NativeFn native; // for calls that don't go through OP_INTRINSIC
+} IntrinsicInfo;
+
+extern const IntrinsicInfo intrinsics[INTRINSIC_COUNT];
+
+// the builtin called name, -1 when there is none
+int findIntrinsic (const char* name, int length);
+
+// b is ignored by the one argument builtins
+static inline double applyIntrinsic (uint8_t id, double a, double b) {
+    switch (id) {
+        case INTRINSIC_SQRT: return sqrt(a);
+        case INTRINSIC_ABS: return fabs(a);
+        case INTRINSIC_FLOOR: return floor(a);
+        case INTRINSIC_CEIL: return ceil(a);
+        case INTRINSIC_ROUND: return round(a);
+        case INTRINSIC_SIN: return sin(a);
+        case INTRINSIC_COS: return cos(a);
+        case INTRINSIC_TAN: return tan(a);
+        case INTRINSIC_ATAN: return atan(a);
+        case INTRINSIC_EXP: return exp(a);
+        case INTRINSIC_LOG: return log(a);
+        case INTRINSIC_MIN: return a < b ? a : b;
+        case INTRINSIC_MAX: return a > b ? a : b;
+        case INTRINSIC_POW: return pow(a, b);
+        default: return atan2(a, b);
+    }
+}
+
+#endif
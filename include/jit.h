@@ -0,0 +1,52 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "common.h"
+#include "object.h"
+
+// baseline template jit: a hot function is translated opcode by opcode into
+// x86-64 code, the interpreter stays in charge of calls and returns
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define JIT_SUPPORTED
+#endif
+
+// number of calls before a function gets compiled
+#define JIT_HOT_CALLS 100
+
+// hotness value of functions the jit gave up on
+#define JIT_NEVER -1
+
+struct CallFrame;
+
+typedef void (*JitEntry) (struct CallFrame* frame, uint8_t* target);
+
+typedef struct JitCode {
+    uint8_t* code; // executable mapping
+    size_t size;
+    uint32_t* pcMap; // native offset for every bytecode offset
+} JitCode;
+
+bool jitAvailable ();
+
+// runs the native code of the frame's function from frame->ip (compiling it
+// once it gets hot), returns with ip and vm.stackTop synced at the first
+// instruction the interpreter has to take over
+void jitRun (struct CallFrame* frame);
+
+void freeJitCode (JitCode* jit);
+
+// runtime helpers called from native code, they work on vm.stackTop and
+// return false when the interpreter has to take over the instruction
+bool jitFalsey (Value* value);
+void jitWriteBarrier (Obj* obj);
+bool jitArithmetic (uint8_t op);
+void jitEqual ();
+void jitPrint ();
+void jitDefineGlobal (Value* name);
+bool jitGetGlobal (Value* name);
+bool jitSetGlobal (Value* name);
+bool jitGetProperty (Value* name);
+bool jitSetProperty (Value* name);
+bool jitIntrinsic (uint8_t* ip);
+
+#endif
@@ -1,7 +1,10 @@
 #ifndef clox_memory_h 
 #define clox_memory_h
 
+#include <stdio.h>
+
 #include "common.h"
+#include "heap.h"
 #include "object.h"
 
 #define ALLOCATE(type, count) \
@@ -28,10 +31,108 @@
 #endif
 
 void* reallocate (void* pointer, size_t oldSize, size_t newSize);
+// memory for an object, counted and collected for like reallocate
+Obj* allocateCell (size_t size);
 void freeObjects();
 
 void collectGarbage();
+void collectNursery();
+// gc work for hosts to run while idle, marks or sweeps for at most budget
+// seconds (the final pause of a cycle excepted), true while a cycle is still
+// unfinished
+bool collectIdle (double budget);
 void markValue (Value value);
 void markObject (Obj* obj);
+void rememberObject (Obj* obj);
+
+// request-scoped allocation: what is allocated between enterRegion and
+// exitRegion goes to region pages, which nothing else is allocated into, and
+// exitRegion runs a minor collection right away, the objects still reached from outside survive it (old from
+// then on) and the pages nothing survived on go back whole; regions nest,
+// the outermost exit collects
+void enterRegion ();
+void exitRegion ();
+// weak refs and weak maps, from their constructors
+void registerWeak (Obj* obj);
+
+// moves the objects of sparse pages into dense ones when the last sweep
+// found the heap fragmented (vm.gcCompactPending); only called where no C
+// code holds pointers into the heap: between instructions or with the vm idle
+void compactHeap ();
+
+// ========= Statistics =========
+
+#define GC_PAUSE_BUCKETS 16
+#define GC_HISTORY 32 // nextGC values kept
+
+// counted all the time, read through gcStat or vm.gcStats
+typedef struct {
+    uint64_t minorCollections;
+    uint64_t fullCollections;
+    uint64_t compactions;
+    uint64_t regions; // exited
+
+    // pauses (collections, the two ends of a cycle, compactions): bucket i
+    // counts the ones under 2^i microseconds, the last bucket the longer ones
+    uint64_t pauses[GC_PAUSE_BUCKETS];
+    double pauseTotal; // seconds
+    double pauseMax;
+
+    // object cells by ObjType, what they own is not included
+    uint64_t objectsAllocated[OBJ_TYPE_COUNT];
+    uint64_t objectsFreed[OBJ_TYPE_COUNT];
+    uint64_t bytesAllocated[OBJ_TYPE_COUNT];
+    uint64_t bytesFreed[OBJ_TYPE_COUNT];
+    uint64_t blockBytes; // what reallocate grew blocks by, owned by objects
+
+    // every value nextGC was set to, the last GC_HISTORY of them
+    size_t nextGCHistory[GC_HISTORY];
+    uint64_t nextGCCount;
+} GcStats;
+
+// a counter by name, false for an unknown one: minorCollections, fullCollections,
+// compactions, regions, pauses, pauseTotal, pauseMax, heapBytes, nextGC, strings, live,
+// and "live <type>", "allocated <type>", "freed <type>" with a type like instance;
+// heapGrowth is what a collection now would let the heap grow by, memoryLimit,
+// memoryUsage and memoryPressure the cgroup's, 0 outside a limited one
+bool gcStat (const char* name, double* value);
+void printGcStats (FILE* out);
+// "string", "instance", ... by ObjType
+const char* gcTypeName (int otype);
+void recordNextGC ();
+
+// most threads --gc-threads takes
+#define GC_MAX_THREADS 16
+
+static inline bool isMarked (Obj* obj) {
+    return heapTest(HEAP_WORD(marks, obj), HEAP_BIT(obj));
+}
+
+static inline bool isOld (Obj* obj) {
+    return (*HEAP_WORD(old, obj) & HEAP_BIT(obj)) != 0;
+}
+
+// scans obj unless the marker thread already did (or waits for it to finish)
+void claimObject (Obj* obj);
+
+// every store of a reference into an existing object goes through this,
+// an old object pointing at young ones is a root of the next minor collection
+// and an object already marked by the current cycle gets rescanned at its end
+// (marks are only ever set outside a collection while a cycle is running)
+static inline void writeBarrier (Obj* obj) {
+    if (!obj->isRemembered && (isOld(obj) || isMarked(obj))) {
+        rememberObject(obj);
+    }
+}
+
+// where compaction moved obj, obj itself unless its page is being evacuated
+static inline Obj* forwardObject (Obj* obj) {
+    if (obj == NULL || !pageOf(obj)->isEvacuating) return obj;
+    return *(Obj**) obj; // left in the old cell
+}
+
+static inline void forwardValue (Value* value) {
+    if (IS_OBJ(*value)) value->as.obj = forwardObject(AS_OBJ(*value));
+}
 
 #endif
\ No newline at end of file
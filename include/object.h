@@ -4,9 +4,11 @@
 #include "common.h"
 #include "chunk.h"
 #include "hashmap.h"
+#include "heap.h"
 #include "value.h"
 
 #include <stdbool.h>
+#include <stddef.h>
 
 #define OBJ_TYPE(value) (AS_OBJ(value) -> otype)
 
@@ -18,6 +20,8 @@
 #define IS_CLASS(value) isObjType(value, OBJ_CLASS)
 #define IS_INSTANCE(value) isObjType(value, OBJ_INSTANCE)
 #define IS_BOUNDMETHOD(value) isObjType(value, OBJ_BOUND_METHOD)
+#define IS_WEAK_REF(value) isObjType(value, OBJ_WEAK_REF)
+#define IS_WEAK_MAP(value) isObjType(value, OBJ_WEAK_MAP)
 
 #define AS_STRING(value) ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString*)AS_OBJ(value)) -> chars)
@@ -35,6 +39,9 @@
 #define AS_INSTANCE(value) ((ObjInstance*) AS_OBJ(value))
 
 #define AS_BOUNDMETHOD(value) ((ObjBoundMethod*) AS_OBJ(value))
+
+#define AS_WEAK_REF(value) ((ObjWeakRef*) AS_OBJ(value))
+#define AS_WEAK_MAP(value) ((ObjWeakMap*) AS_OBJ(value))
 typedef enum {
     OBJ_STRING,
     OBJ_FUNCTION,
@@ -44,61 +51,118 @@ typedef enum {
     OBJ_CLASS,
     OBJ_INSTANCE,
     OBJ_BOUND_METHOD,
+    OBJ_WEAK_REF,
+    OBJ_WEAK_MAP,
 } ObjType;
 
+#define OBJ_TYPE_COUNT (OBJ_WEAK_MAP + 1)
+
+// the gc's bits are kept by the object's heap page
 struct Obj {
-    ObjType otype;
-    bool isMarked;
-    struct Obj* next; // linked list for the vm to clean up
+    uint8_t otype; // ObjType
+    bool isRemembered; // in vm.remembered
 };
 
+// a reference from one object to another, kept right after the header:
+// with COMPRESSED_REFS (common.h) the 32-bit offset into the heap cage,
+// filling the header's padding, a plain pointer otherwise
+#ifdef COMPRESSED_REFS
+typedef uint32_t ObjRef;
+#define REF(obj) compressRef(obj)
+#define DEREF(type, ref) ((type*) expandRef(ref))
+#else
+typedef Obj* ObjRef;
+#define REF(obj) ((Obj*)(obj))
+#define DEREF(type, ref) ((type*)(ref))
+#endif
+
 struct ObjString {
     Obj obj;
     int length;
-    char* chars;
+    char* chars; // inlineChars unless the string is too long for a cell
     uint32_t hash;
+    uint8_t intrinsic; // NO_INTRINSIC unless the string names a math builtin
+    char inlineChars[];
 };
 
+// longer chars would make the cell too big for a size class, they get a
+// block of their own instead
+#define MAX_INLINE_STRING ((int)(HEAP_MAX_CELL - offsetof(ObjString, inlineChars)) - 1)
+
 typedef struct ObjUpvalue {
     Obj obj;
+    ObjRef next; // ObjUpvalue, the next open one
     Value* location;
     Value closed;
-    struct ObjUpvalue* next;
 } ObjUpvalue;
 
+struct JitCode;
+struct CallFrame;
+
+// body of a function translated ahead of time to C, false after a runtime error
+typedef bool (*AotFn) (struct CallFrame* frame);
+
 typedef struct {
     Obj obj;
+    ObjRef name; // ObjString
     int arity;
     int upValuesCount;
     Chunk chunk;
-    ObjString* name;
+
+    int hotness; // calls seen by the jit, JIT_NEVER once it gave up
+    struct JitCode* jit;
+    struct Trace* traces; // compiled hot loops of this function
+    AotFn aot; // set only inside a binary built from --emit-c output
 } ObjFunction;
 
 typedef struct {
     Obj obj;
-    ObjFunction* rawFunc;
+    ObjRef rawFunc; // ObjFunction
     ObjUpvalue** upvalues;
     int upvalueCount;
 } ObjClosure;
 
 typedef struct {
     Obj obj;
-    ObjString* name;
+    ObjRef name; // ObjString
     HashMap methods;
 } ObjClass;
 
 typedef struct {
     Obj obj;
-    ObjClass* clas;
+    ObjRef clas; // ObjClass
     HashMap fields;
 } ObjInstance;
 
 typedef struct {
     Obj obj;
+    ObjRef method; // ObjClosure
     Value receiver;
-    ObjClosure* method;
 } ObjBoundMethod;
 
+// weak objects don't keep what they point at alive, a collection clears
+// the references to what it found dead (see "Weak references" in memory.c)
+typedef struct {
+    Obj obj;
+    ObjRef target; // NULL once it died
+} ObjWeakRef;
+
+// NULL key: empty, with a true value a tombstone
+typedef struct {
+    Obj* key;
+    Value value;
+} WeakEntry;
+
+// an ephemeron table: keys are objects compared by identity, an entry's
+// value is only kept alive while its key is
+typedef struct {
+    Obj obj;
+    bool isStale; // compaction moved keys, rehashed before the next lookup
+    int count; // entries and tombstones
+    int capacity;
+    WeakEntry* entries;
+} ObjWeakMap;
+
 typedef Value (*NativeFn) (int argCount, Value* args);
 
 typedef struct {
@@ -112,7 +176,9 @@ static inline bool isObjType(Value value, ObjType otype) {
 }
 
 ObjString* copyString(const char* chars, int lenght);
-ObjString* takeString(char* chars, int lenght);
+// a string of length with its chars to fill in, takeString interns it
+ObjString* allocateString(int length);
+ObjString* takeString(ObjString* string);
 
 ObjFunction* newFunction();
 ObjNativeFn* newNative(int arity, NativeFn cfunc);
@@ -125,6 +191,9 @@ ObjInstance* newInstance (ObjClass* clas);
 
 ObjBoundMethod* newBoundMethod (Value receiver, ObjClosure* method);
 
+ObjWeakRef* newWeakRef (Obj* target);
+ObjWeakMap* newWeakMap ();
+
 void printObject(Value value);
 
 #endif
@@ -7,12 +7,14 @@ typedef enum {
     TOKEN_LEFT_BRACE, TOKEN_RIGHT_BRACE,
     TOKEN_COMMA, TOKEN_DOT, TOKEN_COLON, TOKEN_QUESTION_MARK, TOKEN_MINUS, TOKEN_PLUS, 
     TOKEN_SEMICOLON, TOKEN_SLASH, TOKEN_STAR,
+    TOKEN_PERCENT, TOKEN_AMPERSAND, TOKEN_PIPE, TOKEN_CARET,
 
     // One or two character tokens
     TOKEN_BANG, TOKEN_BANG_EQUAL,
     TOKEN_EQUAL, TOKEN_EQUAL_EQUAL, 
     TOKEN_GREATER, TOKEN_GREATER_EQUAL, 
     TOKEN_LESS, TOKEN_LESS_EQUAL,
+    TOKEN_GREATER_GREATER, TOKEN_LESS_LESS,
 
     // literals
     TOKEN_IDENTIFIER, TOKEN_STRING, TOKEN_NUMBER,
@@ -21,7 +23,8 @@ typedef enum {
     TOKEN_AND, TOKEN_CLASS, TOKEN_ELSE, TOKEN_FALSE, TOKEN_TRUE, TOKEN_NIL, TOKEN_FUN, TOKEN_FOR,
     TOKEN_IF, TOKEN_OR, TOKEN_PRINT, TOKEN_RETURN,
     TOKEN_CONTINUE, TOKEN_BREAK,
-    TOKEN_SUPER, TOKEN_THIS, TOKEN_VAR, TOKEN_WHILE,
+    TOKEN_SUPER, TOKEN_THIS, TOKEN_VAR, TOKEN_WHILE, TOKEN_REGION,
+    TOKEN_TRY, TOKEN_CATCH, TOKEN_THROW,
 
     // special
     TOKEN_ERROR, TOKEN_EOF
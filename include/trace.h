@@ -0,0 +1,49 @@
+#ifndef clox_trace_h
+#define clox_trace_h
+
+#include "common.h"
+#include "object.h"
+
+// tracing tier: hot loop headers get one iteration recorded (types, the
+// path through branches and calls inlined) and compiled into a native loop
+// with guards that exit back to the interpreter
+
+// back edges before a loop header gets recorded
+#define TRACE_HOT_LOOPS 50
+
+// failed recordings before a loop header is blacklisted
+#define TRACE_MAX_ABORTS 4
+
+#define TRACE_MAX_LENGTH 1024
+#define TRACE_MAX_DEPTH 4 // inlined call depth
+#define TRACE_MAX_CALLEES 8
+
+struct CallFrame;
+
+typedef struct Trace {
+    uint8_t* header; // loop header in the owning function
+    int hotness; // back edges seen, JIT_NEVER once blacklisted
+    int aborts;
+
+    uint8_t* code;
+    size_t size;
+    uint32_t start; // native offset of the loop header
+
+    // functions inlined into the trace, guarded by identity and kept alive
+    // for as long as the owning function is
+    ObjFunction* callees[TRACE_MAX_CALLEES];
+    int calleeCount;
+
+    struct Trace* next;
+} Trace;
+
+// called by the interpreter on every taken back edge, frame->ip already
+// points at the loop header; returns with the vm state synced for the
+// interpreter (possibly inside an inlined frame)
+void traceLoop (struct CallFrame* frame);
+
+void markTraces (Trace* traces);
+void forwardTraces (Trace* traces);
+void freeTraces (Trace* traces);
+
+#endif
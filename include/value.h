@@ -9,6 +9,7 @@ typedef enum {
     VAL_NIL,
     VAL_NUMBER,
     VAL_OBJ,
+    VAL_INT, // exact 64 bit, VAL_NUMBER is the double
 } ValueType;
 
 typedef struct Obj Obj;
@@ -19,6 +20,7 @@ typedef struct {
     union {
         bool boolean;
         double number;
+        int64_t integer;
         Obj* obj;
     } as;
 } Value;
@@ -28,17 +30,28 @@ typedef struct {
 #define BOOL_VAL(value) ((Value) {VAL_BOOL, {.boolean = value}})
 #define NUMBER_VAL(value) ((Value) {VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(object) ((Value) {VAL_OBJ, {.obj = (Obj*)object}})
+#define INT_VAL(value) ((Value) {VAL_INT, {.integer = value}})
+
+// two ints under the operator of a NUMBER_VAL / BOOL_VAL double op,
+// + - * wrap around at 64 bits
+#define INT_OP_NUMBER_VAL(a, op, b) INT_VAL((int64_t)((uint64_t)(a) op (uint64_t)(b)))
+#define INT_OP_BOOL_VAL(a, op, b) BOOL_VAL((a) op (b))
 
 // macros: lox -> C
 #define AS_BOOL(value) ((value).as.boolean)
 #define AS_NUMBER(value) ((value).as.number)
 #define AS_OBJ(value) ((value).as.obj) // returns a pointer
+#define AS_INT(value) ((value).as.integer)
+// either kind of number as a double
+#define AS_DOUBLE(value) (IS_INT(value) ? (double) AS_INT(value) : AS_NUMBER(value))
 
 // macros: guards
 #define IS_BOOL(value) ((value).vtype == VAL_BOOL)
 #define IS_NIL(value) ((value).vtype == VAL_NIL)
 #define IS_NUMBER(value) ((value).vtype == VAL_NUMBER)
 #define IS_OBJ(value) ((value).vtype == VAL_OBJ)
+#define IS_INT(value) ((value).vtype == VAL_INT)
+#define IS_NUMERIC(value) (IS_NUMBER(value) || IS_INT(value))
 
 typedef struct
 {
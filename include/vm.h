@@ -6,11 +6,12 @@
 #include "object.h"
 #include "memory.h"
 #include "hashmap.h"
+#include "intrinsics.h"
 
 #define MAX_FRAMES 64
 #define MAX_STACK (MAX_FRAMES * UINT8_COUNT) // grow dynamically?
 
-typedef struct {
+typedef struct CallFrame {
     ObjClosure* closure;
     uint8_t* ip; // the return adress
     Value* slots; // pointer to the first slot in the stack the callframe can use
@@ -25,7 +26,6 @@ typedef struct {
     Value stack[MAX_STACK];
     Value* stackTop;
     HashMap strings; // interned strings
-    Obj* objects;
     HashMap globals;
 
     // GC stuff
@@ -33,8 +33,47 @@ typedef struct {
     int grayCapacity;
     Obj** grayStack;
 
+    // old objects that may point at young ones
+    int rememberedCount;
+    int rememberedCapacity;
+    Obj** remembered;
+
+    // every weak object still alive (memory.c: Weak references)
+    int weakCount;
+    int weakCapacity;
+    Obj** weak;
+
     size_t bytesAlocated;
     size_t nextGC;
+    size_t nurseryBytes; // allocated since the last collection
+    bool gcMinor;
+    bool gcMarking; // a full collection is running incrementally
+    bool gcConcurrent; // mark on a background thread
+    bool gcConcurrentMarking; // the marker thread is on the heap
+    int gcThreads; // mark full collections with this many threads
+    bool gcParallelMarking; // the workers are on the heap
+    bool gcCompact; // move objects out of sparse pages
+    bool gcCompactPending; // the last sweep left the heap fragmented
+    GcStats gcStats;
+    int regionDepth; // enterRegion calls not yet exited
+    Value* regionBase; // slot of the outermost region block, NULL outside one
+
+    // the governor, checked by run at back edges and calls
+    size_t heapLimit; // past it after a full collection raises "Out of memory.", 0 for none
+    uint64_t fuel; // run stops at 0, UINT64_MAX for as good as unlimited
+    bool outOfMemory; // fuel is zeroed to get the error raised at the next check
+    uint64_t fuelSaved; // what it was before
+
+    Value exception; // thrown and not yet caught
+
+    // the global of the builtin was assigned, its OP_INTRINSIC calls go
+    // through the global from then on
+    bool intrinsicRebound[INTRINSIC_COUNT];
+
+    bool jitEnabled;
+    bool traceEnabled;
+    bool registerCode; // compile locals-heavy code to register instructions
+    bool allocTrace; // count allocations by site (alloctrace.h)
 } VM;
 
 
@@ -42,10 +81,23 @@ typedef enum {
     INTERPRET_OK,
     INTERPRET_COMPILE_ERROR,
     INTERPRET_RUNTIME_ERROR,
+    INTERPRET_OUT_OF_FUEL,
 } InterpretResult;
 
 extern VM vm;
 
+// every write to a global goes through this
+#define GUARD_INTRINSIC(name) \
+    do { \
+        if ((name) -> intrinsic != NO_INTRINSIC) vm.intrinsicRebound[(name) -> intrinsic] = true; \
+    } while (false)
+
+// in-place stores into an existing object come after this, a concurrent
+// marker must never read an object while it changes
+static inline void beforeWrite (Obj* obj) {
+    if (vm.gcConcurrentMarking) claimObject(obj);
+}
+
 void initVM ();
 void freeVM ();
 
@@ -53,4 +105,22 @@ InterpretResult interpret (const char* source);
 void push (Value value);
 Value pop ();
 
+// shared with the jit and the ahead-of-time compiled C
+void runtimeError (const char* format, ...);
+bool handleException (CallFrame* frame);
+void reportException ();
+bool isFalsey (Value value);
+bool numericOp (uint8_t op, Value a, Value b, Value* result);
+void concatenate ();
+ObjUpvalue* captureUpvalue (Value* local);
+void closeUpvalues (Value* last);
+void openRegion ();
+bool callValue (Value callee, int argCount);
+bool invoke (ObjString* name, int argCount);
+bool invokeFromClass (ObjClass* clas, ObjString* name, int argcount);
+bool bindMethod (ObjClass* clas, ObjString* name);
+void defineMethod (ObjString* name);
+bool runIntrinsic (uint8_t id, int argCount);
+bool callGlobal (ObjString* name, int argCount);
+
 #endif
@@ -0,0 +1,16 @@
+#ifndef clox_weakmap_h
+#define clox_weakmap_h
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+// the table of an ObjWeakMap; writes go through beforeWrite / writeBarrier
+// like any other store into an object
+bool weakMapGet (ObjWeakMap* map, Obj* key, Value* value);
+// true for a new key
+bool weakMapSet (ObjWeakMap* map, Obj* key, Value value);
+bool weakMapDelete (ObjWeakMap* map, Obj* key);
+void freeWeakMap (ObjWeakMap* map);
+
+#endif
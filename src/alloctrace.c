@@ -0,0 +1,301 @@
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloctrace.h"
+#include "chunk.h"
+#include "debug.h"
+#include "memory.h"
+#include "vm.h"
+
+#define ALLOC_REPORT_SITES 20 // printed by printAllocSites
+#define ALLOC_ERROR_SITES 3 // named by a failing budget
+
+typedef struct {
+    int line; // 0 outside every call frame: compiling, starting up
+    int opcode; // -1 there
+    int otype; // -1 for blocks
+    uint64_t count;
+    uint64_t bytes;
+} AllocSite;
+
+typedef struct {
+    uint64_t objects; // the counters when it was opened
+    uint64_t bytes;
+    double maxObjects;
+    double maxBytes;
+    uint64_t* siteCounts; // every site's count when it was opened, while tracing
+    int siteCount;
+    int frame; // where allocBudget was called, the index of its frame
+    int offset; // and its instruction there
+} AllocBudget;
+
+static AllocSite* sites = NULL;
+static int siteCount = 0;
+static int siteCapacity = 0;
+static int* siteIndex = NULL; // open addressing into sites, -1 for a free slot
+static int indexCapacity = 0;
+
+static AllocBudget budgets[ALLOC_MAX_BUDGETS];
+static int budgetCount = 0;
+
+// the last instruction looked up, a loop allocating keeps hitting it
+static const uint8_t* cachedCode = NULL;
+static int cachedOffset = -1;
+static int cachedStart = 0;
+
+// the instruction of the innermost frame its ip is in: the last byte read
+// belongs to it, where it starts takes a walk from the start of the chunk
+static void currentSite (int* line, int* opcode) {
+    if (vm.frameCount == 0) {
+        *line = 0;
+        *opcode = -1;
+        return;
+    }
+
+    CallFrame* frame = &vm.frames[vm.frameCount - 1];
+    Chunk* chunk = &DEREF(ObjFunction, frame -> closure -> rawFunc) -> chunk;
+    int offset = (int)(frame -> ip - chunk -> code) - 1;
+    if (offset < 0) offset = 0;
+
+    if (chunk -> code != cachedCode || offset != cachedOffset) {
+        int start = 0;
+        while (start + instructionLength(chunk, start) <= offset) {
+            start += instructionLength(chunk, start);
+        }
+        cachedCode = chunk -> code;
+        cachedOffset = offset;
+        cachedStart = start;
+    }
+
+    *line = chunk -> lines[offset];
+    *opcode = chunk -> code[cachedStart];
+}
+
+static uint32_t hashSite (int line, int opcode, int otype) {
+    uint32_t hash = 2166136261u;
+    hash = (hash ^ (uint32_t) line) * 16777619;
+    hash = (hash ^ (uint32_t) opcode) * 16777619;
+    hash = (hash ^ (uint32_t) otype) * 16777619;
+    return hash;
+}
+
+static int* findSlot (int line, int opcode, int otype) {
+    uint32_t slot = hashSite(line, opcode, otype) & (indexCapacity - 1);
+    for (;;) {
+        int i = siteIndex[slot];
+        if (i < 0) return &siteIndex[slot];
+
+        AllocSite* site = &sites[i];
+        if (site -> line == line && site -> opcode == opcode && site -> otype == otype) {
+            return &siteIndex[slot];
+        }
+        slot = (slot + 1) & (indexCapacity - 1);
+    }
+}
+
+static void growIndex () {
+    free(siteIndex);
+    indexCapacity = GROW_CAPACITY(indexCapacity);
+    siteIndex = (int*)malloc(indexCapacity * sizeof(int));
+    if (siteIndex == NULL) exit(1);
+
+    memset(siteIndex, 0xff, indexCapacity * sizeof(int)); // -1
+    for (int i = 0; i < siteCount; i++) {
+        *findSlot(sites[i].line, sites[i].opcode, sites[i].otype) = i;
+    }
+}
+
+static AllocSite* findSite (int line, int opcode, int otype) {
+    if ((siteCount + 1) * 2 > indexCapacity) growIndex();
+
+    int* slot = findSlot(line, opcode, otype);
+    if (*slot >= 0) return &sites[*slot];
+
+    if (siteCapacity < siteCount + 1) {
+        siteCapacity = GROW_CAPACITY(siteCapacity);
+        sites = (AllocSite*)realloc(sites, siteCapacity * sizeof(AllocSite));
+        if (sites == NULL) exit(1);
+    }
+
+    *slot = siteCount;
+    AllocSite* site = &sites[siteCount++];
+    site -> line = line;
+    site -> opcode = opcode;
+    site -> otype = otype;
+    site -> count = 0;
+    site -> bytes = 0;
+    return site;
+}
+
+void traceAllocation (int otype, size_t size) {
+    int line;
+    int opcode;
+    currentSite(&line, &opcode);
+
+    AllocSite* site = findSite(line, opcode, otype);
+    site -> count++;
+    site -> bytes += size;
+}
+
+static uint64_t objectsAllocated () {
+    uint64_t objects = 0;
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++) objects += vm.gcStats.objectsAllocated[i];
+    return objects;
+}
+
+static uint64_t bytesAllocated () {
+    uint64_t bytes = vm.gcStats.blockBytes;
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++) bytes += vm.gcStats.bytesAllocated[i];
+    return bytes;
+}
+
+bool openAllocBudget (double maxObjects, double maxBytes) {
+    if (budgetCount == ALLOC_MAX_BUDGETS) return false;
+
+    AllocBudget* budget = &budgets[budgetCount++];
+    budget -> objects = objectsAllocated();
+    budget -> bytes = bytesAllocated();
+    budget -> maxObjects = maxObjects;
+    budget -> maxBytes = maxBytes;
+    budget -> siteCounts = NULL;
+    budget -> siteCount = 0;
+    budget -> frame = vm.frameCount - 1;
+    budget -> offset = -1;
+    if (vm.frameCount > 0) {
+        CallFrame* frame = &vm.frames[vm.frameCount - 1];
+        Chunk* chunk = &DEREF(ObjFunction, frame -> closure -> rawFunc) -> chunk;
+        budget -> offset = (int)(frame -> ip - chunk -> code) - 1;
+    }
+
+    if (vm.allocTrace && siteCount > 0) {
+        budget -> siteCounts = (uint64_t*)malloc(siteCount * sizeof(uint64_t));
+        if (budget -> siteCounts == NULL) exit(1);
+
+        for (int i = 0; i < siteCount; i++) budget -> siteCounts[i] = sites[i].count;
+        budget -> siteCount = siteCount;
+    }
+    return true;
+}
+
+static const char* siteInstruction (AllocSite* site) {
+    return site -> opcode < 0 ? "(no frame)" : opcodeName((uint8_t) site -> opcode);
+}
+
+static const char* siteType (AllocSite* site) {
+    return site -> otype < 0 ? "block" : gcTypeName(site -> otype);
+}
+
+static uint64_t countSince (AllocBudget* budget, int site) {
+    uint64_t before = site < budget -> siteCount ? budget -> siteCounts[site] : 0;
+    return sites[site].count - before;
+}
+
+// the sites that allocated the most while the budget was open
+static void describeSites (AllocBudget* budget, char* text, size_t size) {
+    if (!vm.allocTrace) {
+        snprintf(text, size, " (--alloc-trace tells where)");
+        return;
+    }
+
+    int chosen[ALLOC_ERROR_SITES];
+    int count = 0;
+    size_t length = 0;
+    text[0] = '\0';
+
+    while (count < ALLOC_ERROR_SITES) {
+        int best = -1;
+        for (int i = 0; i < siteCount; i++) {
+            bool taken = false;
+            for (int j = 0; j < count; j++) taken = taken || chosen[j] == i;
+            if (taken || countSince(budget, i) == 0) continue;
+            if (best < 0 || countSince(budget, i) > countSince(budget, best)) best = i;
+        }
+        if (best < 0) break;
+        chosen[count] = best;
+
+        AllocSite* site = &sites[best];
+        int written = snprintf(text + length, size - length, "%s line %d %s %s x%" PRIu64,
+                               count == 0 ? ":" : ",", site -> line,
+                               siteInstruction(site),
+                               siteType(site), countSince(budget, best));
+        if (written < 0 || (size_t) written >= size - length) break;
+        length += written;
+        count++;
+    }
+}
+
+bool closeAllocBudget () {
+    if (budgetCount == 0) {
+        runtimeError("No allocation budget is open");
+        return false;
+    }
+
+    AllocBudget* budget = &budgets[--budgetCount];
+    uint64_t objects = objectsAllocated() - budget -> objects;
+    uint64_t bytes = bytesAllocated() - budget -> bytes;
+
+    bool over = (budget -> maxObjects >= 0 && objects > budget -> maxObjects)
+        || (budget -> maxBytes >= 0 && bytes > budget -> maxBytes);
+    if (over) {
+        char where[160];
+        describeSites(budget, where, sizeof(where));
+        runtimeError("Allocation budget exceeded, %" PRIu64 " objects and %" PRIu64 " bytes allocated%s",
+                     objects, bytes, where);
+    }
+
+    free(budget -> siteCounts);
+    return !over;
+}
+
+void dropAllocBudgets (int frame, int start, int end) {
+    while (budgetCount > 0) {
+        AllocBudget* budget = &budgets[budgetCount - 1];
+        bool unwound = budget -> frame > frame
+            || (budget -> frame == frame && budget -> offset >= start && budget -> offset < end);
+        if (!unwound) break;
+
+        free(budget -> siteCounts);
+        budgetCount--;
+    }
+}
+
+static int byBytes (const void* a, const void* b) {
+    uint64_t left = sites[*(const int*) a].bytes;
+    uint64_t right = sites[*(const int*) b].bytes;
+    return left < right ? 1 : left > right ? -1 : 0;
+}
+
+void printAllocSites (FILE* out) {
+    int* order = (int*)malloc((siteCount + 1) * sizeof(int));
+    if (order == NULL) exit(1);
+    for (int i = 0; i < siteCount; i++) order[i] = i;
+    qsort(order, siteCount, sizeof(int), byBytes);
+
+    fprintf(out, "== allocation sites ==\n");
+    fprintf(out, "  line  %-18s %-11s %12s %14s\n", "instruction", "type", "count", "bytes");
+    for (int i = 0; i < siteCount && i < ALLOC_REPORT_SITES; i++) {
+        AllocSite* site = &sites[order[i]];
+        fprintf(out, "  %4d  %-18s %-11s %12" PRIu64 " %12" PRIu64 " B\n", site -> line,
+                siteInstruction(site),
+                siteType(site), site -> count, site -> bytes);
+    }
+    if (siteCount > ALLOC_REPORT_SITES) {
+        fprintf(out, "  ... %d more sites\n", siteCount - ALLOC_REPORT_SITES);
+    }
+    free(order);
+}
+
+void freeAllocTrace () {
+    while (budgetCount > 0) free(budgets[--budgetCount].siteCounts);
+
+    free(sites);
+    free(siteIndex);
+    sites = NULL;
+    siteIndex = NULL;
+    siteCount = 0;
+    siteCapacity = 0;
+    indexCapacity = 0;
+    cachedCode = NULL;
+    cachedOffset = -1;
+}
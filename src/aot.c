@@ -0,0 +1,672 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aot.h"
+#include "chunk.h"
+#include "common.h"
+#include "hashmap.h"
+#include "memory.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+
+// ========= Emitting C =========
+
+typedef struct {
+    ObjFunction** functions;
+    int count;
+    int capacity;
+} FunctionList;
+
+static int indexOf (FunctionList* list, ObjFunction* function) {
+    for (int i = 0; i < list -> count; i++) {
+        if (list -> functions[i] == function) return i;
+    }
+    return -1;
+}
+
+// nested functions first so the loader can resolve them while building
+static void collectFunctions (FunctionList* list, ObjFunction* function) {
+    ValueArray* constants = &function -> chunk.constants;
+    for (int i = 0; i < constants -> count; i++) {
+        if (IS_FUNCTION(constants -> values[i])) {
+            collectFunctions(list, AS_FUNCTION(constants -> values[i]));
+        }
+    }
+
+    if (list -> capacity < list -> count + 1) {
+        list -> capacity = GROW_CAPACITY(list -> capacity);
+        list -> functions = (ObjFunction**)realloc(list -> functions, list -> capacity * sizeof(ObjFunction*));
+        if (list -> functions == NULL) exit(1);
+    }
+    list -> functions[list -> count++] = function;
+}
+
+static int readShort (Chunk* chunk, int offset) {
+    return (chunk -> code[offset] << 8) | chunk -> code[offset + 1];
+}
+
+static void emitString (FILE* out, const char* chars, int length) {
+    fputc('"', out);
+    for (int i = 0; i < length; i++) {
+        unsigned char c = (unsigned char) chars[i];
+        if (c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        } else if (c < 32 || c > 126 || c == '?') {
+            fprintf(out, "\\%03o", c); // '?' too, no trigraphs
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+static void emitData (FILE* out, FunctionList* list, int index) {
+    Chunk* chunk = &list -> functions[index] -> chunk;
+
+    fprintf(out, "static const uint8_t code%d[] = {", index);
+    for (int i = 0; i < chunk -> count; i++) {
+        fprintf(out, "%s%d", i % 16 == 0 ? "\n    " : " ", chunk -> code[i]);
+        if (i < chunk -> count - 1) fputc(',', out);
+    }
+    fprintf(out, "\n};\n");
+
+    fprintf(out, "static const int lines%d[] = {", index);
+    for (int i = 0; i < chunk -> count; i++) {
+        fprintf(out, "%s%d", i % 16 == 0 ? "\n    " : " ", chunk -> lines[i]);
+        if (i < chunk -> count - 1) fputc(',', out);
+    }
+    fprintf(out, "\n};\n");
+
+    fprintf(out, "static const AotConstant constants%d[] = {\n", index);
+    for (int i = 0; i < chunk -> constants.count; i++) {
+        Value value = chunk -> constants.values[i];
+        if (IS_NUMBER(value)) {
+            fprintf(out, "    { AOT_NUMBER, %a, NULL, 0 },\n", AS_NUMBER(value));
+        } else if (IS_INT(value)) {
+            fprintf(out, "    { AOT_INT, 0, NULL, 0, %lldLL },\n", (long long) AS_INT(value));
+        } else if (IS_BOOL(value)) {
+            fprintf(out, "    { AOT_BOOL, %d, NULL, 0 },\n", AS_BOOL(value));
+        } else if (IS_STRING(value)) {
+            fprintf(out, "    { AOT_STRING, 0, ");
+            emitString(out, AS_STRING(value) -> chars, AS_STRING(value) -> length);
+            fprintf(out, ", %d },\n", AS_STRING(value) -> length);
+        } else if (IS_FUNCTION(value)) {
+            fprintf(out, "    { AOT_FUNCTION, 0, NULL, %d },\n", indexOf(list, AS_FUNCTION(value)));
+        } else {
+            fprintf(out, "    { AOT_NIL, 0, NULL, 0 },\n");
+        }
+    }
+    fprintf(out, "    { AOT_NIL, 0, NULL, 0 } // never empty\n};\n");
+
+    fprintf(out, "static const ExceptionHandler handlers%d[] = {\n", index);
+    for (int i = 0; i < chunk -> handlerCount; i++) {
+        ExceptionHandler* handler = &chunk -> handlers[i];
+        fprintf(out, "    { %d, %d, %d, %d },\n", handler -> start, handler -> end,
+                handler -> handler, handler -> stackDepth);
+    }
+    fprintf(out, "    { 0, 0, 0, 0 } // never empty\n};\n\n");
+}
+
+static const char* registerOpName (uint8_t op) {
+    switch (op) {
+        case OP_ADD_RR: case OP_ADD_RK: return "+";
+        case OP_SUBTRACT_RR: case OP_SUBTRACT_RK: return "-";
+        case OP_MULTIPLY_RR: case OP_MULTIPLY_RK: return "*";
+        case OP_DIVIDE_RR: case OP_DIVIDE_RK: return "/";
+        case OP_GREATER_RR: case OP_GREATER_RK: return ">";
+        default: return "<";
+    }
+}
+
+// true when the emitted code can jump to the unwind label
+static bool emitInstruction (FILE* out, Chunk* chunk, int offset) {
+    uint8_t* operands = chunk -> code + offset + 1;
+    int next = offset + instructionLength(chunk, offset);
+    bool canThrow = false;
+
+    // frame->ip is what error traces, handler lookup and callers' return
+    // addresses read, only kept up to date where it can be observed
+    #define SYNC_IP() (canThrow = true, fprintf(out, "    frame -> ip = code + %d;\n", next))
+
+    switch (chunk -> code[offset]) {
+        case OP_CONSTANT: fprintf(out, "    AOT_PUSH(k[%d]);\n", operands[0]); break;
+        case OP_NIL: fprintf(out, "    AOT_PUSH(NIL_VAL);\n"); break;
+        case OP_TRUE: fprintf(out, "    AOT_PUSH(BOOL_VAL(true));\n"); break;
+        case OP_FALSE: fprintf(out, "    AOT_PUSH(BOOL_VAL(false));\n"); break;
+        case OP_POP: fprintf(out, "    vm.stackTop--;\n"); break;
+
+        case OP_GET_LOCAL: fprintf(out, "    AOT_PUSH(frame -> slots[%d]);\n", operands[0]); break;
+        case OP_SET_LOCAL: fprintf(out, "    frame -> slots[%d] = vm.stackTop[-1];\n", operands[0]); break;
+        case OP_GET_UPVALUE:
+            fprintf(out, "    AOT_PUSH(*frame -> closure -> upvalues[%d] -> location);\n", operands[0]);
+            break;
+        case OP_SET_UPVALUE:
+            fprintf(out, "    beforeWrite((Obj*) frame -> closure -> upvalues[%d]);\n", operands[0]);
+            fprintf(out, "    *frame -> closure -> upvalues[%d] -> location = vm.stackTop[-1];\n", operands[0]);
+            fprintf(out, "    writeBarrier((Obj*) frame -> closure -> upvalues[%d]);\n", operands[0]);
+            break;
+
+        case OP_ADD: SYNC_IP(); fprintf(out, "    AOT_BINARY(NUMBER_VAL, +, OP_ADD);\n"); break;
+        case OP_SUBTRACT: SYNC_IP(); fprintf(out, "    AOT_BINARY(NUMBER_VAL, -, OP_SUBTRACT);\n"); break;
+        case OP_MULTIPLY: SYNC_IP(); fprintf(out, "    AOT_BINARY(NUMBER_VAL, *, OP_MULTIPLY);\n"); break;
+        case OP_DIVIDE: SYNC_IP(); fprintf(out, "    AOT_BINARY(NUMBER_VAL, /, OP_DIVIDE);\n"); break;
+        case OP_GREATER: SYNC_IP(); fprintf(out, "    AOT_BINARY(BOOL_VAL, >, OP_GREATER);\n"); break;
+        case OP_LESS: SYNC_IP(); fprintf(out, "    AOT_BINARY(BOOL_VAL, <, OP_LESS);\n"); break;
+        case OP_NEGATE: SYNC_IP(); fprintf(out, "    if (!aotNegate()) goto unwind;\n"); break;
+
+        case OP_MODULO: case OP_BIT_AND: case OP_BIT_OR: case OP_BIT_XOR:
+        case OP_SHIFT_LEFT: case OP_SHIFT_RIGHT:
+            SYNC_IP();
+            fprintf(out, "    if (!aotBinary(%d)) goto unwind;\n", chunk -> code[offset]);
+            break;
+
+        case OP_ADD_NUM: fprintf(out, "    AOT_NUMBER_OP(NUMBER_VAL, +);\n"); break;
+        case OP_SUBTRACT_NUM: fprintf(out, "    AOT_NUMBER_OP(NUMBER_VAL, -);\n"); break;
+        case OP_MULTIPLY_NUM: fprintf(out, "    AOT_NUMBER_OP(NUMBER_VAL, *);\n"); break;
+        case OP_DIVIDE_NUM: fprintf(out, "    AOT_NUMBER_OP(NUMBER_VAL, /);\n"); break;
+        case OP_GREATER_NUM: fprintf(out, "    AOT_NUMBER_OP(BOOL_VAL, >);\n"); break;
+        case OP_LESS_NUM: fprintf(out, "    AOT_NUMBER_OP(BOOL_VAL, <);\n"); break;
+        case OP_NEGATE_NUM:
+            fprintf(out, "    vm.stackTop[-1] = NUMBER_VAL(-AS_NUMBER(vm.stackTop[-1]));\n");
+            break;
+
+        case OP_CHECK_NUM:
+            SYNC_IP();
+            fprintf(out, "    if (!aotCheckNum(&vm.stackTop[-1])) goto unwind;\n");
+            break;
+        case OP_CHECK_NUM_LOCAL:
+            SYNC_IP();
+            fprintf(out, "    if (!aotCheckNum(&frame -> slots[%d])) goto unwind;\n", operands[0]);
+            break;
+
+        case OP_ADD_RR: case OP_SUBTRACT_RR: case OP_MULTIPLY_RR: case OP_DIVIDE_RR:
+        case OP_GREATER_RR: case OP_LESS_RR:
+        case OP_ADD_RK: case OP_SUBTRACT_RK: case OP_MULTIPLY_RK: case OP_DIVIDE_RK:
+        case OP_GREATER_RK: case OP_LESS_RK: {
+            uint8_t op = chunk -> code[offset];
+            bool compare = op == OP_GREATER_RR || op == OP_LESS_RR || op == OP_GREATER_RK || op == OP_LESS_RK;
+            SYNC_IP();
+            fprintf(out, "    AOT_REGISTER(%s, %s, %d, %d, frame -> slots[%d], %s[%d]);\n",
+                    compare ? "BOOL_VAL" : "NUMBER_VAL", registerOpName(op), op,
+                    operands[0], operands[1], op >= OP_ADD_RK ? "k" : "frame -> slots", operands[2]);
+            break;
+        }
+        case OP_MOVE:
+            fprintf(out, "    frame -> slots[%d] = frame -> slots[%d];\n", operands[0], operands[1]);
+            break;
+        case OP_LOAD_CONSTANT:
+            fprintf(out, "    frame -> slots[%d] = k[%d];\n", operands[0], operands[1]);
+            break;
+
+        case OP_NOT:
+            fprintf(out, "    vm.stackTop[-1] = BOOL_VAL(AOT_FALSEY(vm.stackTop[-1]));\n");
+            break;
+        case OP_EQUAL: fprintf(out, "    aotEqual();\n"); break;
+        case OP_PRINT: fprintf(out, "    aotPrint();\n"); break;
+
+        case OP_DEFINE_GLOBAL: fprintf(out, "    aotDefineGlobal(k[%d]);\n", operands[0]); break;
+        case OP_GET_GLOBAL:
+            SYNC_IP();
+            fprintf(out, "    if (!aotGetGlobal(k[%d])) goto unwind;\n", operands[0]);
+            break;
+        case OP_SET_GLOBAL:
+            SYNC_IP();
+            fprintf(out, "    if (!aotSetGlobal(k[%d])) goto unwind;\n", operands[0]);
+            break;
+
+        case OP_JUMP:
+            fprintf(out, "    goto L%d;\n", offset + 3 + readShort(chunk, offset + 1));
+            break;
+        case OP_JUMP_BACK:
+            fprintf(out, "    goto L%d;\n", offset + 3 - readShort(chunk, offset + 1));
+            break;
+        case OP_JUMP_IF_FALSE:
+            fprintf(out, "    if (AOT_FALSEY(vm.stackTop[-1])) goto L%d;\n", offset + 3 + readShort(chunk, offset + 1));
+            break;
+
+        case OP_CALL:
+            SYNC_IP();
+            fprintf(out, "    if (!aotCall(%d)) goto unwind;\n", operands[0]);
+            break;
+        case OP_INVOKE:
+            SYNC_IP();
+            fprintf(out, "    if (!aotInvoke(k[%d], %d)) goto unwind;\n", operands[0], operands[1]);
+            break;
+        case OP_SUPER_INVOKE:
+            SYNC_IP();
+            fprintf(out, "    if (!aotSuperInvoke(k[%d], %d)) goto unwind;\n", operands[0], operands[1]);
+            break;
+        case OP_INTRINSIC:
+            canThrow = true;
+            fprintf(out, "    if (!runIntrinsic(%d, %d)) {\n", operands[2], operands[1]);
+            fprintf(out, "        frame -> ip = code + %d;\n", next);
+            fprintf(out, "        if (!aotCallGlobal(k[%d], %d)) goto unwind;\n    }\n", operands[0], operands[1]);
+            break;
+        case OP_RETURN:
+            fprintf(out, "    return aotReturn(frame);\n");
+            break;
+
+        case OP_CLOSURE:
+            fprintf(out, "    aotClosure(frame, k[%d], code + %d);\n", operands[0], offset + 2);
+            break;
+        case OP_CLOSE_CAPTURE:
+            fprintf(out, "    closeUpvalues(vm.stackTop - 1);\n    vm.stackTop--;\n");
+            break;
+        case OP_REGION:
+            fprintf(out, "    openRegion();\n");
+            break;
+
+        case OP_CLASS:
+            fprintf(out, "    push(OBJ_VAL(newCLass(AS_STRING(k[%d]))));\n", operands[0]);
+            break;
+        case OP_INHERIT:
+            SYNC_IP();
+            fprintf(out, "    if (!aotInherit()) goto unwind;\n");
+            break;
+        case OP_METHOD: fprintf(out, "    aotMethod(k[%d]);\n", operands[0]); break;
+        case OP_GET_PROPERTY:
+            SYNC_IP();
+            fprintf(out, "    if (!aotGetProperty(k[%d])) goto unwind;\n", operands[0]);
+            break;
+        case OP_SET_PROPERTY:
+            SYNC_IP();
+            fprintf(out, "    if (!aotSetProperty(k[%d])) goto unwind;\n", operands[0]);
+            break;
+        case OP_GET_SUPER:
+            SYNC_IP();
+            fprintf(out, "    if (!aotGetSuper(k[%d])) goto unwind;\n", operands[0]);
+            break;
+
+        case OP_THROW:
+            SYNC_IP();
+            fprintf(out, "    vm.exception = *--vm.stackTop;\n    goto unwind;\n");
+            break;
+
+        default:
+            break; // opcodes the interpreter ignores too
+    }
+
+    #undef SYNC_IP
+    return canThrow;
+}
+
+static void emitBody (FILE* out, FunctionList* list, int index) {
+    ObjFunction* function = list -> functions[index];
+    Chunk* chunk = &function -> chunk;
+
+    bool* targets = (bool*)calloc(chunk -> count + 1, sizeof(bool));
+    if (targets == NULL) exit(1);
+
+    for (int offset = 0; offset < chunk -> count; offset += instructionLength(chunk, offset)) {
+        uint8_t op = chunk -> code[offset];
+        if (op == OP_JUMP || op == OP_JUMP_IF_FALSE) {
+            targets[offset + 3 + readShort(chunk, offset + 1)] = true;
+        } else if (op == OP_JUMP_BACK) {
+            targets[offset + 3 - readShort(chunk, offset + 1)] = true;
+        }
+    }
+    for (int i = 0; i < chunk -> handlerCount; i++) {
+        targets[chunk -> handlers[i].handler] = true;
+    }
+
+    ObjString* name = DEREF(ObjString, function -> name);
+    fprintf(out, "// %s\n", name == NULL ? "script" : name -> chars);
+    fprintf(out, "static bool body%d (CallFrame* frame) {\n", index);
+    fprintf(out, "    Value* k = DEREF(ObjFunction, frame -> closure -> rawFunc) -> chunk.constants.values;\n");
+    fprintf(out, "    uint8_t* code = DEREF(ObjFunction, frame -> closure -> rawFunc) -> chunk.code;\n");
+    fprintf(out, "    (void) k;\n    (void) code;\n\n");
+
+    bool canThrow = false;
+    for (int offset = 0; offset < chunk -> count; offset += instructionLength(chunk, offset)) {
+        if (targets[offset]) fprintf(out, "L%d:\n", offset);
+        if (emitInstruction(out, chunk, offset)) canThrow = true;
+    }
+    if (targets[chunk -> count]) fprintf(out, "L%d:\n", chunk -> count);
+    fprintf(out, "    return aotReturn(frame);\n");
+
+    if (canThrow) {
+        // one of this frame's try blocks takes over or the exception propagates
+        fprintf(out, "\nunwind:\n");
+        if (chunk -> handlerCount > 0) {
+            fprintf(out, "    if (!handleException(frame)) return false;\n");
+            fprintf(out, "    switch ((int)(frame -> ip - code)) {\n");
+            for (int i = 0; i < chunk -> handlerCount; i++) {
+                int handler = chunk -> handlers[i].handler;
+                bool seen = false;
+                for (int j = 0; j < i; j++) seen = seen || chunk -> handlers[j].handler == handler;
+                if (!seen) fprintf(out, "        case %d: goto L%d;\n", handler, handler);
+            }
+            fprintf(out, "    }\n");
+        }
+        fprintf(out, "    return false;\n");
+    }
+    fprintf(out, "}\n\n");
+
+    free(targets);
+}
+
+void emitC (ObjFunction* script, FILE* out) {
+    FunctionList list;
+    list.functions = NULL;
+    list.count = 0;
+    list.capacity = 0;
+    collectFunctions(&list, script);
+
+    fprintf(out, "// generated by clox --emit-c, link with the runtime in src/ (all but main.c)\n\n");
+    fprintf(out, "#include \"aot.h\"\n\n");
+
+    for (int i = 0; i < list.count; i++) {
+        emitData(out, &list, i);
+    }
+    for (int i = 0; i < list.count; i++) {
+        emitBody(out, &list, i);
+    }
+
+    fprintf(out, "static const AotFunction functions[] = {\n");
+    for (int i = 0; i < list.count; i++) {
+        ObjFunction* function = list.functions[i];
+        fprintf(out, "    { ");
+        ObjString* name = DEREF(ObjString, function -> name);
+        if (name == NULL) {
+            fprintf(out, "NULL");
+        } else {
+            emitString(out, name -> chars, name -> length);
+        }
+        fprintf(out, ", %d, %d, code%d, lines%d, %d, constants%d, %d, handlers%d, %d, body%d },\n",
+                function -> arity, function -> upValuesCount, i, i, function -> chunk.count,
+                i, function -> chunk.constants.count, i, function -> chunk.handlerCount, i);
+    }
+    fprintf(out, "};\n\n");
+
+    fprintf(out, "int main (int argc, char* argv[]) {\n");
+    fprintf(out, "    initVM();\n");
+    fprintf(out, "    InterpretResult result = aotInterpret(functions, %d);\n", list.count);
+    fprintf(out, "    freeVM();\n");
+    fprintf(out, "    return result == INTERPRET_RUNTIME_ERROR ? 70 : 0;\n");
+    fprintf(out, "}\n");
+
+    free(list.functions);
+}
+
+// ========= Runtime for the emitted code =========
+
+static ObjFunction* loadFunction (const AotFunction* proto, Value* loaded) {
+    ObjFunction* function = newFunction();
+    push(OBJ_VAL(function)); // stays until every function is loaded
+
+    function -> arity = proto -> arity;
+    function -> upValuesCount = proto -> upvalueCount;
+    function -> aot = proto -> body;
+    if (proto -> name != NULL) {
+        function -> name = REF(copyString(proto -> name, (int) strlen(proto -> name)));
+    }
+
+    for (int i = 0; i < proto -> count; i++) {
+        writeChunk(&function -> chunk, proto -> code[i], proto -> lines[i]);
+    }
+
+    for (int i = 0; i < proto -> constantCount; i++) {
+        const AotConstant* constant = &proto -> constants[i];
+        Value value;
+        switch (constant -> ctype) {
+            case AOT_BOOL: value = BOOL_VAL(constant -> number != 0); break;
+            case AOT_NUMBER: value = NUMBER_VAL(constant -> number); break;
+            case AOT_INT: value = INT_VAL((int64_t) constant -> integer); break;
+            case AOT_STRING: value = OBJ_VAL(copyString(constant -> chars, constant -> length)); break;
+            case AOT_FUNCTION: value = loaded[constant -> length]; break;
+            default: value = NIL_VAL; break;
+        }
+        addConstant(&function -> chunk, value);
+    }
+
+    for (int i = 0; i < proto -> handlerCount; i++) {
+        addHandler(&function -> chunk, proto -> handlers[i]);
+    }
+    writeBarrier((Obj*) function); // loading the constants can collect
+    return function;
+}
+
+InterpretResult aotInterpret (const AotFunction* functions, int count) {
+    Value* loaded = vm.stackTop;
+    for (int i = 0; i < count; i++) {
+        loadFunction(&functions[i], loaded);
+    }
+
+    ObjFunction* script = AS_FUNCTION(loaded[count - 1]);
+    vm.stackTop = loaded;
+
+    push(OBJ_VAL(script));
+    ObjClosure* closure = newClosure(script);
+    pop();
+    push(OBJ_VAL(closure));
+    callValue(OBJ_VAL(closure), 0);
+
+    CallFrame* frame = &vm.frames[vm.frameCount - 1];
+    if (script -> aot(frame)) return INTERPRET_OK;
+
+    reportException();
+    return INTERPRET_RUNTIME_ERROR;
+}
+
+// runs the frame callValue / invoke just pushed, natives and initializer-less
+// classes complete without one
+static bool runPushedFrame (int frameCount) {
+    if (vm.frameCount == frameCount) return true;
+
+    CallFrame* frame = &vm.frames[vm.frameCount - 1];
+    return DEREF(ObjFunction, frame -> closure -> rawFunc) -> aot(frame);
+}
+
+bool aotBinary (uint8_t op) {
+    Value b = vm.stackTop[-1];
+    Value a = vm.stackTop[-2];
+
+    if (op == OP_ADD && IS_STRING(a) && IS_STRING(b)) {
+        concatenate();
+        return true;
+    }
+
+    if (!numericOp(op, a, b, &vm.stackTop[-2])) return false;
+    vm.stackTop--;
+    return true;
+}
+
+// only reached when the operands aren't two doubles or two ints
+bool aotRegister (CallFrame* frame, uint8_t op, uint8_t dst, Value a, Value b) {
+    bool add = op == OP_ADD_RR || op == OP_ADD_RK;
+    if (add && IS_STRING(a) && IS_STRING(b)) {
+        push(a);
+        push(b);
+        concatenate();
+        if (dst != REG_STACK) frame -> slots[dst] = pop();
+        return true;
+    }
+
+    uint8_t stackOp;
+    switch (op) {
+        case OP_ADD_RR: case OP_ADD_RK: stackOp = OP_ADD; break;
+        case OP_SUBTRACT_RR: case OP_SUBTRACT_RK: stackOp = OP_SUBTRACT; break;
+        case OP_MULTIPLY_RR: case OP_MULTIPLY_RK: stackOp = OP_MULTIPLY; break;
+        case OP_DIVIDE_RR: case OP_DIVIDE_RK: stackOp = OP_DIVIDE; break;
+        case OP_GREATER_RR: case OP_GREATER_RK: stackOp = OP_GREATER; break;
+        default: stackOp = OP_LESS; break;
+    }
+
+    Value result;
+    if (!numericOp(stackOp, a, b, &result)) return false;
+    if (dst == REG_STACK) push(result);
+    else frame -> slots[dst] = result;
+    return true;
+}
+
+bool aotNegate () {
+    if (IS_INT(vm.stackTop[-1])) {
+        vm.stackTop[-1] = INT_VAL((int64_t)(0 - (uint64_t) AS_INT(vm.stackTop[-1])));
+        return true;
+    }
+    if (!IS_NUMBER(vm.stackTop[-1])) {
+        runtimeError ("Operand must be a number.");
+        return false;
+    }
+    vm.stackTop[-1] = NUMBER_VAL(-AS_NUMBER(vm.stackTop[-1]));
+    return true;
+}
+
+// promotes ints like OP_CHECK_NUM
+bool aotCheckNum (Value* value) {
+    if (IS_INT(*value)) *value = NUMBER_VAL((double) AS_INT(*value));
+    if (!IS_NUMBER(*value)) {
+        runtimeError("Type annotation 'num' violated: expected a number.");
+        return false;
+    }
+    return true;
+}
+
+void aotEqual () {
+    Value b = pop();
+    Value a = pop();
+    push(BOOL_VAL(valuesEqual(a, b)));
+}
+
+void aotPrint () {
+    printValue(pop());
+    printf("\n");
+}
+
+void aotDefineGlobal (Value name) {
+    GUARD_INTRINSIC(AS_STRING(name));
+    hashMapSet(&vm.globals, AS_STRING(name), vm.stackTop[-1]);
+    pop();
+}
+
+bool aotGetGlobal (Value name) {
+    Value value;
+    if (!hashMapGet(&vm.globals, AS_STRING(name), &value)) {
+        runtimeError("Undefined variable '%s'.", AS_CSTRING(name));
+        return false;
+    }
+    push(value);
+    return true;
+}
+
+bool aotSetGlobal (Value name) {
+    GUARD_INTRINSIC(AS_STRING(name));
+    if (hashMapSet(&vm.globals, AS_STRING(name), vm.stackTop[-1])) {
+        hashMapDelete(&vm.globals, AS_STRING(name));
+        runtimeError("Undefined variable '%s'.", AS_CSTRING(name));
+        return false;
+    }
+    return true;
+}
+
+bool aotGetProperty (Value name) {
+    if (!IS_INSTANCE(vm.stackTop[-1])) {
+        runtimeError("Only instances have properties.");
+        return false;
+    }
+
+    ObjInstance* instance = AS_INSTANCE(vm.stackTop[-1]);
+    Value value;
+    if (hashMapGet(&instance -> fields, AS_STRING(name), &value)) {
+        vm.stackTop[-1] = value;
+        return true;
+    }
+    return bindMethod(DEREF(ObjClass, instance -> clas), AS_STRING(name));
+}
+
+bool aotSetProperty (Value name) {
+    if (!IS_INSTANCE(vm.stackTop[-2])) {
+        runtimeError("Only instance have field.");
+        return false;
+    }
+
+    ObjInstance* instance = AS_INSTANCE(vm.stackTop[-2]);
+    beforeWrite((Obj*) instance);
+    hashMapSet(&instance -> fields, AS_STRING(name), vm.stackTop[-1]);
+    writeBarrier((Obj*) instance);
+    Value value = pop();
+    vm.stackTop[-1] = value;
+    return true;
+}
+
+bool aotGetSuper (Value name) {
+    ObjClass* superClass = AS_CLASS(pop());
+    return bindMethod(superClass, AS_STRING(name));
+}
+
+bool aotInherit () {
+    Value superClass = vm.stackTop[-2];
+    if (!IS_CLASS(superClass)) {
+        runtimeError("Can only inherit from classes.");
+        return false;
+    }
+
+    ObjClass* subclass = AS_CLASS(vm.stackTop[-1]);
+    beforeWrite((Obj*) subclass);
+    hashMapAddAll(&AS_CLASS(superClass) -> methods, &subclass -> methods);
+    writeBarrier((Obj*) subclass);
+    pop();
+    return true;
+}
+
+void aotMethod (Value name) {
+    defineMethod(AS_STRING(name));
+}
+
+void aotClosure (CallFrame* frame, Value function, const uint8_t* operands) {
+    ObjClosure* closure = newClosure(AS_FUNCTION(function));
+    push(OBJ_VAL(closure));
+
+    for (int i = 0; i < closure -> upvalueCount; i++) {
+        uint8_t isLocal = *operands++;
+        uint8_t index = *operands++;
+        if (isLocal) {
+            closure -> upvalues[i] = captureUpvalue(frame -> slots + index);
+        } else {
+            closure -> upvalues[i] = frame -> closure -> upvalues[index];
+        }
+    }
+    writeBarrier((Obj*) closure);
+}
+
+bool aotCall (int argCount) {
+    int frameCount = vm.frameCount;
+    if (!callValue(vm.stackTop[-1 - argCount], argCount)) return false;
+    return runPushedFrame(frameCount);
+}
+
+bool aotCallGlobal (Value name, int argCount) {
+    int frameCount = vm.frameCount;
+    if (!callGlobal(AS_STRING(name), argCount)) return false;
+    return runPushedFrame(frameCount);
+}
+
+bool aotInvoke (Value name, int argCount) {
+    int frameCount = vm.frameCount;
+    if (!invoke(AS_STRING(name), argCount)) return false;
+    return runPushedFrame(frameCount);
+}
+
+bool aotSuperInvoke (Value name, int argCount) {
+    int frameCount = vm.frameCount;
+    ObjClass* superClass = AS_CLASS(pop());
+    if (!invokeFromClass(superClass, AS_STRING(name), argCount)) return false;
+    return runPushedFrame(frameCount);
+}
+
+bool aotReturn (CallFrame* frame) {
+    closeUpvalues(frame -> slots); // can collect, the result is still on the stack
+    Value result = pop();
+    vm.frameCount--;
+
+    if (vm.frameCount == 0) {
+        pop();
+        return true;
+    }
+
+    vm.stackTop = frame -> slots;
+    push(result);
+    return true;
+}
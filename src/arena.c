@@ -0,0 +1,66 @@
+#include <string.h>
+
+#include "arena.h"
+#include "heap.h"
+
+#define ARENA_FIRST_BLOCK (16 * 1024)
+#define ARENA_MAX_BLOCK (1024 * 1024)
+
+struct ArenaBlock {
+    ArenaBlock* next;
+    size_t size;
+};
+
+#define ARENA_HEADER (heapCellSize(sizeof(ArenaBlock)))
+
+void initArena (Arena* arena) {
+    arena->blocks = NULL;
+    arena->next = NULL;
+    arena->end = NULL;
+    arena->last = NULL;
+}
+
+static void newBlock (Arena* arena, size_t needed) {
+    size_t size = arena->blocks == NULL ? ARENA_FIRST_BLOCK : arena->blocks->size * 2;
+    if (size > ARENA_MAX_BLOCK) size = ARENA_MAX_BLOCK;
+    if (size < ARENA_HEADER + needed) size = ARENA_HEADER + needed;
+
+    ArenaBlock* block = (ArenaBlock*) heapReallocate(NULL, 0, size);
+    block->next = arena->blocks;
+    block->size = size;
+    arena->blocks = block;
+    arena->next = (char*) block + ARENA_HEADER;
+    arena->end = (char*) block + size;
+}
+
+void* arenaAllocate (Arena* arena, size_t size) {
+    size = heapCellSize(size);
+    if (arena->next == NULL || (size_t)(arena->end - arena->next) < size) newBlock(arena, size);
+
+    void* result = arena->next;
+    arena->next += size;
+    arena->last = result;
+    return result;
+}
+
+void* arenaGrow (Arena* arena, void* pointer, size_t oldSize, size_t newSize) {
+    if (pointer != NULL && pointer == arena->last
+        && (size_t)(arena->end - (char*) pointer) >= heapCellSize(newSize)) {
+        arena->next = (char*) pointer + heapCellSize(newSize);
+        return pointer;
+    }
+
+    void* result = arenaAllocate(arena, newSize);
+    if (pointer != NULL) memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+    return result;
+}
+
+void freeArena (Arena* arena) {
+    ArenaBlock* block = arena->blocks;
+    while (block != NULL) {
+        ArenaBlock* next = block->next;
+        heapReallocate(block, block->size, 0);
+        block = next;
+    }
+    initArena(arena);
+}
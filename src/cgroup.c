@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "cgroup.h"
+
+#ifndef CGROUP_ROOT
+#define CGROUP_ROOT "/sys/fs/cgroup"
+#endif
+#ifndef CGROUP_SELF
+#define CGROUP_SELF "/proc/self/cgroup"
+#endif
+
+#define CGROUP_PATH 512
+#define CGROUP_NO_LIMIT ((size_t) 1 << 60) // v1 says "no limit" with a huge number
+
+static bool searched = false;
+static bool found = false;
+static bool isV2;
+static const char* rootDir; // the hierarchy's top, where the walk up stops
+static char groupDir[CGROUP_PATH * 2];
+
+// "max" is no limit
+static bool readBytes (const char* path, size_t* bytes) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) return false;
+
+    char text[32];
+    bool read = fgets(text, sizeof(text), file) != NULL;
+    fclose(file);
+    if (!read) return false;
+
+    unsigned long long value;
+    if (strncmp(text, "max", 3) == 0) {
+        *bytes = SIZE_MAX;
+    } else if (sscanf(text, "%llu", &value) == 1) {
+        *bytes = value >= CGROUP_NO_LIMIT ? SIZE_MAX : (size_t) value;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static bool readFile (const char* dir, const char* name, size_t* bytes) {
+    char path[CGROUP_PATH * 3];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    return readBytes(path, bytes);
+}
+
+static bool readLimit (const char* dir, size_t* limit) {
+    return readFile(dir, isV2 ? "memory.max" : "memory.limit_in_bytes", limit);
+}
+
+static bool readUsage (const char* dir, size_t* usage) {
+    return readFile(dir, isV2 ? "memory.current" : "memory.usage_in_bytes", usage);
+}
+
+static bool tryGroup (const char* dir, const char* root, bool v2) {
+    isV2 = v2;
+    size_t limit;
+    if (!readLimit(dir, &limit)) return false;
+
+    rootDir = root;
+    snprintf(groupDir, sizeof(groupDir), "%s", dir);
+    return true;
+}
+
+// /proc/self/cgroup has "0::/path" for v2 and "N:memory,...:/path" for the
+// v1 controller; the path is relative to the mount unless the process has a
+// cgroup namespace of its own, so the mount's top is tried too
+static void findGroup () {
+    searched = true;
+
+    char v2[CGROUP_PATH] = "";
+    char v1[CGROUP_PATH] = "";
+    bool hasV2 = false;
+    bool hasV1 = false;
+
+    FILE* file = fopen(CGROUP_SELF, "r");
+    if (file != NULL) {
+        char line[CGROUP_PATH];
+        while (fgets(line, sizeof(line), file) != NULL) {
+            line[strcspn(line, "\n")] = '\0';
+            char* controllers = strchr(line, ':');
+            if (controllers == NULL) continue;
+            char* path = strchr(controllers + 1, ':');
+            if (path == NULL) continue;
+            *controllers++ = '\0';
+            *path++ = '\0';
+
+            if (controllers[0] == '\0' && strcmp(line, "0") == 0) {
+                snprintf(v2, CGROUP_PATH, "%s", path);
+                hasV2 = true;
+            } else if (strstr(controllers, "memory") != NULL) {
+                snprintf(v1, CGROUP_PATH, "%s", path);
+                hasV1 = true;
+            }
+        }
+        fclose(file);
+    }
+
+    char dir[CGROUP_PATH * 2];
+    if (hasV2) {
+        snprintf(dir, sizeof(dir), CGROUP_ROOT "%s", v2);
+        if (tryGroup(dir, CGROUP_ROOT, true) || tryGroup(CGROUP_ROOT, CGROUP_ROOT, true)) {
+            found = true;
+            return;
+        }
+    }
+    if (hasV1) {
+        snprintf(dir, sizeof(dir), CGROUP_ROOT "/memory%s", v1);
+        if (tryGroup(dir, CGROUP_ROOT "/memory", false) || tryGroup(CGROUP_ROOT "/memory", CGROUP_ROOT "/memory", false)) {
+            found = true;
+        }
+    }
+}
+
+bool readMemoryStatus (MemoryStatus* status) {
+    if (!searched) findGroup();
+    if (!found) return false;
+
+    // read every time, the limits can be changed from outside; a group
+    // without a limit of its own can still sit in one that has, the group
+    // and every one above it count, the one with the least room left wins
+    char dir[CGROUP_PATH * 2];
+    snprintf(dir, sizeof(dir), "%s", groupDir);
+    bool limited = false;
+    for (;;) {
+        size_t limit;
+        size_t usage;
+        if (readLimit(dir, &limit) && limit != SIZE_MAX && readUsage(dir, &usage)) {
+            size_t room = usage < limit ? limit - usage : 0;
+            if (!limited || room < status->limit - status->usage) {
+                status->limit = limit;
+                status->usage = usage < limit ? usage : limit;
+                limited = true;
+            }
+        }
+
+        char* slash = strrchr(dir, '/');
+        if (strlen(dir) <= strlen(rootDir) || slash == NULL) break;
+        *slash = '\0';
+    }
+    if (!limited) return false;
+
+    // stalls are the process's own group's
+    status->pressure = 0;
+    if (isV2) {
+        char pressurePath[CGROUP_PATH * 3];
+        snprintf(pressurePath, sizeof(pressurePath), "%s/memory.pressure", groupDir);
+        FILE* file = fopen(pressurePath, "r");
+        if (file != NULL) {
+            if (fscanf(file, "some avg10=%lf", &status->pressure) != 1) status->pressure = 0;
+            fclose(file);
+        }
+    }
+    return true;
+}
@@ -1,5 +1,7 @@
 #include <stdlib.h>
+#include <string.h>
 
+#include "arena.h"
 #include "chunk.h"
 #include "memory.h"
 #include "value.h"
@@ -11,15 +13,24 @@ void initChunk (Chunk* chunk) {
     chunk->code = NULL;
     chunk->lines = NULL;
     initValueArray(&chunk -> constants);
+    chunk->handlers = NULL;
+    chunk->handlerCount = 0;
+    chunk->handlerCapacity = 0;
+    chunk->arena = NULL;
 }
 
+#define GROW_CHUNK_ARRAY(chunk, type, pointer, oldCount, newCount) \
+    ((chunk) -> arena != NULL \
+        ? (type*)arenaGrow((chunk) -> arena, pointer, sizeof(type) * (oldCount), sizeof(type) * (newCount)) \
+        : GROW_ARRAY(type, pointer, oldCount, newCount))
+
 void writeChunk (Chunk* chunk, uint8_t byte, int line) {
     // working with byte long data in chunks
     if (chunk->capacity < chunk -> count + 1) {
         int old_capacity = chunk -> capacity;
         chunk -> capacity = GROW_CAPACITY(old_capacity);
-        chunk -> code = GROW_ARRAY(uint8_t, chunk -> code, old_capacity, chunk -> capacity);
-        chunk -> lines = GROW_ARRAY(int, chunk -> lines, old_capacity, chunk -> capacity);
+        chunk -> code = GROW_CHUNK_ARRAY(chunk, uint8_t, chunk -> code, old_capacity, chunk -> capacity);
+        chunk -> lines = GROW_CHUNK_ARRAY(chunk, int, chunk -> lines, old_capacity, chunk -> capacity);
     }
 
     chunk -> code[chunk -> count] = byte;
@@ -28,16 +39,100 @@ void writeChunk (Chunk* chunk, uint8_t byte, int line) {
 }
 
 void freeChunk (Chunk* chunk) {
+    if (chunk -> arena != NULL) { // its arrays go with the arena
+        initChunk(chunk);
+        return;
+    }
+
     FREE_ARRAY(uint8_t, chunk -> code, chunk -> capacity);
     FREE_ARRAY(int, chunk -> lines, chunk -> capacity);
     freeValueArray(&chunk -> constants);
+    FREE_ARRAY(ExceptionHandler, chunk -> handlers, chunk -> handlerCapacity);
     initChunk(chunk);
 }
 
 int addConstant (Chunk* chunk, Value value) {
-    push(value);
-    writeValueArray(&chunk -> constants, value);
-    pop();
-    return chunk -> constants.count - 1;
+    if (chunk -> arena == NULL) {
+        push(value);
+        writeValueArray(&chunk -> constants, value);
+        pop();
+        return chunk -> constants.count - 1;
+    }
+
+    ValueArray* constants = &chunk -> constants;
+    if (constants -> capacity < constants -> count + 1) {
+        int old_capacity = constants -> capacity;
+        constants -> capacity = GROW_CAPACITY(old_capacity);
+        constants -> values = GROW_CHUNK_ARRAY(chunk, Value, constants -> values, old_capacity, constants -> capacity);
+    }
+    constants -> values[constants -> count] = value;
+    return constants -> count++;
+}
+
+void addHandler (Chunk* chunk, ExceptionHandler handler) {
+    if (chunk -> handlerCapacity < chunk -> handlerCount + 1) {
+        int old_capacity = chunk -> handlerCapacity;
+        chunk -> handlerCapacity = GROW_CAPACITY(old_capacity);
+        chunk -> handlers = GROW_CHUNK_ARRAY(chunk, ExceptionHandler, chunk -> handlers, old_capacity, chunk -> handlerCapacity);
+    }
+
+    chunk -> handlers[chunk -> handlerCount++] = handler;
+}
+
+// one right-sized heap array each for what was compiled into the arena
+static void* moveToHeap (const void* from, size_t size) {
+    if (size == 0) return NULL;
+
+    void* to = reallocate(NULL, 0, size);
+    memcpy(to, from, size);
+    return to;
 }
 
+void finishChunk (Chunk* chunk) {
+    if (chunk -> arena == NULL) return;
+
+    // the arena outlives this, a collection in between still reads the old arrays
+    chunk -> code = moveToHeap(chunk -> code, chunk -> count * sizeof(uint8_t));
+    chunk -> lines = moveToHeap(chunk -> lines, chunk -> count * sizeof(int));
+    chunk -> capacity = chunk -> count;
+
+    ValueArray* constants = &chunk -> constants;
+    constants -> values = moveToHeap(constants -> values, constants -> count * sizeof(Value));
+    constants -> capacity = constants -> count;
+
+    chunk -> handlers = moveToHeap(chunk -> handlers, chunk -> handlerCount * sizeof(ExceptionHandler));
+    chunk -> handlerCapacity = chunk -> handlerCount;
+
+    chunk -> arena = NULL;
+}
+
+int instructionLength (Chunk* chunk, int offset) {
+    switch (chunk -> code[offset]) {
+        case OP_CONSTANT: case OP_CHECK_NUM_LOCAL:
+        case OP_DEFINE_GLOBAL: case OP_GET_GLOBAL: case OP_SET_GLOBAL:
+        case OP_GET_LOCAL: case OP_SET_LOCAL: case OP_GET_UPVALUE: case OP_SET_UPVALUE:
+        case OP_CALL: case OP_CLASS: case OP_GET_PROPERTY: case OP_SET_PROPERTY:
+        case OP_METHOD: case OP_GET_SUPER:
+            return 2;
+
+        case OP_JUMP: case OP_JUMP_IF_FALSE: case OP_JUMP_BACK:
+        case OP_INVOKE: case OP_SUPER_INVOKE:
+        case OP_MOVE: case OP_LOAD_CONSTANT:
+            return 3;
+
+        case OP_ADD_RR: case OP_SUBTRACT_RR: case OP_MULTIPLY_RR: case OP_DIVIDE_RR:
+        case OP_GREATER_RR: case OP_LESS_RR:
+        case OP_ADD_RK: case OP_SUBTRACT_RK: case OP_MULTIPLY_RK: case OP_DIVIDE_RK:
+        case OP_GREATER_RK: case OP_LESS_RK:
+        case OP_INTRINSIC:
+            return 4;
+
+        case OP_CLOSURE: {
+            ObjFunction* function = AS_FUNCTION(chunk -> constants.values[chunk -> code[offset + 1]]);
+            return 2 + 2 * function -> upValuesCount;
+        }
+
+        default:
+            return 1;
+    }
+}
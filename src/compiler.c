@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <math.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -12,16 +13,26 @@
 #include "object.h"
 #include "hashmap.h"
 #include "memory.h"
+#include "arena.h"
+#include "vm.h"
+#include "intrinsics.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
 #endif
 
+// static type of an expression, known only through 'num' annotations
+typedef enum {
+    HINT_ANY,
+    HINT_NUM,
+} TypeHint;
+
 typedef struct {
     Token current;
     Token previous;
     bool hadError;
     bool panicMode;
+    TypeHint hint; // type of the last compiled expression
 } Parser;
 
 typedef enum {
@@ -32,8 +43,12 @@ typedef enum {
     PREC_AND,         // and
     PREC_EQUALITY,    // == !=
     PREC_COMPARISON,  // < > <= >=
+    PREC_BIT_OR,      // |
+    PREC_BIT_XOR,     // ^
+    PREC_BIT_AND,     // &
+    PREC_SHIFT,       // << >>
     PREC_TERM,        // + -
-    PREC_FACTOR,      // * /
+    PREC_FACTOR,      // * / %
     PREC_UNARY,       // ! -
     PREC_CALL,        // . ()
     PREC_PRIMARY
@@ -52,11 +67,13 @@ typedef struct {
     int depth;
     bool isCaptured;
     Token name;
+    TypeHint hint;
 } Local;
 
 typedef struct {
     uint8_t index;
     bool isLocal;
+    TypeHint hint;
 } Upvalue;
 
 typedef enum {
@@ -71,12 +88,21 @@ typedef struct Compiler {
 
     ObjFunction* function;
     FunctionType ftype;
+    TypeHint returnHint;
 
     Local locals[UINT8_MAX + 1];
     int localCount;
     int scopeDepth;
 
     Upvalue upValues [UINT8_COUNT];
+
+    // register code: where the last fusable instructions start, fusion
+    // never reaches back over the last jump target
+    int lastGetLocal;
+    int lastSetLocal;
+    int lastConstant;
+    int lastRegister;
+    int lastLabel;
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -88,6 +114,7 @@ Parser parser;
 Compiler* current = NULL;
 ClassCompiler* currentClass = NULL;
 Chunk* compilingChunk;
+Arena arena; // the chunks being compiled grow in here
 
 // ========= Parsing Declarations =========
 
@@ -96,10 +123,13 @@ static void statement ();
 static void declaration ();
 static void varDeclaration ();
 static uint8_t parseVariable (const char* msg);
+static TypeHint typeAnnotation ();
 static void function (FunctionType ftype);
 static void expressionStatement ();
+static Token syntheticToken (const char* text);
 static void beginScope ();
 static void endScope ();
+static uint8_t parseArguments ();
 static ParserRule* getRule (TokenType type);
 static void parsePrecedence (Precedence precedence);
 
@@ -155,9 +185,25 @@ static void emitBytes (uint8_t b1, uint8_t b2) {
 }
 
 static void emitConstant (Value val) {
+    current -> lastConstant = currentChunk() -> count;
     emitBytes(OP_CONSTANT, makeConstant(val));
 }
 
+// the current offset is a jump target
+static int markLabel () {
+    current -> lastLabel = currentChunk() -> count;
+    return current -> lastLabel;
+}
+
+// drop the tail of the chunk that is being rewritten
+static void rewindTo (int offset) {
+    currentChunk() -> count = offset;
+    current -> lastGetLocal = -1;
+    current -> lastSetLocal = -1;
+    current -> lastConstant = -1;
+    current -> lastRegister = -1;
+}
+
 static int emitJump (uint8_t instruction) {
     emitByte(instruction);
 
@@ -192,7 +238,7 @@ static void emitJumpBack (int start) {
 
 static void patchJump (int offset) {
     // size of the chunk after parsing statements
-    int top = currentChunk() -> count;
+    int top = markLabel();
 
     // -2 offsets for the bytes used for the jump instruction
     int jump = top - offset - 2;
@@ -211,20 +257,51 @@ static void emitReturn () {
         emitBytes(OP_GET_LOCAL, 0);
     } else {
         emitByte(OP_NIL);
+        // falling off the end of a 'num' function is an annotation violation
+        if (current -> returnHint == HINT_NUM) emitByte(OP_CHECK_NUM);
     }
     emitByte(OP_RETURN);
 }
+
+// turns the integer literal loaded at offset into a double, 'num' is a
+// double so this is the promotion OP_CHECK_NUM would do at run time
+static bool promoteConstant (int offset) {
+    Chunk* chunk = currentChunk();
+    if (offset < 0 || chunk -> code[offset] != OP_CONSTANT) return false;
+
+    Value value = chunk -> constants.values[chunk -> code[offset + 1]];
+    if (!IS_INT(value)) return false;
+
+    chunk -> code[offset + 1] = makeConstant(NUMBER_VAL((double) AS_INT(value)));
+    return true;
+}
+
+// guard a value entering a typed slot unless it is statically known to fit
+static void emitGuard (TypeHint target) {
+    if (target == HINT_NUM && parser.hint != HINT_NUM) {
+        int last = currentChunk() -> count - 2;
+        if (current -> lastConstant == last && promoteConstant(last)) {
+            parser.hint = HINT_NUM;
+            return;
+        }
+        emitByte(OP_CHECK_NUM);
+    }
+}
 static ObjFunction* endCompiler () {
     emitReturn();
 
     ObjFunction* func = current -> function;
+    writeBarrier((Obj*) func); // got its constants without barriers
 
     #ifdef DEBUG_PRINT_CODE
     if (!parser.hadError) {
-        disassembleChunk(currentChunk(), func -> name != NULL ? func -> name -> chars : "<script>");
+        ObjString* name = DEREF(ObjString, func -> name);
+        disassembleChunk(currentChunk(), name != NULL ? name -> chars : "<script>");
     }
 #endif
 
+    // still a root here, moving the arrays can collect
+    finishChunk(&func -> chunk);
     current = current -> enclosing;
     return func;
 }
@@ -233,19 +310,28 @@ static void initCompiler (Compiler* compiler, FunctionType ftype) {
     compiler -> enclosing = current;
     compiler -> function = NULL;
     compiler -> ftype = ftype;
+    compiler -> returnHint = HINT_ANY;
 
     compiler -> localCount = 0;
     compiler -> scopeDepth = 0;
 
+    compiler -> lastGetLocal = -1;
+    compiler -> lastSetLocal = -1;
+    compiler -> lastConstant = -1;
+    compiler -> lastRegister = -1;
+    compiler -> lastLabel = 0;
+
     compiler -> function = newFunction();
+    compiler -> function -> chunk.arena = &arena;
     current = compiler;
 
     if (ftype != TYPE_SCRIPT) {
-        current -> function -> name = copyString(parser.previous.start, parser.previous.length);
+        current -> function -> name = REF(copyString(parser.previous.start, parser.previous.length));
     }
 
     Local* local = &current -> locals[current -> localCount++];
     local->isCaptured = false;
+    local->hint = HINT_ANY;
 
     if (ftype != TYPE_FUNCTION) {
         local -> name.start = "this"; // reserved in the VM stack for the first call frame (aka the main function)
@@ -316,9 +402,10 @@ static void addLocal (Token name) {
     local -> name = name;
     local -> depth = -1; // not initialized
     local ->isCaptured = false;
+    local -> hint = HINT_ANY;
 }
 
-static int addUpvalue (Compiler* compiler, uint8_t index, bool isLocal) {
+static int addUpvalue (Compiler* compiler, uint8_t index, bool isLocal, TypeHint hint) {
     int upValueCount = compiler -> function -> upValuesCount;
     for (int i = 0; i < upValueCount; i++) {
         Upvalue* upvalue = &compiler -> upValues[i];
@@ -334,6 +421,7 @@ static int addUpvalue (Compiler* compiler, uint8_t index, bool isLocal) {
 
     compiler -> upValues[upValueCount].isLocal = isLocal;
     compiler -> upValues[upValueCount].index = index;
+    compiler -> upValues[upValueCount].hint = hint;
 
 
     return compiler -> function -> upValuesCount++;
@@ -359,12 +447,14 @@ static int resolveUpvalue (Compiler* compiler, Token* name) {
     int local = resolveLocal(compiler -> enclosing, name);
     if (local != -1) {
         compiler ->enclosing->locals[local].isCaptured = true;
-        return addUpvalue (compiler, (uint8_t) local, true);
+        return addUpvalue (compiler, (uint8_t) local, true,
+                           compiler -> enclosing -> locals[local].hint);
     }
 
     int upValue = resolveUpvalue(compiler -> enclosing, name);
     if (upValue != -1)
-        return addUpvalue(compiler, (uint8_t) upValue, false);
+        return addUpvalue(compiler, (uint8_t) upValue, false,
+                          compiler -> enclosing -> upValues[upValue].hint);
 
     return -1;
 }
@@ -401,26 +491,43 @@ static void defineVariable (uint8_t global) {
 
 static void namedVariable (Token name, bool canAssign) {
     u_int8_t getOp, setOp;
+    TypeHint hint = HINT_ANY; // globals can be rebound from anywhere
 
     int arg = resolveLocal(current, &name);
     if (arg != -1) {
         getOp = OP_GET_LOCAL;
         setOp = OP_SET_LOCAL;
+        hint = current -> locals[arg].hint;
     } else if ((arg = resolveUpvalue(current, &name)) != -1 ) {
         getOp = OP_GET_UPVALUE;
         setOp = OP_SET_UPVALUE;
+        hint = current -> upValues[arg].hint;
     } else {
         arg = identifierConstant(&name); // store the identifier as a string in te hash table
         getOp = OP_GET_GLOBAL;
         setOp = OP_SET_GLOBAL;
+
+        // calls to math builtins skip the global lookup while it isn't rebound
+        int intrinsic = findIntrinsic(name.start, name.length);
+        if (intrinsic != -1 && match(TOKEN_LEFT_PAREN)) {
+            uint8_t argCount = parseArguments();
+            emitBytes(OP_INTRINSIC, (uint8_t)arg);
+            emitBytes(argCount, (uint8_t)intrinsic);
+            parser.hint = HINT_ANY;
+            return;
+        }
     }
 
     if (match(TOKEN_EQUAL) && canAssign) {
         parsePrecedence(PREC_ASSIGNMENT);
+        emitGuard(hint);
+        if (setOp == OP_SET_LOCAL) current -> lastSetLocal = currentChunk() -> count;
         emitBytes(setOp, (uint8_t)arg);
     } else {
+        if (getOp == OP_GET_LOCAL) current -> lastGetLocal = currentChunk() -> count;
         emitBytes(getOp, (uint8_t)arg);
     }
+    parser.hint = hint;
 }
 
 static uint8_t parseArguments () {
@@ -461,6 +568,9 @@ static void synchonize () {
             case TOKEN_CONTINUE:
             case TOKEN_BREAK:
             case TOKEN_RETURN:
+            case TOKEN_TRY:
+            case TOKEN_THROW:
+            case TOKEN_REGION:
                 return;
 
             default:
@@ -471,32 +581,152 @@ static void synchonize () {
     }
 }
 
+// ========= Register code =========
+
+// 'a op b' where a is a local just read at leftAt and b a local or a
+// constant read right after it becomes one instruction on the frame slots
+static bool fuseRegisterOp (TokenType opType, int leftAt) {
+    Chunk* chunk = currentChunk();
+    if (chunk -> count != leftAt + 4 || current -> lastLabel > leftAt) return false;
+
+    bool constant;
+    if (current -> lastGetLocal == leftAt + 2) {
+        constant = false;
+    } else if (current -> lastConstant == leftAt + 2) {
+        constant = true;
+    } else {
+        return false;
+    }
+
+    uint8_t op;
+    bool negate = false;
+    switch (opType) {
+        case TOKEN_PLUS: op = constant ? OP_ADD_RK : OP_ADD_RR; break;
+        case TOKEN_MINUS: op = constant ? OP_SUBTRACT_RK : OP_SUBTRACT_RR; break;
+        case TOKEN_STAR: op = constant ? OP_MULTIPLY_RK : OP_MULTIPLY_RR; break;
+        case TOKEN_SLASH: op = constant ? OP_DIVIDE_RK : OP_DIVIDE_RR; break;
+        case TOKEN_LESS: op = constant ? OP_LESS_RK : OP_LESS_RR; break;
+        case TOKEN_GREATER: op = constant ? OP_GREATER_RK : OP_GREATER_RR; break;
+        case TOKEN_LESS_EQUAL: op = constant ? OP_GREATER_RK : OP_GREATER_RR; negate = true; break;
+        case TOKEN_GREATER_EQUAL: op = constant ? OP_LESS_RK : OP_LESS_RR; negate = true; break;
+        default: return false;
+    }
+
+    uint8_t a = chunk -> code[leftAt + 1];
+    uint8_t b = chunk -> code[leftAt + 3];
+
+    rewindTo(leftAt);
+    current -> lastRegister = leftAt;
+    emitBytes(op, REG_STACK);
+    emitBytes(a, b);
+    if (negate) emitByte(OP_NOT);
+    return true;
+}
+
+// pop the value of an expression statement, with register code a plain
+// assignment to a local stores straight into its slot instead
+static void emitPop () {
+    Chunk* chunk = currentChunk();
+    int setAt = chunk -> count - 2;
+
+    if (vm.registerCode && current -> lastSetLocal == setAt) {
+        uint8_t dst = chunk -> code[setAt + 1];
+
+        if (current -> lastRegister == setAt - 4 && current -> lastLabel <= setAt - 4
+                && dst != REG_STACK) {
+            rewindTo(setAt);
+            chunk -> code[setAt - 3] = dst;
+            return;
+        }
+
+        if (current -> lastLabel <= setAt - 2) {
+            uint8_t src = chunk -> code[setAt - 1];
+
+            if (current -> lastGetLocal == setAt - 2) {
+                rewindTo(setAt - 2);
+                emitBytes(OP_MOVE, dst);
+                emitByte(src);
+                return;
+            }
+            if (current -> lastConstant == setAt - 2) {
+                rewindTo(setAt - 2);
+                emitBytes(OP_LOAD_CONSTANT, dst);
+                emitByte(src);
+                return;
+            }
+        }
+    }
+
+    emitByte(OP_POP);
+}
+
 // ========= Parsing tokens =========
 
 static void binary (bool canAssign) {
     TokenType opType = parser.previous.ttype;
+    TypeHint leftHint = parser.hint;
+
+    int leftAt = currentChunk() -> count - 2;
+    bool leftLocal = vm.registerCode && current -> lastGetLocal == leftAt;
+    bool leftConstant = current -> lastConstant == leftAt;
 
     ParserRule* rule = getRule (opType);
     parsePrecedence((Precedence) (rule -> precedence + 1));
 
-    switch (opType) {
-        case TOKEN_PLUS: emitByte(OP_ADD); break;
-        case TOKEN_MINUS: emitByte(OP_SUBTRACT); break;
-        case TOKEN_STAR: emitByte(OP_MULTIPLY); break;
-        case TOKEN_SLASH: emitByte(OP_DIVIDE); break;
+    // an integer literal meeting a proven double is a double already
+    int rightAt = currentChunk() -> count - 2;
+    bool bitwise = opType == TOKEN_AMPERSAND || opType == TOKEN_PIPE || opType == TOKEN_CARET
+                || opType == TOKEN_LESS_LESS || opType == TOKEN_GREATER_GREATER;
+    if (!bitwise && leftHint == HINT_NUM && parser.hint != HINT_NUM
+            && current -> lastConstant == rightAt && promoteConstant(rightAt)) {
+        parser.hint = HINT_NUM;
+    } else if (!bitwise && parser.hint == HINT_NUM && leftHint != HINT_NUM
+            && leftConstant && promoteConstant(leftAt)) {
+        leftHint = HINT_NUM;
+    }
+
+    // both operands proven numbers -> skip the runtime type dispatch
+    bool numeric = leftHint == HINT_NUM && parser.hint == HINT_NUM;
+
+    if (leftLocal && fuseRegisterOp(opType, leftAt)) {
+        // operands read straight from the frame
+    } else switch (opType) {
+        case TOKEN_PLUS: emitByte(numeric ? OP_ADD_NUM : OP_ADD); break;
+        case TOKEN_MINUS: emitByte(numeric ? OP_SUBTRACT_NUM : OP_SUBTRACT); break;
+        case TOKEN_STAR: emitByte(numeric ? OP_MULTIPLY_NUM : OP_MULTIPLY); break;
+        case TOKEN_SLASH: emitByte(numeric ? OP_DIVIDE_NUM : OP_DIVIDE); break;
+        case TOKEN_PERCENT: emitByte(OP_MODULO); break;
+
+        case TOKEN_AMPERSAND: emitByte(OP_BIT_AND); break;
+        case TOKEN_PIPE: emitByte(OP_BIT_OR); break;
+        case TOKEN_CARET: emitByte(OP_BIT_XOR); break;
+        case TOKEN_LESS_LESS: emitByte(OP_SHIFT_LEFT); break;
+        case TOKEN_GREATER_GREATER: emitByte(OP_SHIFT_RIGHT); break;
 
         case TOKEN_EQUAL_EQUAL: emitByte(OP_EQUAL); break;
         case TOKEN_BANG_EQUAL: emitByte(OP_EQUAL); emitByte(OP_NOT); break;
 
-        case TOKEN_LESS: emitByte(OP_LESS); break;
-        case TOKEN_LESS_EQUAL: emitByte(OP_GREATER); emitByte(OP_NOT); break;
+        case TOKEN_LESS: emitByte(numeric ? OP_LESS_NUM : OP_LESS); break;
+        case TOKEN_LESS_EQUAL: emitByte(numeric ? OP_GREATER_NUM : OP_GREATER); emitByte(OP_NOT); break;
 
-        case TOKEN_GREATER: emitByte(OP_GREATER); break;
-        case TOKEN_GREATER_EQUAL: emitByte(OP_LESS); emitByte(OP_NOT); break;
+        case TOKEN_GREATER: emitByte(numeric ? OP_GREATER_NUM : OP_GREATER); break;
+        case TOKEN_GREATER_EQUAL: emitByte(numeric ? OP_LESS_NUM : OP_LESS); emitByte(OP_NOT); break;
 
         default: // unreachable
             return;
     }
+
+    switch (opType) {
+        case TOKEN_PLUS:
+        case TOKEN_MINUS:
+        case TOKEN_STAR:
+        case TOKEN_SLASH:
+            parser.hint = numeric ? HINT_NUM : HINT_ANY;
+            break;
+        default:
+            parser.hint = HINT_ANY;
+            break;
+    }
 }
 
 static void and_ (bool canAssign) {
@@ -510,6 +740,7 @@ static void and_ (bool canAssign) {
     // expr2 left on stack (since expr1 is true the result of and it equal to expr2)
 
     patchJump(and_off);
+    parser.hint = HINT_ANY;
 }
 
 static void or_ (bool canAssign) {
@@ -522,12 +753,35 @@ static void or_ (bool canAssign) {
     parsePrecedence(PREC_OR);
 
     patchJump(expr1_true);
+    parser.hint = HINT_ANY;
 
 }
 
+// literals without a fraction are integers unless they don't fit in 64 bits
 static void number (bool canAssign) {
-    double value = strtod(parser.previous.start, NULL);
+    const char* start = parser.previous.start;
+    int length = parser.previous.length;
+
+    if (length > 2 && (start[1] == 'x' || start[1] == 'X')) {
+        // hex is the bit pattern, 0xffffffffffffffff is -1
+        emitConstant(INT_VAL((int64_t) strtoull(start, NULL, 16)));
+        parser.hint = HINT_ANY;
+        return;
+    }
+
+    if (memchr(start, '.', length) == NULL) {
+        errno = 0;
+        long long value = strtoll(start, NULL, 10);
+        if (errno != ERANGE) {
+            emitConstant(INT_VAL((int64_t) value));
+            parser.hint = HINT_ANY; // 'num' means double, see promoteConstant
+            return;
+        }
+    }
+
+    double value = strtod(start, NULL);
     emitConstant(NUMBER_VAL(value));
+    parser.hint = HINT_NUM;
 }
 
 static void string (bool canAssign) {
@@ -549,8 +803,13 @@ static void unary (bool canAssign) {
     // emit the operator funcion
     switch (opType)
     {
-    case TOKEN_MINUS: emitByte(OP_NEGATE); break;
-    case TOKEN_BANG: emitByte(OP_NOT); break;
+    case TOKEN_MINUS:
+        emitByte(parser.hint == HINT_NUM ? OP_NEGATE_NUM : OP_NEGATE);
+        break;
+    case TOKEN_BANG:
+        emitByte(OP_NOT);
+        parser.hint = HINT_ANY;
+        break;
 
     default:
         break;
@@ -561,6 +820,7 @@ static void call (bool canAssign) {
     // '(' is consumed
     uint8_t n_args = parseArguments();
     emitBytes(OP_CALL, n_args);
+    parser.hint = HINT_ANY;
 }
 
 static void dot (bool canAssign) {
@@ -577,6 +837,7 @@ static void dot (bool canAssign) {
     } else {
         emitBytes(OP_GET_PROPERTY, name);
     }
+    parser.hint = HINT_ANY;
 }
 
 static void literal (bool canAssign) {
@@ -608,6 +869,7 @@ static void ternary (bool canAssign) {
 
     parsePrecedence(PREC_ASSIGNMENT);
     patchJump(exit);
+    parser.hint = HINT_ANY;
 }
 
 static void comma (bool canAssign) {
@@ -675,7 +937,7 @@ static void ifStatement () {
 static void whileStatement () {
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while' statement");
 
-    int loop_start = currentChunk() -> count;
+    int loop_start = markLabel();
 
     // printf("Loop start: %d\n", loop_start);
 
@@ -712,7 +974,7 @@ static void forStatement () {
         expressionStatement();
     }
 
-    int start_loop = currentChunk() -> count;
+    int start_loop = markLabel();
 
     // condition
     int exit_jump = -1;
@@ -729,14 +991,14 @@ static void forStatement () {
 
     int body_jump = emitJump(OP_JUMP);
 
-    int increment_start = currentChunk() -> count;
+    int increment_start = markLabel();
 
     // check for increment
     if (match(TOKEN_RIGHT_PAREN)) {
         // no increment
     } else {
         expression ();
-        emitByte(OP_POP);
+        emitPop();
         consume(TOKEN_RIGHT_PAREN, "Expect ')' after the loop initializer");
     }
 
@@ -757,6 +1019,61 @@ static void forStatement () {
     endScope();
 }
 
+static void tryStatement () {
+    // slots in use when the catch takes over, everything above is dropped
+    int stackDepth = current -> localCount;
+    int start = markLabel();
+
+    consume(TOKEN_LEFT_BRACE, "Expect '{' after 'try'");
+    beginScope();
+    blockStatement();
+    endScope();
+
+    int end = currentChunk() -> count;
+    int skipCatch = emitJump(OP_JUMP);
+
+    consume(TOKEN_CATCH, "Expect 'catch' after try block");
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'catch'");
+
+    // the vm pushes the exception, it becomes the catch variable
+    beginScope();
+    int handler = markLabel();
+    consume(TOKEN_IDENTIFIER, "Expect exception variable name");
+    declareVariable();
+    markInitialized();
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after exception variable");
+
+    consume(TOKEN_LEFT_BRACE, "Expect '{' before catch body");
+    blockStatement();
+    endScope();
+
+    patchJump(skipCatch);
+
+    ExceptionHandler entry = { start, end, handler, stackDepth };
+    addHandler(currentChunk(), entry);
+}
+
+// what the block allocates goes to a heap region (memory.h: enterRegion),
+// collected as the block is left; its hidden slot is closed like a captured
+// local so a return or an exception leaves the region as well
+static void regionStatement () {
+    consume(TOKEN_LEFT_BRACE, "Expect '{' after 'region'");
+    beginScope();
+    emitByte(OP_REGION);
+    addLocal(syntheticToken(""));
+    markInitialized();
+    current -> locals[current -> localCount - 1].isCaptured = true;
+
+    blockStatement();
+    endScope();
+}
+
+static void throwStatement () {
+    expression();
+    consume(TOKEN_SEMICOLON, "Expect ';' after thrown value");
+    emitByte(OP_THROW);
+}
+
 static void breakStatement () {
 
 }
@@ -778,6 +1095,7 @@ static void returnStatement () {
         }
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after the return value.");
+        emitGuard(current -> returnHint);
         emitByte(OP_RETURN);
     }
 }
@@ -797,14 +1115,23 @@ static void function (FunctionType ftype) {
                 errorAtCurrent("Can't have more than 255 paremeters.");
             }
             uint8_t constant = parseVariable("Expect parameter name.");
+            current -> locals[current -> localCount - 1].hint = typeAnnotation();
             defineVariable(constant);
         } while (match(TOKEN_COMMA));
     }
 
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after function name.");
+    current -> returnHint = typeAnnotation();
 
     consume(TOKEN_LEFT_BRACE, "Expect '{' after parameter list.");
 
+    // one guard per annotated parameter at function entry
+    for (int i = 1; i < current -> localCount; i++) {
+        if (current -> locals[i].hint == HINT_NUM) {
+            emitBytes(OP_CHECK_NUM_LOCAL, (uint8_t) i);
+        }
+    }
+
     blockStatement(); // consumes the trailing bracket
 
     ObjFunction* function = endCompiler();
@@ -833,7 +1160,7 @@ static void method () {
 static void expressionStatement () {
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after expression");
-    emitByte(OP_POP); // to return the stack to its original state
+    emitPop(); // to return the stack to its original state
 }
 
 static uint8_t parseVariable (const char* msg) {
@@ -849,6 +1176,20 @@ static void variable (bool canAssign) {
     namedVariable(parser.previous, canAssign);
 }
 
+// optional ': type' after a variable, parameter or parameter list
+static TypeHint typeAnnotation () {
+    if (!match(TOKEN_COLON)) return HINT_ANY;
+
+    consume(TOKEN_IDENTIFIER, "Expect type name after ':'.");
+    Token* name = &parser.previous;
+
+    if (name -> length == 3 && memcmp(name -> start, "num", 3) == 0) return HINT_NUM;
+    if (name -> length == 3 && memcmp(name -> start, "any", 3) == 0) return HINT_ANY;
+
+    errorAt(name, "Unknown type name.");
+    return HINT_ANY;
+}
+
 static Token syntheticToken (const char* text) {
     Token token;
     token.start = text;
@@ -913,6 +1254,14 @@ ParserRule rules [] = {
     [TOKEN_PLUS] = {NULL, binary, PREC_TERM},
     [TOKEN_STAR] = {NULL, binary, PREC_FACTOR},
     [TOKEN_SLASH] = {NULL, binary, PREC_FACTOR},
+    [TOKEN_PERCENT] = {NULL, binary, PREC_FACTOR},
+
+    // bitwise
+    [TOKEN_AMPERSAND] = {NULL, binary, PREC_BIT_AND},
+    [TOKEN_PIPE] = {NULL, binary, PREC_BIT_OR},
+    [TOKEN_CARET] = {NULL, binary, PREC_BIT_XOR},
+    [TOKEN_LESS_LESS] = {NULL, binary, PREC_SHIFT},
+    [TOKEN_GREATER_GREATER] = {NULL, binary, PREC_SHIFT},
 
     // the rest
 
@@ -994,6 +1343,12 @@ static void statement () {
         breakStatement();
     } else if (match(TOKEN_RETURN)) {
         returnStatement();
+    } else if (match(TOKEN_TRY)) {
+        tryStatement();
+    } else if (match(TOKEN_THROW)) {
+        throwStatement();
+    } else if (match(TOKEN_REGION)) {
+        regionStatement();
     } else {
         expressionStatement ();
     }
@@ -1005,15 +1360,24 @@ static void varDeclaration () {
 
     // consume the identifier
     uint8_t global = parseVariable("Expect variable name");
+    TypeHint hint = typeAnnotation();
 
     if (match(TOKEN_EQUAL)) {
         expression();
+        emitGuard(hint);
+    } else if (hint == HINT_NUM) {
+        emitConstant(NUMBER_VAL(0));
     } else {
         emitByte(OP_NIL);
     }
 
     consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration");
 
+    // the hint only sticks to locals, globals can be rebound from anywhere
+    if (current -> scopeDepth > 0) {
+        current -> locals[current -> localCount - 1].hint = hint;
+    }
+
     defineVariable(global);
 }
 
@@ -1107,6 +1471,7 @@ static void parsePrecedence (Precedence precedence) {
     }
 
     bool canAssign = precedence <= PREC_ASSIGNMENT;
+    parser.hint = HINT_ANY;
     prefixRule(canAssign);
 
     while (precedence <= getRule(parser.current.ttype) -> precedence) {
@@ -1143,12 +1508,15 @@ ObjFunction* compile (const char* source) {
     }
 
     ObjFunction* func = endCompiler();
+    freeArena(&arena);
     return parser.hadError ? NULL : func;
 }
 
 void markCompilerRoots () {
     Compiler* compiler = current;
     while (compiler != NULL) {
+        // constants are added without barriers, scan the whole function
+        writeBarrier((Obj*) compiler -> function);
         markObject((Obj*) compiler -> function);
         compiler = compiler -> enclosing;
     }
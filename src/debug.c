@@ -4,6 +4,87 @@
 #include "debug.h"
 #include "object.h"
 
+static const char* opcodeNames[] = {
+    [OP_RETURN] = "OP_RETURN",
+    [OP_CONSTANT] = "OP_CONSTANT",
+    [OP_NEGATE] = "OP_NEGATE",
+    [OP_TRUE] = "OP_TRUE",
+    [OP_FALSE] = "OP_FALSE",
+    [OP_NIL] = "OP_NIL",
+    [OP_EQUAL] = "OP_EQUAL",
+    [OP_GREATER] = "OP_GREATER",
+    [OP_LESS] = "OP_LESS",
+    [OP_NOT] = "OP_NOT",
+    [OP_OR] = "OP_OR",
+    [OP_AND] = "OP_AND",
+    [OP_ADD] = "OP_ADD",
+    [OP_SUBTRACT] = "OP_SUBTRACT",
+    [OP_MULTIPLY] = "OP_MULTIPLY",
+    [OP_DIVIDE] = "OP_DIVIDE",
+    [OP_MODULO] = "OP_MODULO",
+    [OP_BIT_AND] = "OP_BIT_AND",
+    [OP_BIT_OR] = "OP_BIT_OR",
+    [OP_BIT_XOR] = "OP_BIT_XOR",
+    [OP_SHIFT_LEFT] = "OP_SHIFT_LEFT",
+    [OP_SHIFT_RIGHT] = "OP_SHIFT_RIGHT",
+    [OP_ADD_NUM] = "OP_ADD_NUM",
+    [OP_SUBTRACT_NUM] = "OP_SUBTRACT_NUM",
+    [OP_MULTIPLY_NUM] = "OP_MULTIPLY_NUM",
+    [OP_DIVIDE_NUM] = "OP_DIVIDE_NUM",
+    [OP_NEGATE_NUM] = "OP_NEGATE_NUM",
+    [OP_GREATER_NUM] = "OP_GREATER_NUM",
+    [OP_LESS_NUM] = "OP_LESS_NUM",
+    [OP_CHECK_NUM] = "OP_CHECK_NUM",
+    [OP_CHECK_NUM_LOCAL] = "OP_CHECK_NUM_LOCAL",
+    [OP_ADD_RR] = "OP_ADD_RR",
+    [OP_SUBTRACT_RR] = "OP_SUBTRACT_RR",
+    [OP_MULTIPLY_RR] = "OP_MULTIPLY_RR",
+    [OP_DIVIDE_RR] = "OP_DIVIDE_RR",
+    [OP_GREATER_RR] = "OP_GREATER_RR",
+    [OP_LESS_RR] = "OP_LESS_RR",
+    [OP_ADD_RK] = "OP_ADD_RK",
+    [OP_SUBTRACT_RK] = "OP_SUBTRACT_RK",
+    [OP_MULTIPLY_RK] = "OP_MULTIPLY_RK",
+    [OP_DIVIDE_RK] = "OP_DIVIDE_RK",
+    [OP_GREATER_RK] = "OP_GREATER_RK",
+    [OP_LESS_RK] = "OP_LESS_RK",
+    [OP_MOVE] = "OP_MOVE",
+    [OP_LOAD_CONSTANT] = "OP_LOAD_CONSTANT",
+    [OP_CONSTANT_LONG] = "OP_CONSTANT_LONG",
+    [OP_PRINT] = "OP_PRINT",
+    [OP_POP] = "OP_POP",
+    [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+    [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+    [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+    [OP_SET_LOCAL] = "OP_SET_LOCAL",
+    [OP_GET_LOCAL] = "OP_GET_LOCAL",
+    [OP_GET_UPVALUE] = "OP_GET_UPVALUE",
+    [OP_SET_UPVALUE] = "OP_SET_UPVALUE",
+    [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+    [OP_JUMP] = "OP_JUMP",
+    [OP_JUMP_BACK] = "OP_JUMP_BACK",
+    [OP_CALL] = "OP_CALL",
+    [OP_CLOSURE] = "OP_CLOSURE",
+    [OP_CLOSE_CAPTURE] = "OP_CLOSE_CAPTURE",
+    [OP_CLASS] = "OP_CLASS",
+    [OP_GET_PROPERTY] = "OP_GET_PROPERTY",
+    [OP_SET_PROPERTY] = "OP_SET_PROPERTY",
+    [OP_METHOD] = "OP_METHOD",
+    [OP_INHERIT] = "OP_INHERIT",
+    [OP_GET_SUPER] = "OP_GET_SUPER",
+    [OP_INVOKE] = "OP_INVOKE",
+    [OP_SUPER_INVOKE] = "OP_SUPER_INVOKE",
+    [OP_INTRINSIC] = "OP_INTRINSIC",
+    [OP_THROW] = "OP_THROW",
+    [OP_REGION] = "OP_REGION",
+};
+
+// the opcode's name, for reports outside the disassembler
+const char* opcodeName (uint8_t opcode) {
+    if (opcode >= sizeof(opcodeNames) / sizeof(opcodeNames[0]) || opcodeNames[opcode] == NULL) return "OP_?";
+    return opcodeNames[opcode];
+}
+
 static int simpleInstruction (const char* name, int offset) {
     printf("%s\n", name);
     return offset + 1;
@@ -40,6 +121,30 @@ static int invokeInstruction(const char* name, Chunk* chunk, int offset) {
     return offset + 3;
 }
 
+static int slot (uint8_t operand) {
+    return operand == REG_STACK ? -1 : operand; // -1: pushed on the stack
+}
+
+static int registerInstruction (const char* name, Chunk* chunk, int offset) {
+    uint8_t* operands = chunk -> code + offset + 1;
+    printf("%-16s %4d %4d %4d\n", name, slot(operands[0]), operands[1], operands[2]);
+    return offset + 4;
+}
+
+static int registerConstantInstruction (const char* name, Chunk* chunk, int offset) {
+    uint8_t* operands = chunk -> code + offset + 1;
+    printf("%-16s %4d %4d '", name, slot(operands[0]), operands[1]);
+    printValue(chunk -> constants.values[operands[2]]);
+    printf("'\n");
+    return offset + 4;
+}
+
+static int moveInstruction (const char* name, Chunk* chunk, int offset) {
+    uint8_t* operands = chunk -> code + offset + 1;
+    printf("%-16s %4d %4d\n", name, operands[0], operands[1]);
+    return offset + 3;
+}
+
 int disassembleInstruction(Chunk* chunk, int offset) {
     printf("%04d ", offset);
 
@@ -67,6 +172,73 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return simpleInstruction("OP_MULTIPLY", offset);
         case OP_DIVIDE:
             return simpleInstruction("OP_DIVIDE", offset);
+        case OP_MODULO:
+            return simpleInstruction("OP_MODULO", offset);
+        case OP_BIT_AND:
+            return simpleInstruction("OP_BIT_AND", offset);
+        case OP_BIT_OR:
+            return simpleInstruction("OP_BIT_OR", offset);
+        case OP_BIT_XOR:
+            return simpleInstruction("OP_BIT_XOR", offset);
+        case OP_SHIFT_LEFT:
+            return simpleInstruction("OP_SHIFT_LEFT", offset);
+        case OP_SHIFT_RIGHT:
+            return simpleInstruction("OP_SHIFT_RIGHT", offset);
+
+        // unchecked numeric ops
+        case OP_ADD_NUM:
+            return simpleInstruction("OP_ADD_NUM", offset);
+        case OP_SUBTRACT_NUM:
+            return simpleInstruction("OP_SUBTRACT_NUM", offset);
+        case OP_MULTIPLY_NUM:
+            return simpleInstruction("OP_MULTIPLY_NUM", offset);
+        case OP_DIVIDE_NUM:
+            return simpleInstruction("OP_DIVIDE_NUM", offset);
+        case OP_NEGATE_NUM:
+            return simpleInstruction("OP_NEGATE_NUM", offset);
+        case OP_GREATER_NUM:
+            return simpleInstruction("OP_GREATER_NUM", offset);
+        case OP_LESS_NUM:
+            return simpleInstruction("OP_LESS_NUM", offset);
+        case OP_CHECK_NUM:
+            return simpleInstruction("OP_CHECK_NUM", offset);
+        case OP_CHECK_NUM_LOCAL:
+            return byteInstruction("OP_CHECK_NUM_LOCAL", chunk, offset);
+
+        // register instructions
+        case OP_ADD_RR:
+            return registerInstruction("OP_ADD_RR", chunk, offset);
+        case OP_SUBTRACT_RR:
+            return registerInstruction("OP_SUBTRACT_RR", chunk, offset);
+        case OP_MULTIPLY_RR:
+            return registerInstruction("OP_MULTIPLY_RR", chunk, offset);
+        case OP_DIVIDE_RR:
+            return registerInstruction("OP_DIVIDE_RR", chunk, offset);
+        case OP_GREATER_RR:
+            return registerInstruction("OP_GREATER_RR", chunk, offset);
+        case OP_LESS_RR:
+            return registerInstruction("OP_LESS_RR", chunk, offset);
+        case OP_ADD_RK:
+            return registerConstantInstruction("OP_ADD_RK", chunk, offset);
+        case OP_SUBTRACT_RK:
+            return registerConstantInstruction("OP_SUBTRACT_RK", chunk, offset);
+        case OP_MULTIPLY_RK:
+            return registerConstantInstruction("OP_MULTIPLY_RK", chunk, offset);
+        case OP_DIVIDE_RK:
+            return registerConstantInstruction("OP_DIVIDE_RK", chunk, offset);
+        case OP_GREATER_RK:
+            return registerConstantInstruction("OP_GREATER_RK", chunk, offset);
+        case OP_LESS_RK:
+            return registerConstantInstruction("OP_LESS_RK", chunk, offset);
+        case OP_MOVE:
+            return moveInstruction("OP_MOVE", chunk, offset);
+        case OP_LOAD_CONSTANT: {
+            uint8_t constant = chunk -> code[offset + 2];
+            printf("%-16s %4d %4d '", "OP_LOAD_CONSTANT", chunk -> code[offset + 1], constant);
+            printValue(chunk -> constants.values[constant]);
+            printf("'\n");
+            return offset + 3;
+        }
 
         // booleans
         case OP_TRUE:
@@ -148,10 +320,17 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return constantInstruction("OP_GET_PROPERTY", chunk, offset);
         case OP_METHOD:
             return constantInstruction("OP_METHOD", chunk, offset);
+        case OP_THROW:
+            return simpleInstruction("OP_THROW", offset);
+        case OP_REGION:
+            return simpleInstruction("OP_REGION", offset);
         case OP_INVOKE:
             return constantInstruction("OP_INVOKE", chunk, offset);
         case OP_SUPER_INVOKE:
             return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
+        case OP_INTRINSIC:
+            invokeInstruction("OP_INTRINSIC", chunk, offset);
+            return offset + 4;
         case OP_GET_SUPER:
             return constantInstruction("OP_GET_SUPER", chunk, offset);
         case OP_INHERIT:
@@ -167,4 +346,10 @@ void disassembleChunk (Chunk* chunk, const char* name) {
     for (int offset = 0; offset < chunk -> count;) {
         offset = disassembleInstruction(chunk, offset);
     }
+
+    for (int i = 0; i < chunk -> handlerCount; i++) {
+        ExceptionHandler* handler = &chunk -> handlers[i];
+        printf("try %04d-%04d -> catch %04d (depth %d)\n",
+               handler -> start, handler -> end, handler -> handler, handler -> stackDepth);
+    }
 }
@@ -53,7 +53,7 @@ static void adjustCapacity (HashMap* map, int capacity) {
         map -> count++;
     }
 
-    free(map -> entries);
+    FREE_ARRAY(Entry, map -> entries, map -> capacity);
     map -> entries = entries;
     map -> capacity = capacity;
 }
@@ -145,10 +145,19 @@ void markHashMap (HashMap* map) {
     }
 }
 
+// keys keep their hash when they move, the entries stay where they are
+void forwardHashMap (HashMap* map) {
+    for (int i = 0; i < map->capacity; i++) {
+        Entry* entry = &map->entries[i];
+        entry->key = (ObjString*) forwardObject((Obj*) entry->key);
+        forwardValue(&entry->value);
+    }
+}
+
 void hashMapRemoveWhite (HashMap* map) {
     for (int i = 0; i < map->capacity; i ++) {
         Entry* entry = &map->entries[i];
-        if (entry->key != NULL && !entry->key->obj.isMarked) {
+        if (entry->key != NULL && !isMarked(&entry->key->obj)) {
             hashMapDelete(map, entry->key);
         }
     }
@@ -0,0 +1,451 @@
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS and madvise with -std=c99
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "heap.h"
+
+// free cells are poisoned under AddressSanitizer, stale pointers into
+// recycled cells then still get caught; pages are leak checker roots, it
+// would not look inside mappings otherwise
+#ifdef __SANITIZE_ADDRESS__
+#include <sanitizer/asan_interface.h>
+#include <sanitizer/lsan_interface.h>
+#define POISON(cell, size) ASAN_POISON_MEMORY_REGION(cell, size)
+#define UNPOISON(cell, size) ASAN_UNPOISON_MEMORY_REGION(cell, size)
+#define ROOT(page, size) __lsan_register_root_region(page, size)
+#define UNROOT(page, size) __lsan_unregister_root_region(page, size)
+#else
+#define POISON(cell, size) ((void) (cell), (void) (size))
+#define UNPOISON(cell, size) ((void) (cell), (void) (size))
+#define ROOT(page, size) ((void) (page), (void) (size))
+#define UNROOT(page, size) ((void) (page), (void) (size))
+#endif
+
+#define OS_PAGE 4096
+#define SPARE_PAGES 64 // empty pages kept mapped (but given back) for reuse
+
+Heap heap;
+
+static size_t roundToOsPage (size_t size) {
+    return (size + OS_PAGE - 1) & ~(size_t)(OS_PAGE - 1);
+}
+
+#ifdef COMPRESSED_REFS
+
+// ========= Cage =========
+
+// with compressed references every page is carved out of one 4GB
+// reservation, address space only until touched; ranges given back stay
+// mapped (but empty) on a free list in address order, neighbours merged
+#define CAGE_SIZE ((size_t) 1 << 32)
+
+typedef struct CageRange {
+    struct CageRange* next;
+    size_t size;
+} CageRange;
+
+static CageRange* cageFree = NULL;
+static char* cageTop = NULL; // never handed out from here on
+
+static void reserveCage () {
+    size_t span = 2 * CAGE_SIZE;
+    char* memory = (char*) mmap(NULL, span, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (memory == MAP_FAILED) exit(1);
+
+    char* cage = (char*)(((uintptr_t) memory + CAGE_SIZE - 1) & ~(uintptr_t)(CAGE_SIZE - 1));
+    if (cage > memory) munmap(memory, cage - memory);
+    if (memory + span > cage + CAGE_SIZE) munmap(cage + CAGE_SIZE, memory + span - (cage + CAGE_SIZE));
+
+    heap.cage = cage;
+    cageTop = cage;
+}
+
+// pages stay aligned to HEAP_PAGE_SIZE, so are the ranges
+static size_t cageSize (size_t size) {
+    return (size + HEAP_PAGE_SIZE - 1) & ~(size_t)(HEAP_PAGE_SIZE - 1);
+}
+
+static void* cageMap (size_t size) {
+    if (heap.cage == NULL) reserveCage();
+    size = cageSize(size);
+
+    for (CageRange** link = &cageFree; *link != NULL; link = &(*link)->next) {
+        CageRange* range = *link;
+        if (range->size < size) continue;
+
+        if (range->size == size) {
+            *link = range->next;
+        } else {
+            CageRange* rest = (CageRange*)((char*) range + size);
+            rest->next = range->next;
+            rest->size = range->size - size;
+            *link = rest;
+        }
+        memset(range, 0, sizeof(CageRange)); // the rest was given back, reads zero
+        return range;
+    }
+
+    if (size > (size_t)(heap.cage + CAGE_SIZE - cageTop)) exit(1); // the heap outgrew the cage
+    char* page = cageTop;
+    cageTop += size;
+    return page;
+}
+
+static void cageUnmap (void* page, size_t size) {
+    size = cageSize(size);
+    madvise(page, size, MADV_DONTNEED);
+
+    CageRange* before = NULL;
+    CageRange* after = cageFree;
+    while (after != NULL && (char*) after < (char*) page) {
+        before = after;
+        after = after->next;
+    }
+
+    CageRange* range = (CageRange*) page;
+    if (before != NULL && (char*) before + before->size == (char*) page) {
+        before->size += size;
+        range = before;
+    } else {
+        range->size = size;
+        range->next = after;
+        if (before != NULL) before->next = range;
+        else cageFree = range;
+    }
+
+    if (after != NULL && (char*) range + range->size == (char*) after) {
+        range->size += after->size;
+        range->next = after->next;
+        memset(after, 0, sizeof(CageRange));
+    }
+}
+
+#endif
+
+// ========= Pages =========
+
+static void* spare = NULL; // linked through their first word
+static int spareCount = 0;
+
+// size bytes aligned to HEAP_PAGE_SIZE, zeroed
+static void* mapPage (size_t size) {
+    if (size == HEAP_PAGE_SIZE && spare != NULL) {
+        void* page = spare;
+        spare = *(void**) spare;
+        spareCount--;
+        *(void**) page = NULL;
+        return page;
+    }
+
+#ifdef COMPRESSED_REFS
+    char* page = (char*) cageMap(size);
+#else
+    size_t span = size + HEAP_PAGE_SIZE;
+    char* memory = (char*) mmap(NULL, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) exit(1);
+
+    char* page = (char*)(((uintptr_t) memory + HEAP_PAGE_SIZE - 1) & ~(uintptr_t)(HEAP_PAGE_SIZE - 1));
+    if (page > memory) munmap(memory, page - memory);
+    if (memory + span > page + size) munmap(page + size, memory + span - (page + size));
+#endif
+
+    ROOT(page, size);
+    return page;
+}
+
+static void unmapPage (void* page, size_t size) {
+    UNPOISON(page, size);
+
+    if (size == HEAP_PAGE_SIZE && spareCount < SPARE_PAGES) {
+        madvise(page, size, MADV_DONTNEED);
+        *(void**) page = spare;
+        spare = page;
+        spareCount++;
+        return;
+    }
+    UNROOT(page, size);
+#ifdef COMPRESSED_REFS
+    cageUnmap(page, size);
+#else
+    munmap(page, size);
+#endif
+}
+
+// ========= Objects =========
+
+// cells start right after the header
+#define FIRST_CELL (heapCellSize(sizeof(HeapPage)))
+
+static HeapPage* newPage (size_t size, size_t cellSize) {
+    HeapPage* page = (HeapPage*) mapPage(size);
+    page->size = size;
+    page->cellSize = cellSize;
+    page->bump = (char*) page + FIRST_CELL;
+    page->end = page->bump + (size - FIRST_CELL) / cellSize * cellSize;
+
+    page->next = heap.pages;
+    if (heap.pages != NULL) heap.pages->prev = page;
+    heap.pages = page;
+    return page;
+}
+
+void heapReleasePage (HeapPage* page) {
+    if (page->prev != NULL) page->prev->next = page->next;
+    else heap.pages = page->next;
+    if (page->next != NULL) page->next->prev = page->prev;
+
+    unmapPage(page, page->size);
+}
+
+int heapPageCapacity (HeapPage* page) {
+    return (int)((page->end - ((char*) page + FIRST_CELL)) / page->cellSize);
+}
+
+static void makeAvailable (HeapPage* page) {
+    HeapPage** available = page->isRegion ? heap.regionAvailable : heap.available;
+    int sizeClass = (int)(page->cellSize / HEAP_GRANULE) - 1;
+    page->nextAvailable = available[sizeClass];
+    available[sizeClass] = page;
+    page->isAvailable = true;
+}
+
+static bool hasFreeCells (HeapPage* page) {
+    return page->freeCells != NULL || page->bump + page->cellSize <= page->end;
+}
+
+static HeapPage* pageWithRoom (size_t cellSize) {
+    if (cellSize > HEAP_MAX_CELL) {
+        return newPage(roundToOsPage(FIRST_CELL + cellSize), cellSize);
+    }
+
+    HeapPage** available = heap.inRegion ? heap.regionAvailable : heap.available;
+    int sizeClass = (int)(cellSize / HEAP_GRANULE) - 1;
+    for (;;) {
+        HeapPage* page = available[sizeClass];
+        if (page == NULL) break;
+        if (hasFreeCells(page)) return page;
+
+        available[sizeClass] = page->nextAvailable;
+        page->isAvailable = false;
+    }
+
+    HeapPage* page = newPage(HEAP_PAGE_SIZE, cellSize);
+    page->isRegion = heap.inRegion;
+    makeAvailable(page);
+    return page;
+}
+
+void* heapAllocate (size_t size) {
+    size_t cellSize = heapCellSize(size);
+    HeapPage* page = pageWithRoom(cellSize);
+
+    void* cell;
+    if (page->freeCells != NULL) {
+        cell = page->freeCells;
+        UNPOISON(cell, cellSize);
+        page->freeCells = *(void**) cell;
+    } else {
+        cell = page->bump;
+        page->bump += cellSize;
+    }
+
+    *HEAP_WORD(live, cell) |= HEAP_BIT(cell);
+    if (!page->hasYoung) {
+        page->hasYoung = true;
+        page->nextYoung = heap.young;
+        heap.young = page;
+    }
+    return cell;
+}
+
+void heapFreeCell (HeapPage* page, void* cell) {
+    *HEAP_WORD(live, cell) &= ~HEAP_BIT(cell);
+    *HEAP_WORD(old, cell) &= ~HEAP_BIT(cell);
+
+    *(void**) cell = page->freeCells;
+    page->freeCells = cell;
+    POISON(cell, page->cellSize);
+}
+
+void heapPageSwept (HeapPage* page) {
+    if (page->isAvailable) return;
+
+    bool empty = true;
+    for (int i = 0; i < HEAP_BITMAP_WORDS && empty; i++) {
+        empty = page->live[i] == 0;
+    }
+
+    if (empty) {
+        heapReleasePage(page);
+    } else if (page->cellSize <= HEAP_MAX_CELL && hasFreeCells(page)) {
+        makeAvailable(page);
+    }
+}
+
+void heapOpenRegion () {
+    heap.inRegion = true;
+}
+
+// the pages it allocated into come off the list, the collection that ends
+// the region gives back the ones nothing survived on whole
+void heapCloseRegion () {
+    heap.inRegion = false;
+
+    for (int i = 0; i < HEAP_CLASSES; i++) {
+        HeapPage* page = heap.regionAvailable[i];
+        heap.regionAvailable[i] = NULL;
+
+        while (page != NULL) {
+            HeapPage* next = page->nextAvailable;
+            page->isAvailable = false;
+            if (!page->hasYoung) makeAvailable(page); // swept already
+            page = next;
+        }
+    }
+}
+
+// ========= Blocks =========
+
+// everything reallocate hands out that is not an object: arrays, tables,
+// string bytes; segregated by size class in pages of their own, bigger
+// blocks get a mapping each, the page of a block is its address rounded down
+typedef struct BlockPage {
+    struct BlockPage* nextAvailable; // heap.blocks
+    size_t size;
+    size_t cellSize;
+    int used;
+    bool isAvailable;
+
+    void* freeCells; // linked through their first word
+    char* bump;
+    char* end;
+} BlockPage;
+
+#define FIRST_BLOCK (heapCellSize(sizeof(BlockPage)))
+
+static int blockClass (size_t size) {
+    if (size <= HEAP_MAX_CELL) return (int)(heapCellSize(size) / HEAP_GRANULE) - 1;
+
+    int sizeClass = HEAP_CLASSES;
+    for (size_t cell = 2 * HEAP_MAX_CELL; cell < size; cell *= 2) sizeClass++;
+    return sizeClass;
+}
+
+static size_t classSize (int sizeClass) {
+    if (sizeClass < HEAP_CLASSES) return (size_t)(sizeClass + 1) * HEAP_GRANULE;
+    return (size_t) 2 * HEAP_MAX_CELL << (sizeClass - HEAP_CLASSES);
+}
+
+static BlockPage* newBlockPage (size_t size, size_t cellSize) {
+    BlockPage* page = (BlockPage*) mapPage(size);
+    page->size = size;
+    page->cellSize = cellSize;
+    page->bump = (char*) page + FIRST_BLOCK;
+    page->end = page->bump + (size - FIRST_BLOCK) / cellSize * cellSize;
+    return page;
+}
+
+static void makeBlocksAvailable (BlockPage* page) {
+    int sizeClass = blockClass(page->cellSize);
+    page->nextAvailable = heap.blocks[sizeClass];
+    heap.blocks[sizeClass] = page;
+    page->isAvailable = true;
+}
+
+static BlockPage* blockPageWithRoom (size_t size) {
+    if (size > HEAP_MAX_BLOCK) {
+        size_t pageSize = roundToOsPage(FIRST_BLOCK + size);
+        return newBlockPage(pageSize, pageSize - FIRST_BLOCK);
+    }
+
+    int sizeClass = blockClass(size);
+    for (;;) {
+        BlockPage* page = heap.blocks[sizeClass];
+        if (page == NULL) break;
+        if (page->freeCells != NULL || page->bump + page->cellSize <= page->end) return page;
+
+        heap.blocks[sizeClass] = page->nextAvailable;
+        page->isAvailable = false;
+    }
+
+    BlockPage* page = newBlockPage(HEAP_PAGE_SIZE, classSize(sizeClass));
+    makeBlocksAvailable(page);
+    return page;
+}
+
+static void* allocateBlock (size_t size) {
+    BlockPage* page = blockPageWithRoom(size);
+
+    void* block;
+    if (page->freeCells != NULL) {
+        block = page->freeCells;
+        UNPOISON(block, page->cellSize);
+        page->freeCells = *(void**) block;
+    } else {
+        block = page->bump;
+        page->bump += page->cellSize;
+    }
+    page->used++;
+
+    POISON((char*) block + size, page->cellSize - size);
+    return block;
+}
+
+static void freeBlock (void* block) {
+    BlockPage* page = (BlockPage*) pageOf(block);
+    if (page->cellSize > HEAP_MAX_BLOCK) {
+        unmapPage(page, page->size);
+        return;
+    }
+
+    UNPOISON(block, page->cellSize);
+    *(void**) block = page->freeCells;
+    page->freeCells = block;
+    POISON(block, page->cellSize);
+    page->used--;
+
+    if (page->used > 0) {
+        if (!page->isAvailable) makeBlocksAvailable(page);
+    } else if (!page->isAvailable) {
+        unmapPage(page, page->size);
+    } else if (heap.blocks[blockClass(page->cellSize)] != page) {
+        // stays on its list, the memory past the header goes back to the os
+        UNPOISON(page, page->size);
+        page->freeCells = NULL;
+        page->bump = (char*) page + FIRST_BLOCK;
+        madvise((char*) page + OS_PAGE, page->size - OS_PAGE, MADV_DONTNEED);
+    }
+}
+
+void* heapReallocate (void* pointer, size_t oldSize, size_t newSize) {
+    if (newSize == 0) {
+        if (pointer != NULL) freeBlock(pointer);
+        return NULL;
+    }
+
+    if (pointer != NULL) {
+        // still the right class, or a big block with the room
+        BlockPage* page = (BlockPage*) pageOf(pointer);
+        bool fits = page->cellSize > HEAP_MAX_BLOCK
+            ? newSize > HEAP_MAX_BLOCK && newSize <= page->cellSize
+            : newSize <= HEAP_MAX_BLOCK && classSize(blockClass(newSize)) == page->cellSize;
+
+        if (fits) {
+            UNPOISON(pointer, page->cellSize);
+            POISON((char*) pointer + newSize, page->cellSize - newSize);
+            return pointer;
+        }
+    }
+
+    void* block = allocateBlock(newSize);
+    if (pointer != NULL) {
+        memcpy(block, pointer, oldSize < newSize ? oldSize : newSize);
+        freeBlock(pointer);
+    }
+    return block;
+}
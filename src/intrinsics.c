@@ -0,0 +1,63 @@
+#include <string.h>
+
+#include "intrinsics.h"
+#include "vm.h"
+
+static Value mathNative (uint8_t id, int argCount, Value* args) {
+    for (int i = 0; i < argCount; i++) {
+        if (!IS_NUMERIC(args[i])) {
+            runtimeError("Arguments to '%s' must be numbers.", intrinsics[id].name);
+            return NIL_VAL;
+        }
+    }
+    double b = argCount > 1 ? AS_DOUBLE(args[1]) : 0;
+    return NUMBER_VAL(applyIntrinsic(id, AS_DOUBLE(args[0]), b));
+}
+
+#define MATH_NATIVE(fn, id) \
+    static Value fn (int argCount, Value* args) { return mathNative(id, argCount, args); }
+
+MATH_NATIVE(sqrtNative, INTRINSIC_SQRT)
+MATH_NATIVE(absNative, INTRINSIC_ABS)
+MATH_NATIVE(floorNative, INTRINSIC_FLOOR)
+MATH_NATIVE(ceilNative, INTRINSIC_CEIL)
+MATH_NATIVE(roundNative, INTRINSIC_ROUND)
+MATH_NATIVE(sinNative, INTRINSIC_SIN)
+MATH_NATIVE(cosNative, INTRINSIC_COS)
+MATH_NATIVE(tanNative, INTRINSIC_TAN)
+MATH_NATIVE(atanNative, INTRINSIC_ATAN)
+MATH_NATIVE(expNative, INTRINSIC_EXP)
+MATH_NATIVE(logNative, INTRINSIC_LOG)
+MATH_NATIVE(minNative, INTRINSIC_MIN)
+MATH_NATIVE(maxNative, INTRINSIC_MAX)
+MATH_NATIVE(powNative, INTRINSIC_POW)
+MATH_NATIVE(atan2Native, INTRINSIC_ATAN2)
+
+#undef MATH_NATIVE
+
+// in Intrinsic order
+const IntrinsicInfo intrinsics[INTRINSIC_COUNT] = {
+    {"sqrt", 1, sqrtNative},
+    {"abs", 1, absNative},
+    {"floor", 1, floorNative},
+    {"ceil", 1, ceilNative},
+    {"round", 1, roundNative},
+    {"sin", 1, sinNative},
+    {"cos", 1, cosNative},
+    {"tan", 1, tanNative},
+    {"atan", 1, atanNative},
+    {"exp", 1, expNative},
+    {"log", 1, logNative},
+    {"min", 2, minNative},
+    {"max", 2, maxNative},
+    {"pow", 2, powNative},
+    {"atan2", 2, atan2Native},
+};
+
+int findIntrinsic (const char* name, int length) {
+    for (int i = 0; i < INTRINSIC_COUNT; i++) {
+        const char* candidate = intrinsics[i].name;
+        if ((int) strlen(candidate) == length && memcmp(candidate, name, length) == 0) return i;
+    }
+    return -1;
+}
@@ -0,0 +1,574 @@
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS with -std=c99
+#endif
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "chunk.h"
+#include "hashmap.h"
+#include "jit.h"
+#include "memory.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+
+#ifdef JIT_SUPPORTED
+
+#include "assembler.h"
+
+#define NO_ENTRY UINT32_MAX
+
+// bytecode being translated, jump fixups target its offsets
+static Chunk* jitChunk;
+
+static uint8_t* pcAddress (int pc) {
+    return jitChunk -> code + pc;
+}
+
+// ========= Slow paths =========
+
+// the ones declared in jit.h are shared with the trace compiler
+
+bool jitArithmetic (uint8_t op) {
+    Value b = vm.stackTop[-1];
+    Value a = vm.stackTop[-2];
+
+    if (op == OP_ADD && IS_STRING(a) && IS_STRING(b)) {
+        concatenate();
+        return true;
+    }
+
+    // the interpreter reports the errors
+    if (!IS_NUMERIC(a) || !IS_NUMERIC(b)) return false;
+    bool ints = IS_INT(a) && IS_INT(b);
+    if (!ints && op >= OP_BIT_AND && op <= OP_SHIFT_RIGHT) return false;
+    if (ints && op == OP_MODULO && AS_INT(b) == 0) return false;
+
+    numericOp(op, a, b, &vm.stackTop[-2]);
+    vm.stackTop--;
+    return true;
+}
+
+bool jitFalsey (Value* value) {
+    return isFalsey(*value);
+}
+
+// both barriers, before the store of an upvalue
+void jitWriteBarrier (Obj* obj) {
+    beforeWrite(obj);
+    writeBarrier(obj);
+}
+
+void jitEqual () {
+    Value b = pop();
+    Value a = pop();
+    push(BOOL_VAL(valuesEqual(a, b)));
+}
+
+void jitPrint () {
+    printValue(pop());
+    printf("\n");
+}
+
+void jitDefineGlobal (Value* name) {
+    GUARD_INTRINSIC(AS_STRING(*name));
+    hashMapSet(&vm.globals, AS_STRING(*name), vm.stackTop[-1]);
+    pop();
+}
+
+bool jitGetGlobal (Value* name) {
+    Value value;
+    if (!hashMapGet(&vm.globals, AS_STRING(*name), &value)) return false;
+    push(value);
+    return true;
+}
+
+bool jitSetGlobal (Value* name) {
+    Value value;
+    if (!hashMapGet(&vm.globals, AS_STRING(*name), &value)) return false;
+    GUARD_INTRINSIC(AS_STRING(*name));
+    hashMapSet(&vm.globals, AS_STRING(*name), vm.stackTop[-1]);
+    return true;
+}
+
+bool jitIntrinsic (uint8_t* ip) {
+    return runIntrinsic(ip[3], ip[2]);
+}
+
+bool jitGetProperty (Value* name) {
+    if (!IS_INSTANCE(vm.stackTop[-1])) return false;
+
+    Value value;
+    if (!hashMapGet(&AS_INSTANCE(vm.stackTop[-1])->fields, AS_STRING(*name), &value)) {
+        return false; // methods get bound by the interpreter
+    }
+    vm.stackTop[-1] = value;
+    return true;
+}
+
+bool jitSetProperty (Value* name) {
+    if (!IS_INSTANCE(vm.stackTop[-2])) return false;
+
+    ObjInstance* instance = AS_INSTANCE(vm.stackTop[-2]);
+    beforeWrite((Obj*) instance);
+    hashMapSet(&instance->fields, AS_STRING(*name), vm.stackTop[-1]);
+    writeBarrier((Obj*) instance);
+    Value value = pop();
+    pop();
+    push(value);
+    return true;
+}
+
+static void jitClosure (CallFrame* frame, Value* function, uint8_t* operands) {
+    ObjClosure* closure = newClosure(AS_FUNCTION(*function));
+    push(OBJ_VAL(closure));
+
+    for (int i = 0; i < closure -> upvalueCount; i++) {
+        uint8_t isLocal = *operands++;
+        uint8_t index = *operands++;
+        if (isLocal) {
+            closure -> upvalues[i] = captureUpvalue(frame -> slots + index);
+        } else {
+            closure -> upvalues[i] = frame -> closure -> upvalues[index];
+        }
+    }
+    writeBarrier((Obj*) closure);
+}
+
+static void jitCloseCapture () {
+    closeUpvalues(vm.stackTop - 1);
+    pop();
+}
+
+// ========= Templates =========
+
+static Value* constantSlot (Assembler* as, int index) {
+    return &jitChunk -> constants.values[index];
+}
+
+static int readShort (Chunk* chunk, int offset) {
+    return (chunk -> code[offset] << 8) | chunk -> code[offset + 1];
+}
+
+// length of the instruction at offset, -1 for opcodes the jit doesn't know
+static int compiledLength (Chunk* chunk, int offset) {
+    switch (chunk -> code[offset]) {
+        case OP_RETURN: case OP_NEGATE: case OP_TRUE: case OP_FALSE: case OP_NIL:
+        case OP_EQUAL: case OP_GREATER: case OP_LESS: case OP_NOT:
+        case OP_ADD: case OP_SUBTRACT: case OP_MULTIPLY: case OP_DIVIDE:
+        case OP_ADD_NUM: case OP_SUBTRACT_NUM: case OP_MULTIPLY_NUM: case OP_DIVIDE_NUM:
+        case OP_NEGATE_NUM: case OP_GREATER_NUM: case OP_LESS_NUM: case OP_CHECK_NUM:
+        case OP_PRINT: case OP_POP: case OP_CLOSE_CAPTURE: case OP_INHERIT:
+        case OP_THROW: case OP_REGION:
+        case OP_MODULO: case OP_BIT_AND: case OP_BIT_OR: case OP_BIT_XOR:
+        case OP_SHIFT_LEFT: case OP_SHIFT_RIGHT:
+            return 1;
+
+        case OP_CONSTANT: case OP_CHECK_NUM_LOCAL:
+        case OP_DEFINE_GLOBAL: case OP_GET_GLOBAL: case OP_SET_GLOBAL:
+        case OP_GET_LOCAL: case OP_SET_LOCAL: case OP_GET_UPVALUE: case OP_SET_UPVALUE:
+        case OP_CALL: case OP_CLASS: case OP_GET_PROPERTY: case OP_SET_PROPERTY:
+        case OP_METHOD: case OP_GET_SUPER:
+            return 2;
+
+        case OP_JUMP: case OP_JUMP_IF_FALSE: case OP_JUMP_BACK:
+        case OP_INVOKE: case OP_SUPER_INVOKE:
+        case OP_MOVE: case OP_LOAD_CONSTANT:
+            return 3;
+
+        case OP_INTRINSIC:
+            return 4;
+
+        case OP_ADD_RR: case OP_SUBTRACT_RR: case OP_MULTIPLY_RR: case OP_DIVIDE_RR:
+        case OP_GREATER_RR: case OP_LESS_RR:
+        case OP_ADD_RK: case OP_SUBTRACT_RK: case OP_MULTIPLY_RK: case OP_DIVIDE_RK:
+        case OP_GREATER_RK: case OP_LESS_RK:
+            return 4;
+
+        case OP_CLOSURE: {
+            ObjFunction* function = AS_FUNCTION(chunk -> constants.values[chunk -> code[offset + 1]]);
+            return 2 + 2 * function -> upValuesCount;
+        }
+
+        default:
+            return -1;
+    }
+}
+
+// checked forms: two doubles, then two ints inline, the rest through
+// jitArithmetic; sseOp / intOp name the inline instruction, intOp 0 when
+// ints don't stay ints (division)
+static void emitArithmetic (Assembler* as, uint8_t op, uint8_t sseOp, uint8_t intOp, bool checked, int pc) {
+    if (!checked) {
+        emitNumberOp(as, sseOp);
+        return;
+    }
+
+    cmpTag(as, STACK_TOP, SLOT(1), VAL_NUMBER);
+    int notDouble = jccForward(as, CC_NE);
+    cmpTag(as, STACK_TOP, SLOT(2), VAL_NUMBER);
+    int slowA = jccForward(as, CC_NE);
+    emitNumberOp(as, sseOp);
+    int doneA = jmpForward(as);
+
+    patchHere(as, notDouble);
+    int slowB = -1, slowC = -1, doneB = -1;
+    if (intOp != 0) {
+        cmpTag(as, STACK_TOP, SLOT(1), VAL_INT);
+        slowB = jccForward(as, CC_NE);
+        cmpTag(as, STACK_TOP, SLOT(2), VAL_INT);
+        slowC = jccForward(as, CC_NE);
+        emitIntOp(as, intOp);
+        doneB = jmpForward(as);
+    }
+
+    patchHere(as, slowA);
+    if (slowB >= 0) patchHere(as, slowB);
+    if (slowC >= 0) patchHere(as, slowC);
+    movImm64(as, RDI, op);
+    emitStackHelper(as, (void*) jitArithmetic, true, pcAddress(pc));
+
+    patchHere(as, doneA);
+    if (doneB >= 0) patchHere(as, doneB);
+}
+
+static void emitComparison (Assembler* as, uint8_t op, bool checked, int pc) {
+    bool greater = op == OP_GREATER || op == OP_GREATER_NUM;
+    if (!checked) {
+        emitNumberCompare(as, greater);
+        return;
+    }
+
+    cmpTag(as, STACK_TOP, SLOT(1), VAL_NUMBER);
+    int notDouble = jccForward(as, CC_NE);
+    cmpTag(as, STACK_TOP, SLOT(2), VAL_NUMBER);
+    int slowA = jccForward(as, CC_NE);
+    emitNumberCompare(as, greater);
+    int doneA = jmpForward(as);
+
+    patchHere(as, notDouble);
+    cmpTag(as, STACK_TOP, SLOT(1), VAL_INT);
+    int slowB = jccForward(as, CC_NE);
+    cmpTag(as, STACK_TOP, SLOT(2), VAL_INT);
+    int slowC = jccForward(as, CC_NE);
+    emitIntCompare(as, greater);
+    int doneB = jmpForward(as);
+
+    patchHere(as, slowA);
+    patchHere(as, slowB);
+    patchHere(as, slowC);
+    movImm64(as, RDI, op);
+    emitStackHelper(as, (void*) jitArithmetic, true, pcAddress(pc));
+
+    patchHere(as, doneA);
+    patchHere(as, doneB);
+}
+
+static bool emitInstruction (Assembler* as, int pc) {
+    Chunk* chunk = jitChunk;
+    uint8_t* operands = chunk -> code + pc + 1;
+
+    switch (chunk -> code[pc]) {
+        case OP_CONSTANT:
+            movImm64(as, RAX, (uint64_t)(uintptr_t) constantSlot(as, operands[0]));
+            copyValue(as, STACK_TOP, 0, RAX, 0);
+            addImm(as, STACK_TOP, VALUE_SIZE);
+            break;
+
+        case OP_NIL:
+            storeTag(as, STACK_TOP, 0, VAL_NIL);
+            storePayloadImm(as, STACK_TOP, 0, 0);
+            addImm(as, STACK_TOP, VALUE_SIZE);
+            break;
+        case OP_TRUE:
+        case OP_FALSE:
+            storeTag(as, STACK_TOP, 0, VAL_BOOL);
+            storePayloadImm(as, STACK_TOP, 0, chunk -> code[pc] == OP_TRUE);
+            addImm(as, STACK_TOP, VALUE_SIZE);
+            break;
+
+        case OP_POP:
+            subImm(as, STACK_TOP, VALUE_SIZE);
+            break;
+
+        case OP_GET_LOCAL:
+            copyValue(as, STACK_TOP, 0, SLOTS, operands[0] * VALUE_SIZE);
+            addImm(as, STACK_TOP, VALUE_SIZE);
+            break;
+        case OP_SET_LOCAL:
+            copyValue(as, SLOTS, operands[0] * VALUE_SIZE, STACK_TOP, SLOT(1));
+            break;
+
+        case OP_GET_UPVALUE:
+            emitUpvalueLocation(as, operands[0]);
+            copyValue(as, STACK_TOP, 0, RAX, 0);
+            addImm(as, STACK_TOP, VALUE_SIZE);
+            break;
+        case OP_SET_UPVALUE:
+            emitSetUpvalue(as, operands[0]);
+            break;
+
+        case OP_ADD: emitArithmetic(as, OP_ADD, ADDSD, INT_ADD, true, pc); break;
+        case OP_SUBTRACT: emitArithmetic(as, OP_SUBTRACT, SUBSD, INT_SUB, true, pc); break;
+        case OP_MULTIPLY: emitArithmetic(as, OP_MULTIPLY, MULSD, INT_IMUL, true, pc); break;
+        case OP_DIVIDE: emitArithmetic(as, OP_DIVIDE, DIVSD, 0, true, pc); break;
+        case OP_ADD_NUM: emitArithmetic(as, OP_ADD, ADDSD, 0, false, pc); break;
+        case OP_SUBTRACT_NUM: emitArithmetic(as, OP_SUBTRACT, SUBSD, 0, false, pc); break;
+        case OP_MULTIPLY_NUM: emitArithmetic(as, OP_MULTIPLY, MULSD, 0, false, pc); break;
+        case OP_DIVIDE_NUM: emitArithmetic(as, OP_DIVIDE, DIVSD, 0, false, pc); break;
+
+        case OP_GREATER: emitComparison(as, OP_GREATER, true, pc); break;
+        case OP_LESS: emitComparison(as, OP_LESS, true, pc); break;
+        case OP_GREATER_NUM: emitComparison(as, OP_GREATER_NUM, false, pc); break;
+        case OP_LESS_NUM: emitComparison(as, OP_LESS_NUM, false, pc); break;
+
+        case OP_MODULO: case OP_BIT_AND: case OP_BIT_OR: case OP_BIT_XOR:
+        case OP_SHIFT_LEFT: case OP_SHIFT_RIGHT:
+            movImm64(as, RDI, chunk -> code[pc]);
+            emitStackHelper(as, (void*) jitArithmetic, true, pcAddress(pc));
+            break;
+
+        case OP_ADD_RR: case OP_SUBTRACT_RR: case OP_MULTIPLY_RR: case OP_DIVIDE_RR:
+        case OP_GREATER_RR: case OP_LESS_RR:
+            emitRegisterOp(as, pcAddress(pc), NULL);
+            break;
+        case OP_ADD_RK: case OP_SUBTRACT_RK: case OP_MULTIPLY_RK: case OP_DIVIDE_RK:
+        case OP_GREATER_RK: case OP_LESS_RK:
+            emitRegisterOp(as, pcAddress(pc), constantSlot(as, operands[2]));
+            break;
+
+        case OP_MOVE:
+            copyValue(as, SLOTS, operands[0] * VALUE_SIZE, SLOTS, operands[1] * VALUE_SIZE);
+            break;
+        case OP_LOAD_CONSTANT:
+            movImm64(as, RAX, (uint64_t)(uintptr_t) constantSlot(as, operands[1]));
+            copyValue(as, SLOTS, operands[0] * VALUE_SIZE, RAX, 0);
+            break;
+
+        case OP_NEGATE: {
+            cmpTag(as, STACK_TOP, SLOT(1), VAL_NUMBER);
+            int notDouble = jccForward(as, CC_NE);
+            emitNegate(as);
+            int done = jmpForward(as);
+            patchHere(as, notDouble);
+            guardTag(as, STACK_TOP, SLOT(1), VAL_INT, pcAddress(pc));
+            emitIntNegate(as);
+            patchHere(as, done);
+            break;
+        }
+        case OP_NEGATE_NUM:
+            emitNegate(as);
+            break;
+
+        case OP_CHECK_NUM:
+            guardTag(as, STACK_TOP, SLOT(1), VAL_NUMBER, pcAddress(pc));
+            break;
+        case OP_CHECK_NUM_LOCAL:
+            guardTag(as, SLOTS, operands[0] * VALUE_SIZE, VAL_NUMBER, pcAddress(pc));
+            break;
+
+        case OP_NOT:
+            emitNot(as);
+            break;
+
+        case OP_EQUAL:
+            emitStackHelper(as, (void*) jitEqual, false, pcAddress(pc));
+            break;
+
+        case OP_JUMP:
+            jumpTo(as, -1, pc + 3 + readShort(chunk, pc + 1));
+            break;
+        case OP_JUMP_BACK:
+            emitFuel(as, pcAddress(pc));
+            jumpTo(as, -1, pc + 3 - readShort(chunk, pc + 1));
+            break;
+        case OP_JUMP_IF_FALSE: {
+            int target = pc + 3 + readShort(chunk, pc + 1);
+
+            // booleans inline, everything else through isFalsey
+            cmpTag(as, STACK_TOP, SLOT(1), VAL_BOOL);
+            int slow = jccForward(as, CC_NE);
+            rex(as, false, 0, STACK_TOP);
+            emit8(as, 0x80);
+            modrmMem(as, 7, STACK_TOP, SLOT(1) + PAYLOAD);
+            emit8(as, 0); // cmp byte [r12 - 8], 0
+            jumpTo(as, CC_E, target);
+            int next = jmpForward(as);
+
+            patchHere(as, slow);
+            lea(as, RDI, STACK_TOP, SLOT(1));
+            callHelper(as, (void*) jitFalsey);
+            testAl(as);
+            jumpTo(as, CC_NE, target);
+            patchHere(as, next);
+            break;
+        }
+
+        case OP_PRINT:
+            emitStackHelper(as, (void*) jitPrint, false, pcAddress(pc));
+            break;
+
+        case OP_DEFINE_GLOBAL:
+            movImm64(as, RDI, (uint64_t)(uintptr_t) constantSlot(as, operands[0]));
+            emitStackHelper(as, (void*) jitDefineGlobal, false, pcAddress(pc));
+            break;
+        case OP_GET_GLOBAL:
+            movImm64(as, RDI, (uint64_t)(uintptr_t) constantSlot(as, operands[0]));
+            emitStackHelper(as, (void*) jitGetGlobal, true, pcAddress(pc));
+            break;
+        case OP_SET_GLOBAL:
+            movImm64(as, RDI, (uint64_t)(uintptr_t) constantSlot(as, operands[0]));
+            emitStackHelper(as, (void*) jitSetGlobal, true, pcAddress(pc));
+            break;
+
+        case OP_GET_PROPERTY:
+            movImm64(as, RDI, (uint64_t)(uintptr_t) constantSlot(as, operands[0]));
+            emitStackHelper(as, (void*) jitGetProperty, true, pcAddress(pc));
+            break;
+        case OP_SET_PROPERTY:
+            movImm64(as, RDI, (uint64_t)(uintptr_t) constantSlot(as, operands[0]));
+            emitStackHelper(as, (void*) jitSetProperty, true, pcAddress(pc));
+            break;
+
+        case OP_CLOSURE:
+            movReg(as, RDI, FRAME);
+            movImm64(as, RSI, (uint64_t)(uintptr_t) constantSlot(as, operands[0]));
+            movImm64(as, RDX, (uint64_t)(uintptr_t)(operands + 1));
+            emitStackHelper(as, (void*) jitClosure, false, pcAddress(pc));
+            break;
+
+        case OP_CLOSE_CAPTURE:
+            emitStackHelper(as, (void*) jitCloseCapture, false, pcAddress(pc));
+            break;
+
+        case OP_INTRINSIC:
+            // rebound builtins and bad arguments exit to the generic call
+            movImm64(as, RDI, (uint64_t)(uintptr_t) pcAddress(pc));
+            emitStackHelper(as, (void*) jitIntrinsic, true, pcAddress(pc));
+            break;
+
+        // frame transitions, unwinding and class definitions stay in the interpreter
+        case OP_THROW:
+        case OP_CALL:
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+        case OP_RETURN:
+        case OP_CLASS:
+        case OP_METHOD:
+        case OP_INHERIT:
+        case OP_GET_SUPER:
+        case OP_REGION:
+            emitExit(as, pcAddress(pc));
+            break;
+
+        default:
+            return false;
+    }
+    return true;
+}
+
+static JitCode* compileFunction (ObjFunction* function) {
+    if (sizeof(Value) != 16) return NULL; // templates assume {tag, 8 byte payload}
+
+    Chunk* chunk = &function -> chunk;
+    jitChunk = chunk;
+
+    Assembler as;
+    initAssembler(&as);
+
+    uint32_t* pcMap = (uint32_t*)malloc(sizeof(uint32_t) * (chunk -> count + 1));
+    if (pcMap == NULL) exit(1);
+
+    for (int i = 0; i <= chunk -> count; i++) pcMap[i] = NO_ENTRY;
+
+    emitPrologue(&as);
+
+    bool ok = true;
+    for (int pc = 0; pc < chunk -> count && ok;) {
+        int length = compiledLength(chunk, pc);
+        if (length < 0) {
+            ok = false;
+            break;
+        }
+        pcMap[pc] = (uint32_t) as.count;
+        ok = emitInstruction(&as, pc);
+        pc += length;
+    }
+
+    for (int i = 0; i < as.fixupCount && ok; i++) {
+        JumpFixup* fixup = &as.fixups[i];
+        if (fixup -> target > chunk -> count || pcMap[fixup -> target] == NO_ENTRY) {
+            ok = false;
+            break;
+        }
+        uint32_t rel = pcMap[fixup -> target] - (uint32_t)(fixup -> offset + 4);
+        memcpy(as.code + fixup -> offset, &rel, 4);
+    }
+
+    size_t size = 0;
+    uint8_t* code = ok ? finishCode(&as, &size) : NULL;
+    freeAssembler(&as);
+
+    if (code == NULL) {
+        free(pcMap);
+        return NULL;
+    }
+
+    JitCode* jit = (JitCode*)malloc(sizeof(JitCode));
+    if (jit == NULL) exit(1);
+    jit -> code = code;
+    jit -> size = size;
+    jit -> pcMap = pcMap;
+    return jit;
+}
+
+bool jitAvailable () {
+    return true;
+}
+
+void jitRun (CallFrame* frame) {
+    ObjFunction* function = DEREF(ObjFunction, frame -> closure -> rawFunc);
+
+    if (function -> jit == NULL) {
+        if (function -> hotness == JIT_NEVER) return;
+        if (frame -> ip != function -> chunk.code) return; // only count calls
+        if (++function -> hotness < JIT_HOT_CALLS) return;
+
+        function -> jit = compileFunction(function);
+        if (function -> jit == NULL) {
+            function -> hotness = JIT_NEVER;
+            return;
+        }
+    }
+
+    uint32_t target = function -> jit -> pcMap[frame -> ip - function -> chunk.code];
+    if (target == NO_ENTRY) return;
+
+    JitEntry entry = (JitEntry) function -> jit -> code;
+    entry(frame, function -> jit -> code + target);
+}
+
+void freeJitCode (JitCode* jit) {
+    if (jit == NULL) return;
+    munmap(jit -> code, jit -> size);
+    free(jit -> pcMap);
+    free(jit);
+}
+
+#else
+
+bool jitAvailable () {
+    return false;
+}
+
+void jitRun (CallFrame* frame) {
+}
+
+void freeJitCode (JitCode* jit) {
+}
+
+#endif
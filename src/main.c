@@ -3,9 +3,14 @@
 #include <string.h>
 
 
+#include "alloctrace.h"
+#include "aot.h"
 #include "common.h"
 #include "chunk.h"
+#include "compiler.h"
 #include "debug.h"
+#include "jit.h"
+#include "memory.h"
 #include "vm.h"
 
 #include "test.h"
@@ -43,9 +48,27 @@ static char* readFile (const char* path) {
 }
 
 // swith later to dynamic repl
+static bool gcStats = false;
+
+// before freeVM, or from atexit when the script ends in an error
+static void dumpGcStats () {
+    if (!gcStats) return;
+    gcStats = false;
+    printGcStats(stderr);
+}
+
+static bool allocSites = false;
+
+static void dumpAllocSites () {
+    if (!allocSites) return;
+    allocSites = false;
+    printAllocSites(stderr);
+}
+
 static void repl () {
     char line [1024];
     for (;;) {
+        collectIdle(0.01); // the user is still typing
         printf (">> ");
 
         if (!fgets(line, sizeof (line), stdin)) {
@@ -68,6 +91,17 @@ static void runFile (const char* path) {
 
     if (result == INTERPRET_COMPILE_ERROR) exit(64);
     if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+    if (result == INTERPRET_OUT_OF_FUEL) exit(75);
+}
+
+// writes the compiled script as a C program on stdout
+static void emitFile (const char* path) {
+    char* source = readFile (path);
+    ObjFunction* script = compile(source);
+    free(source);
+
+    if (script == NULL) exit(64);
+    emitC(script, stdout);
 }
 
 // Custom includes
@@ -82,17 +116,70 @@ int main (int argc, char *argv[]) {
     }
 
     initVM();
-    
-    
-    if (argc == 1) {
+
+    // runtime switches come before the script path
+    int arg = 1;
+    bool toC = false;
+    for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+        if (strcmp(argv[arg], "--jit") == 0) {
+            if (jitAvailable()) {
+                vm.jitEnabled = true;
+            } else {
+                fprintf(stderr, "JIT not supported on this platform, interpreting.\n");
+            }
+        } else if (strcmp(argv[arg], "--trace") == 0) {
+            if (jitAvailable()) {
+                vm.traceEnabled = true;
+            } else {
+                fprintf(stderr, "JIT not supported on this platform, interpreting.\n");
+            }
+        } else if (strcmp(argv[arg], "--registers") == 0) {
+            vm.registerCode = true;
+        } else if (strcmp(argv[arg], "--concurrent-gc") == 0) {
+            vm.gcConcurrent = true;
+        } else if (strcmp(argv[arg], "--gc-threads") == 0 && arg + 1 < argc) {
+            vm.gcThreads = atoi(argv[++arg]);
+            if (vm.gcThreads < 1 || vm.gcThreads > GC_MAX_THREADS) {
+                fprintf(stderr, "--gc-threads takes 1 to %d.\n", GC_MAX_THREADS);
+                exit(64);
+            }
+        } else if (strcmp(argv[arg], "--compact") == 0) {
+            vm.gcCompact = true;
+        } else if (strcmp(argv[arg], "--heap-limit") == 0 && arg + 1 < argc) {
+            vm.heapLimit = (size_t) strtoull(argv[++arg], NULL, 10) * 1024 * 1024;
+        } else if (strcmp(argv[arg], "--fuel") == 0 && arg + 1 < argc) {
+            vm.fuel = strtoull(argv[++arg], NULL, 10);
+        } else if (strcmp(argv[arg], "--gc-stats") == 0) {
+            gcStats = true;
+            atexit(dumpGcStats);
+        } else if (strcmp(argv[arg], "--alloc-trace") == 0) {
+            vm.allocTrace = true;
+            allocSites = true;
+            atexit(dumpAllocSites);
+        } else if (strcmp(argv[arg], "--emit-c") == 0) {
+            toC = true;
+        } else {
+            fprintf(stderr, "Unknown option \"%s\".\n", argv[arg]);
+            exit(64);
+        }
+    }
+
+    if (toC && arg == argc - 1) {
+        emitFile(argv[arg]);
+    } else if (toC) {
+        fprintf(stderr, "Usage: clox [--registers] --emit-c path\n");
+        exit(64);
+    } else if (arg == argc) {
         repl();
-    } else if (argc == 2) {
-        runFile (argv[1]);
+    } else if (arg == argc - 1) {
+        runFile (argv[arg]);
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
+        fprintf(stderr, "Usage: clox [--jit] [--trace] [--registers] [--concurrent-gc] [--gc-threads N] [--compact] [--heap-limit MB] [--fuel N] [--gc-stats] [--alloc-trace] [path]\n");
         exit(64);
     }
 
+    dumpGcStats();
+    dumpAllocSites();
     freeVM();
 
     return 0;
@@ -1,37 +1,118 @@
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE // pthreads and sched_yield with -std=c99
+#endif
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
+#include "alloctrace.h"
+#include "cgroup.h"
 #include "common.h"
 #include "memory.h"
 #include "object.h"
 #include "compiler.h"
+#include "jit.h"
+#include "trace.h"
 #include "vm.h"
+#include "weakmap.h"
 
 #define GC_HEAP_GROW_FACTOR 2
+#define GC_HEAP_GROW_MAX 4 // in a container with plenty of room
+#define GC_HEAP_MIN_GROWTH (256 * 1024) // in one with hardly any
+#define GC_MEMORY_PRESSURE 10.0 // PSI avg10 (%) above which growth is halved
+#define GC_CGROUP_INTERVAL 0.1 // seconds between reads of the cgroup's files
+#define GC_NURSERY_SIZE (256 * 1024) // bytes allocated between minor collections
+#define GC_MARK_STEP 64 // gray objects blackened per allocation while marking
+#define GC_SWEEP_STEP 1 // unswept pages swept per allocation
 
-void* reallocate (void* pointer, size_t oldSize, size_t newSize) {
-    vm.bytesAlocated += newSize - oldSize;
+static void startCycle ();
+static bool markStep (int budget);
+static void finishCycle ();
+static void stopMarker (bool quit);
+static void stopWorkers ();
+static bool sweepStep (int budget);
+static void finishSweep ();
+static size_t heapTarget ();
+static void traceParallel ();
+static void checkFragmentation ();
+static void beginPause ();
+static void endPause ();
+
+// past vm.heapLimit: a full collection, then the out of memory error if that
+// wasn't enough; run raises it at its next back edge or call, the allocation
+// itself still goes through
+static void overLimit () {
+    if (vm.outOfMemory) return;
+
+    collectGarbage();
+    finishSweep();
+    if (vm.bytesAlocated <= vm.heapLimit) return;
+
+    vm.outOfMemory = true;
+    vm.fuelSaved = vm.fuel;
+    vm.fuel = 0; // every tier stops at its next check
+}
+
+// gc work owed by an allocation of size bytes, before it is made
+static void allocating (size_t size) {
+    vm.nurseryBytes += size;
+
+    if (heap.unswept != NULL) {
+        // no cycle starts before the last one is swept
+        sweepStep(GC_SWEEP_STEP);
+        if (vm.nurseryBytes > GC_NURSERY_SIZE) collectNursery();
+    } else if (vm.gcMarking) {
+        // the nursery waits for the end of the cycle
+        if (markStep(GC_MARK_STEP)) finishCycle();
+    } else if (vm.bytesAlocated > vm.nextGC) {
+        // parallel marking runs the whole cycle in one pause
+        if (vm.gcThreads > 1 && !vm.gcConcurrent) collectGarbage();
+        else startCycle();
+    } else if (vm.nurseryBytes > GC_NURSERY_SIZE) {
+        collectNursery();
+    }
+
+    if (vm.heapLimit != 0 && vm.bytesAlocated > vm.heapLimit) overLimit();
 
-    if (newSize > oldSize) {
 #ifdef DEBUG_STRESS_GC
-        collectGarbage();
+    if (!vm.gcMarking) collectNursery();
 #endif
+}
 
-        if (vm.bytesAlocated > vm.nextGC) {
-            collectGarbage();
-        }
-    }
+void* reallocate (void* pointer, size_t oldSize, size_t newSize) {
+    vm.bytesAlocated += newSize - oldSize;
 
-    if (newSize == 0) {
-        free(pointer);
-        return NULL;
+    if (newSize > oldSize) {
+        vm.gcStats.blockBytes += newSize - oldSize;
+        if (vm.allocTrace) traceAllocation(-1, newSize - oldSize);
+        allocating(newSize - oldSize);
     }
 
-    void* result = realloc(pointer, newSize);
+    return heapReallocate(pointer, oldSize, newSize);
+}
+
+Obj* allocateCell (size_t size) {
+    size_t cellSize = heapCellSize(size);
+    vm.bytesAlocated += cellSize;
+    allocating(cellSize);
 
-    if (result == NULL) exit(1);
-    return result;
+    Obj* obj = (Obj*) heapAllocate(cellSize);
+    if (vm.gcMarking) {
+        // survives the running cycle, and the marker has nothing to scan
+        heapSet(HEAP_WORD(marks, obj), HEAP_BIT(obj));
+        if (vm.gcConcurrentMarking) {
+            heapSet(HEAP_WORD(scanClaimed, obj), HEAP_BIT(obj));
+            heapSet(HEAP_WORD(scanDone, obj), HEAP_BIT(obj));
+        }
+    }
+    return obj;
 }
 
+// what obj owns, its cell goes back to its page in freeCells
 static void freeObject (Obj* obj) {
 
 #ifdef DEBUG_LOG_GC
@@ -41,79 +122,118 @@ static void freeObject (Obj* obj) {
     {
     case OBJ_STRING: {
         ObjString* string = (ObjString*)obj;
-        FREE_ARRAY(char, string->chars, string->length + 1);
-        FREE(ObjString, obj);
+        if (string->chars != string->inlineChars) {
+            FREE_ARRAY(char, string->chars, string->length + 1);
+        }
         break;
     }
     case OBJ_FUNCTION: {
         ObjFunction* func = (ObjFunction*) obj;
+        freeJitCode(func -> jit);
+        freeTraces(func -> traces);
         freeChunk(&func -> chunk);
-        FREE(ObjFunction, func);
-        break;
-    }
-    case OBJ_NATIVE: {
-        FREE(ObjNativeFn, obj);
         break;
     }
     case OBJ_CLOSURE: {
         ObjClosure* closure = (ObjClosure*) obj;
         FREE_ARRAY(ObjUpvalue*, closure ->upvalues, closure ->upvalueCount);
-        FREE(ObjClosure, obj); // since closure does not own the raw function
-        break;
-    }
-
-    case OBJ_UPVALUE: {
-        FREE(ObjUpvalue, obj);
         break;
     }
 
     case OBJ_CLASS: {
         ObjClass* clas = (ObjClass*) obj;
         freeHashMap(&clas->methods);
-        FREE(ObjClass, obj);
         break;
     }
     case OBJ_INSTANCE: {
         ObjInstance* instance = (ObjInstance*) obj;
         freeHashMap(&instance->fields);
-        FREE(ObjInstance, obj);
         break;
     }
-    case OBJ_BOUND_METHOD: {
-        FREE(ObjBoundMethod, obj);
+    case OBJ_WEAK_MAP:
+        freeWeakMap((ObjWeakMap*) obj);
+        break;
+    default: // natives, upvalues, bound methods and weak refs own nothing
         break;
     }
+}
 
-    default:
-        break;
+// frees what the cells of page set in dead own, one bitmap word of them;
+// the cells themselves are left to the caller
+static void freeOwned (HeapPage* page, int word, uint64_t dead) {
+    while (dead != 0) {
+        Obj* obj = (Obj*) cellAt(page, word, __builtin_ctzll(dead));
+        dead &= dead - 1;
+
+        // a full collection already dropped it from the string table
+        if (vm.gcMinor && obj->otype == OBJ_STRING) {
+            hashMapDelete(&vm.strings, (ObjString*) obj);
+        }
+        vm.gcStats.objectsFreed[obj->otype]++;
+        vm.gcStats.bytesFreed[obj->otype] += page->cellSize;
+        freeObject(obj);
+        vm.bytesAlocated -= page->cellSize;
+    }
+}
+
+static void freeCells (HeapPage* page, int word, uint64_t dead) {
+    freeOwned(page, word, dead);
+    while (dead != 0) {
+        heapFreeCell(page, cellAt(page, word, __builtin_ctzll(dead)));
+        dead &= dead - 1;
     }
 }
 
 void freeObjects () {
-    Obj* object = vm.objects;
-    while (object != NULL) {
-        Obj* next = object->next;
-        freeObject(object);
-        object = next;
+    stopMarker(true);
+    stopWorkers();
+
+    while (heap.pages != NULL) {
+        HeapPage* page = heap.pages;
+        for (int i = 0; i < HEAP_BITMAP_WORDS; i++) {
+            freeCells(page, i, page->live[i]);
+        }
+        heapReleasePage(page);
+    }
+    heap.young = NULL;
+    heap.unswept = NULL;
+    heap.inRegion = false;
+    for (int i = 0; i < HEAP_CLASSES; i++) {
+        heap.available[i] = NULL;
+        heap.regionAvailable[i] = NULL;
     }
 }
 
-void markValue (Value value) {
-    if (IS_OBJ(value)) markObject(AS_OBJ(value));
+// ========= Remembered set =========
+
+void rememberObject (Obj* obj) {
+    obj->isRemembered = true;
+
+    if (vm.rememberedCapacity < vm.rememberedCount + 1) {
+        vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+        vm.remembered = (Obj**)realloc(vm.remembered, vm.rememberedCapacity * sizeof(Obj*));
+
+        if (vm.remembered == NULL) exit(1);
+    }
+
+    vm.remembered[vm.rememberedCount++] = obj;
 }
 
-void markObject (Obj* obj) {
-    if (obj == NULL) return;
-    if (obj->isMarked) return;
+// after a minor collection every survivor is old
+static void resetRemembered () {
+    for (int i = 0; i < vm.rememberedCount; i++) {
+        vm.remembered[i]->isRemembered = false;
+    }
+    vm.rememberedCount = 0;
+}
 
-#ifdef DEBUG_LOG_GC
-    printf("%p mark ", (void*) obj);
-    printValue(OBJ_VAL(obj));
-    printf("\n");
-#endif
+// ========= Marking =========
 
-    obj -> isMarked = true;
+void markValue (Value value) {
+    if (IS_OBJ(value)) markObject(AS_OBJ(value));
+}
 
+static void pushGray (Obj* obj) {
     if (vm.grayCapacity < vm.grayCount + 1) {
         vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
         vm.grayStack = (Obj**)realloc(vm.grayStack, vm.grayCapacity * sizeof(Obj*));
@@ -124,13 +244,41 @@ void markObject (Obj* obj) {
     vm.grayStack[vm.grayCount++] = obj;
 }
 
+static void markShared (Obj* obj);
+static void markParallel (Obj* obj);
+static bool survives (Obj* obj);
+
+void markObject (Obj* obj) {
+    if (obj == NULL) return;
+    if (vm.gcConcurrentMarking) {
+        markShared(obj);
+        return;
+    }
+    if (vm.gcParallelMarking) {
+        markParallel(obj);
+        return;
+    }
+    if (isMarked(obj)) return;
+    if (vm.gcMinor && isOld(obj)) return; // old objects survive minor collections
+
+#ifdef DEBUG_LOG_GC
+    printf("%p mark ", (void*) obj);
+    printValue(OBJ_VAL(obj));
+    printf("\n");
+#endif
+
+    *HEAP_WORD(marks, obj) |= HEAP_BIT(obj);
+    pushGray(obj);
+}
+
 static void markArray (ValueArray* array) {
     for (int i = 0; i < array->count; i++) {
         markValue(array->values[i]);
     }
 }
 
-static void markRoots () {
+// everything the mutator may be in the middle of changing
+static void markStackRoots () {
     for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
         markValue(*slot);
     }
@@ -139,10 +287,15 @@ static void markRoots () {
         markObject((Obj*)vm.frames[i].closure);
     }
 
-    for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+    for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = DEREF(ObjUpvalue, upvalue->next)) {
         markObject((Obj*) upvalue);
     }
     markCompilerRoots();
+    markValue(vm.exception);
+}
+
+static void markRoots () {
+    markStackRoots();
     markObject((Obj*)vm.initString);
     markHashMap(&vm.globals);
 }
@@ -166,13 +319,14 @@ static void blackenObject (Obj* obj) {
 
     case OBJ_FUNCTION: {
         ObjFunction* func = (ObjFunction*) obj;
-        markObject((Obj*)func->name);
+        markObject(DEREF(Obj, func->name));
         markArray(&func->chunk.constants);
+        markTraces(func->traces);
         break;
     }
     case OBJ_CLOSURE: {
         ObjClosure* closure = (ObjClosure*) obj;
-        markObject((Obj*)closure->rawFunc);
+        markObject(DEREF(Obj, closure->rawFunc));
         for (int i = 0; i < closure->upvalueCount; i++) {
             markObject((Obj*)closure->upvalues[i]);
         }
@@ -180,20 +334,31 @@ static void blackenObject (Obj* obj) {
     }
     case OBJ_CLASS: {
         ObjClass* clas = (ObjClass*) obj;
-        markObject((Obj*) clas->name);
+        markObject(DEREF(Obj, clas->name));
         markHashMap(&clas->methods);
         break;
     }
     case OBJ_INSTANCE: {
         ObjInstance* instance = (ObjInstance*) obj;
         markHashMap(&instance->fields);
-        markObject((Obj*) instance->clas);
+        markObject(DEREF(Obj, instance->clas));
         break;
     }
     case OBJ_BOUND_METHOD: {
         ObjBoundMethod* boundMethod = (ObjBoundMethod*) obj;
         markValue(boundMethod->receiver);
-        markObject((Obj*) boundMethod->method);
+        markObject(DEREF(Obj, boundMethod->method));
+        break;
+    }
+    case OBJ_WEAK_REF:
+        break; // the target is left to processWeak
+    case OBJ_WEAK_MAP: {
+        // the values of the keys known to live, the others once they do
+        ObjWeakMap* map = (ObjWeakMap*) obj;
+        for (int i = 0; i < map->capacity; i++) {
+            WeakEntry* entry = &map->entries[i];
+            if (entry->key != NULL && survives(entry->key)) markValue(entry->value);
+        }
         break;
     }
     default:
@@ -202,53 +367,1086 @@ static void blackenObject (Obj* obj) {
 }
 
 static void traceReferences () {
+    // minor collections are too small to be worth waking the workers
+    if (vm.gcThreads > 1 && !vm.gcMinor) {
+        traceParallel();
+        return;
+    }
+
     while (vm.grayCount > 0) {
         Obj* obj = vm.grayStack[--vm.grayCount];
         blackenObject (obj);
     }
 }
 
-static void sweep () {
-    Obj* previous = NULL;
-    Obj* curr = vm.objects;
-    while (curr != NULL) {
+// objects written to since the last collection: roots of a minor collection,
+// and rescanned at the end of a marking cycle
+static void markRemembered () {
+    for (int i = 0; i < vm.rememberedCount; i++) {
+        blackenObject(vm.remembered[i]);
+    }
+}
+
+// ========= Weak references =========
+
+// every weak ref and weak map, they are looked at once marking is done
+void registerWeak (Obj* obj) {
+    if (vm.weakCapacity < vm.weakCount + 1) {
+        vm.weakCapacity = GROW_CAPACITY(vm.weakCapacity);
+        vm.weak = (Obj**)realloc(vm.weak, vm.weakCapacity * sizeof(Obj*));
+
+        if (vm.weak == NULL) exit(1);
+    }
+
+    vm.weak[vm.weakCount++] = obj;
+}
+
+// once marking is done; a minor collection leaves the old objects alone
+static bool survives (Obj* obj) {
+    return isMarked(obj) || (vm.gcMinor && isOld(obj));
+}
+
+// an old weak object nobody wrote to since the last collection points at
+// old objects only, which a minor collection keeps anyway
+static bool isCollected (Obj* weak) {
+    return !vm.gcMinor || !isOld(weak) || weak->isRemembered;
+}
+
+// marks the values of the entries whose keys are live, true if it did any
+static bool markEphemerons (ObjWeakMap* map) {
+    bool marked = false;
+    for (int i = 0; i < map->capacity; i++) {
+        WeakEntry* entry = &map->entries[i];
+        if (entry->key == NULL || !survives(entry->key)) continue;
+        if (!IS_OBJ(entry->value) || survives(AS_OBJ(entry->value))) continue;
+
+        markObject(AS_OBJ(entry->value));
+        marked = true;
+    }
+    return marked;
+}
+
+static void clearDead (Obj* weak) {
+    if (weak->otype == OBJ_WEAK_REF) {
+        ObjWeakRef* ref = (ObjWeakRef*) weak;
+        Obj* target = DEREF(Obj, ref->target);
+        if (target != NULL && !survives(target)) ref->target = REF(NULL);
+        return;
+    }
+
+    ObjWeakMap* map = (ObjWeakMap*) weak;
+    for (int i = 0; i < map->capacity; i++) {
+        WeakEntry* entry = &map->entries[i];
+        if (entry->key == NULL || survives(entry->key)) continue;
+        entry->key = NULL;
+        entry->value = BOOL_VAL(true); // tombstone
+    }
+}
+
+// after the trace: a value marked through its live key can make other keys
+// live, so the maps are gone over until nothing new gets marked; then what
+// died is dropped from the weak objects that live, and the dead ones from
+// the list
+static void processWeak () {
+    bool marked = true;
+    while (marked) {
+        marked = false;
+        for (int i = 0; i < vm.weakCount; i++) {
+            Obj* weak = vm.weak[i];
+            if (weak->otype != OBJ_WEAK_MAP || !isCollected(weak) || !survives(weak)) continue;
+            if (markEphemerons((ObjWeakMap*) weak)) marked = true;
+        }
+        if (marked) traceReferences();
+    }
 
-        if (!curr->isMarked) {
-            Obj* to_free = curr;
-            curr = curr -> next;
-            if (previous == NULL) {
-                vm.objects = curr;
+    int kept = 0;
+    for (int i = 0; i < vm.weakCount; i++) {
+        Obj* weak = vm.weak[i];
+        if (!survives(weak)) continue;
+        if (isCollected(weak)) clearDead(weak);
+        vm.weak[kept++] = weak;
+    }
+    vm.weakCount = kept;
+}
+
+// ========= Sweeping =========
+
+// nothing on it is marked or old, what a request's region leaves behind
+static bool isDead (HeapPage* page) {
+    for (int i = 0; i < HEAP_BITMAP_WORDS; i++) {
+        if ((page->marks[i] | page->old[i]) & page->live[i]) return false;
+    }
+    return true;
+}
+
+// frees the dead cells of a page and clears its marks, the survivors are
+// old from then on; a minor sweep only looks at the young cells
+static void sweepPage (HeapPage* page, bool minor) {
+    if (!page->isAvailable && isDead(page)) {
+        // no free list to thread the cells onto, the page goes back whole
+        for (int i = 0; i < HEAP_BITMAP_WORDS; i++) freeOwned(page, i, page->live[i]);
+        heapReleasePage(page);
+        return;
+    }
+
+    for (int i = 0; i < HEAP_BITMAP_WORDS; i++) {
+        uint64_t cells = minor ? page->live[i] & ~page->old[i] : page->live[i];
+        if (cells == 0) continue;
+
+        page->old[i] |= cells & page->marks[i];
+        freeCells(page, i, cells & ~page->marks[i]);
+    }
+
+    memset(page->marks, 0, sizeof(page->marks));
+    memset(page->scanClaimed, 0, sizeof(page->scanClaimed));
+    memset(page->scanDone, 0, sizeof(page->scanDone));
+    page->hasYoung = false;
+    heapPageSwept(page);
+}
+
+// the pages allocated into since the last minor collection
+static void sweepYoung () {
+    HeapPage* page = heap.young;
+    heap.young = NULL;
+
+    while (page != NULL) {
+        HeapPage* next = page->nextYoung;
+        sweepPage(page, vm.gcMinor);
+        page = next;
+    }
+}
+
+// a cycle ends by sweeping the young pages and leaving the others to
+// allocations, which sweep a page at a time before asking for more memory;
+// nothing is allocated into a page before it is swept
+static void startSweep () {
+    heap.unswept = NULL;
+    for (int i = 0; i < HEAP_CLASSES; i++) {
+        heap.available[i] = NULL;
+        heap.regionAvailable[i] = NULL;
+    }
+
+    for (HeapPage* page = heap.pages; page != NULL; page = page->next) {
+        page->isAvailable = false;
+        if (!page->hasYoung) {
+            page->nextUnswept = heap.unswept;
+            heap.unswept = page;
+        }
+    }
+    sweepYoung();
+}
+
+static bool sweepStep (int budget) {
+    while (heap.unswept != NULL && budget-- > 0) {
+        HeapPage* page = heap.unswept;
+        heap.unswept = page->nextUnswept;
+        sweepPage(page, false);
+    }
+    if (heap.unswept != NULL) return false;
+
+    // what is left is live, size the next cycle on it
+    vm.nextGC = heapTarget();
+    recordNextGC();
+    if (vm.gcCompact) checkFragmentation();
+
+#ifdef DEBUG_LOG_GC
+    printf("-- sweep end\n");
+    printf("   heap at %zu next at %zu\n", vm.bytesAlocated, vm.nextGC);
+#endif
+    return true;
+}
+
+static void finishSweep () {
+    while (!sweepStep(GC_SWEEP_STEP));
+}
+
+// ========= Concurrent marking =========
+
+// with vm.gcConcurrent the gray stack is drained by a marker thread: mark
+// bits are set atomically, the gray stack is shared under grayLock, and an
+// object is scanned by whoever sets its scanClaimed bit, the marker or a
+// mutator about to store into it (claimObject)
+static pthread_t marker;
+static pthread_mutex_t grayLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t markerWake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t markerIdle = PTHREAD_COND_INITIALIZER;
+static bool markerStarted = false;
+static bool markerActive = false; // has gray objects to drain, under grayLock
+static bool markerScanning = false; // outside the lock on an object
+static bool markerQuit = false;
+
+static void markShared (Obj* obj) {
+    if (isMarked(obj)) return;
+    if (heapSet(HEAP_WORD(marks, obj), HEAP_BIT(obj))) return;
+
+    pthread_mutex_lock(&grayLock);
+    pushGray(obj);
+    pthread_mutex_unlock(&grayLock);
+}
+
+// false when someone else scans it
+static bool claimScan (Obj* obj) {
+    return !heapSet(HEAP_WORD(scanClaimed, obj), HEAP_BIT(obj));
+}
+
+static void scanDone (Obj* obj) {
+    heapSet(HEAP_WORD(scanDone, obj), HEAP_BIT(obj));
+}
+
+void claimObject (Obj* obj) {
+    if (claimScan(obj)) {
+        // being written, so reachable
+        heapSet(HEAP_WORD(marks, obj), HEAP_BIT(obj));
+        blackenObject(obj);
+        scanDone(obj);
+        return;
+    }
+
+    while (!heapTest(HEAP_WORD(scanDone, obj), HEAP_BIT(obj))) {
+        sched_yield(); // the marker is halfway through it
+    }
+}
+
+static void* markerThread (void* unused) {
+    (void) unused;
+    pthread_mutex_lock(&grayLock);
+
+    for (;;) {
+        while (!markerActive && !markerQuit) {
+            pthread_cond_wait(&markerWake, &grayLock);
+        }
+        if (markerQuit) break;
+
+        if (vm.grayCount == 0) {
+            markerActive = false;
+            pthread_cond_broadcast(&markerIdle);
+            continue;
+        }
+
+        Obj* obj = vm.grayStack[--vm.grayCount];
+        markerScanning = true;
+        pthread_mutex_unlock(&grayLock);
+
+        if (claimScan(obj)) {
+            blackenObject(obj);
+            scanDone(obj);
+        }
+
+        pthread_mutex_lock(&grayLock);
+        markerScanning = false;
+        if (!markerActive) pthread_cond_broadcast(&markerIdle);
+    }
+
+    pthread_mutex_unlock(&grayLock);
+    return NULL;
+}
+
+static void startMarker () {
+    pthread_mutex_lock(&grayLock);
+    if (!markerStarted) {
+        markerQuit = false;
+        if (pthread_create(&marker, NULL, markerThread, NULL) != 0) exit(1);
+        markerStarted = true;
+    }
+    vm.gcConcurrentMarking = true;
+    markerActive = true;
+    pthread_cond_signal(&markerWake);
+    pthread_mutex_unlock(&grayLock);
+}
+
+// waits until the marker is off the heap, what it left gray stays on the stack
+static void stopMarker (bool quit) {
+    if (!markerStarted) return;
+
+    pthread_mutex_lock(&grayLock);
+    markerActive = false;
+    while (markerScanning) pthread_cond_wait(&markerIdle, &grayLock);
+    vm.gcConcurrentMarking = false;
+
+    if (quit) {
+        markerQuit = true;
+        pthread_cond_signal(&markerWake);
+    }
+    pthread_mutex_unlock(&grayLock);
+
+    if (quit) {
+        pthread_join(marker, NULL);
+        markerStarted = false;
+    }
+}
+
+static bool markerDone () {
+    pthread_mutex_lock(&grayLock);
+    bool done = !markerActive && !markerScanning;
+    pthread_mutex_unlock(&grayLock);
+    return done;
+}
+
+// ========= Parallel marking =========
+
+// with vm.gcThreads > 1 the tracing in a full collection's pause is split
+// across worker threads: each owns a gray deque, mark bits are set
+// atomically, and a worker out of gray objects steals from the others
+#define GC_SHARE_MIN 32 // gray objects a worker keeps before sharing half
+
+typedef struct {
+    // the owner's end, no locking
+    Obj** stack;
+    int count;
+    int capacity;
+    // the end other workers steal from, under lock
+    pthread_mutex_t lock;
+    Obj** shared;
+    int sharedCount;
+    int sharedCapacity;
+} GcWorker;
+
+static GcWorker workers[GC_MAX_THREADS];
+static pthread_t workerThreads[GC_MAX_THREADS]; // worker 0 is the mutator
+static int workerCount = 0; // started, the mutator included
+static pthread_mutex_t workLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workWake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t workDone = PTHREAD_COND_INITIALIZER;
+static unsigned workRound = 0; // under workLock, bumped to wake the helpers
+static int workActive = 0; // under workLock, helpers still in the round
+static bool workQuit = false;
+static int workIdle = 0; // atomic, workers out of gray objects
+static __thread GcWorker* currentWorker = NULL;
+
+static void reserveGray (Obj*** stack, int* capacity, int needed) {
+    if (*capacity >= needed) return;
+
+    while (*capacity < needed) *capacity = GROW_CAPACITY(*capacity);
+    *stack = (Obj**)realloc(*stack, *capacity * sizeof(Obj*));
+
+    if (*stack == NULL) exit(1);
+}
+
+static void workerPush (GcWorker* worker, Obj* obj) {
+    reserveGray(&worker->stack, &worker->capacity, worker->count + 1);
+    worker->stack[worker->count++] = obj;
+}
+
+static void markParallel (Obj* obj) {
+    if (isMarked(obj)) return;
+    if (heapSet(HEAP_WORD(marks, obj), HEAP_BIT(obj))) return;
+
+    workerPush(currentWorker, obj);
+}
+
+// the oldest half of the private stack, those tend to have the most below them
+static void shareGray (GcWorker* worker) {
+    int half = worker->count / 2;
+
+    pthread_mutex_lock(&worker->lock);
+    reserveGray(&worker->shared, &worker->sharedCapacity, worker->sharedCount + half);
+    memcpy(worker->shared + worker->sharedCount, worker->stack, half * sizeof(Obj*));
+    __atomic_store_n(&worker->sharedCount, worker->sharedCount + half, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&worker->lock);
+
+    worker->count -= half;
+    memmove(worker->stack, worker->stack + half, worker->count * sizeof(Obj*));
+}
+
+// moves half of victim's shared objects (at least one) onto worker's stack
+static bool takeGray (GcWorker* worker, GcWorker* victim) {
+    if (__atomic_load_n(&victim->sharedCount, __ATOMIC_ACQUIRE) == 0) return false;
+
+    pthread_mutex_lock(&victim->lock);
+    int taken = victim->sharedCount == 1 ? 1 : victim->sharedCount / 2;
+    if (victim == worker) taken = victim->sharedCount; // its own, all of it
+    int left = victim->sharedCount - taken;
+
+    reserveGray(&worker->stack, &worker->capacity, worker->count + taken);
+    memcpy(worker->stack + worker->count, victim->shared + left, taken * sizeof(Obj*));
+    worker->count += taken;
+    __atomic_store_n(&victim->sharedCount, left, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&victim->lock);
+
+    return taken > 0;
+}
+
+static bool stealGray (GcWorker* worker) {
+    int self = (int)(worker - workers);
+    for (int i = 0; i < workerCount; i++) {
+        if (takeGray(worker, &workers[(self + i) % workerCount])) return true;
+    }
+    return false;
+}
+
+static bool anyShared () {
+    for (int i = 0; i < workerCount; i++) {
+        if (__atomic_load_n(&workers[i].sharedCount, __ATOMIC_ACQUIRE) > 0) return true;
+    }
+    return false;
+}
+
+// a worker is idle only with both ends of its deque empty and nobody else
+// fills them, so once every worker is idle the marking is over
+static void drainGray (GcWorker* worker) {
+    currentWorker = worker;
+
+    for (;;) {
+        while (worker->count > 0) {
+            blackenObject(worker->stack[--worker->count]);
+
+            if (worker->count > GC_SHARE_MIN
+                && __atomic_load_n(&workIdle, __ATOMIC_RELAXED) > 0
+                && __atomic_load_n(&worker->sharedCount, __ATOMIC_RELAXED) == 0) {
+                shareGray(worker);
+            }
+        }
+        if (stealGray(worker)) continue;
+
+        __atomic_add_fetch(&workIdle, 1, __ATOMIC_ACQ_REL);
+        for (;;) {
+            if (__atomic_load_n(&workIdle, __ATOMIC_ACQUIRE) == workerCount) {
+                currentWorker = NULL;
+                return;
+            }
+            if (anyShared()) break;
+            sched_yield();
+        }
+        __atomic_sub_fetch(&workIdle, 1, __ATOMIC_ACQ_REL);
+    }
+}
+
+static void* workerThread (void* arg) {
+    GcWorker* worker = (GcWorker*) arg;
+    unsigned seen = 0;
+
+    pthread_mutex_lock(&workLock);
+    for (;;) {
+        while (workRound == seen && !workQuit) {
+            pthread_cond_wait(&workWake, &workLock);
+        }
+        if (workQuit) break;
+        seen = workRound;
+        pthread_mutex_unlock(&workLock);
+
+        drainGray(worker);
+
+        pthread_mutex_lock(&workLock);
+        if (--workActive == 0) pthread_cond_signal(&workDone);
+    }
+    pthread_mutex_unlock(&workLock);
+    return NULL;
+}
+
+static void startWorkers () {
+    if (workerCount > 0) return;
+
+    workerCount = vm.gcThreads < GC_MAX_THREADS ? vm.gcThreads : GC_MAX_THREADS;
+    workQuit = false;
+    for (int i = 0; i < workerCount; i++) {
+        pthread_mutex_init(&workers[i].lock, NULL);
+        if (i > 0 && pthread_create(&workerThreads[i], NULL, workerThread, &workers[i]) != 0) exit(1);
+    }
+}
+
+static void stopWorkers () {
+    if (workerCount == 0) return;
+
+    pthread_mutex_lock(&workLock);
+    workQuit = true;
+    pthread_cond_broadcast(&workWake);
+    pthread_mutex_unlock(&workLock);
+
+    for (int i = 0; i < workerCount; i++) {
+        if (i > 0) pthread_join(workerThreads[i], NULL);
+        pthread_mutex_destroy(&workers[i].lock);
+        free(workers[i].stack);
+        free(workers[i].shared);
+        workers[i] = (GcWorker){0};
+    }
+    workerCount = 0;
+}
+
+// drains vm.grayStack with every worker, the mutator being worker 0
+static void traceParallel () {
+    startWorkers();
+
+    for (int i = 0; i < vm.grayCount; i++) {
+        workerPush(&workers[i % workerCount], vm.grayStack[i]);
+    }
+    vm.grayCount = 0;
+
+    workIdle = 0;
+    vm.gcParallelMarking = true;
+    pthread_mutex_lock(&workLock);
+    workRound++;
+    workActive = workerCount - 1;
+    pthread_cond_broadcast(&workWake);
+    pthread_mutex_unlock(&workLock);
+
+    drainGray(&workers[0]);
+
+    pthread_mutex_lock(&workLock);
+    while (workActive > 0) pthread_cond_wait(&workDone, &workLock);
+    pthread_mutex_unlock(&workLock);
+    vm.gcParallelMarking = false;
+}
+
+// ========= Heap sizing =========
+
+// outside a container the heap doubles past what is live; inside one the
+// growth comes out of what the group has left, half of it, the rest of the
+// process needs some too: more than doubling when that is plenty, less
+// near the limit, and less again while tasks are stalling on memory
+static double now () {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static MemoryStatus memoryStatus;
+static bool memoryLimited = false;
+static double memoryRead = -1;
+
+static void readMemory () {
+    double time = now();
+    if (memoryRead >= 0 && time - memoryRead < GC_CGROUP_INTERVAL) return;
+    memoryRead = time;
+    memoryLimited = readMemoryStatus(&memoryStatus);
+}
+
+// nextGC for the heap as it is now
+static size_t heapTarget () {
+    size_t live = vm.bytesAlocated;
+    size_t grow = live * (GC_HEAP_GROW_FACTOR - 1);
+
+    readMemory();
+    if (memoryLimited) {
+        size_t room = memoryStatus.usage < memoryStatus.limit ? memoryStatus.limit - memoryStatus.usage : 0;
+        room /= 2;
+
+        if (live * (GC_HEAP_GROW_MAX - 1) <= room / 2) grow = live * (GC_HEAP_GROW_MAX - 1);
+        else if (grow > room) grow = room;
+        if (memoryStatus.pressure > GC_MEMORY_PRESSURE) grow /= 2;
+        if (grow < GC_HEAP_MIN_GROWTH) grow = GC_HEAP_MIN_GROWTH;
+    }
+
+    // a cycle before the governor's limit, not the error
+    if (vm.heapLimit != 0 && live < vm.heapLimit && grow > vm.heapLimit - live) grow = vm.heapLimit - live;
+    return live + grow;
+}
+
+// ========= Statistics =========
+
+static int pauseDepth = 0; // a collectGarbage is one pause, not its two halves
+static double pauseStart;
+
+static void beginPause () {
+    if (pauseDepth++ == 0) pauseStart = now();
+}
+
+static void endPause () {
+    if (--pauseDepth > 0) return;
+
+    GcStats* stats = &vm.gcStats;
+    double pause = now() - pauseStart;
+    stats->pauseTotal += pause;
+    if (pause > stats->pauseMax) stats->pauseMax = pause;
+
+    int bucket = 0;
+    while (bucket < GC_PAUSE_BUCKETS - 1 && pause * 1e6 >= (double)(1 << bucket)) bucket++;
+    stats->pauses[bucket]++;
+}
+
+void recordNextGC () {
+    vm.gcStats.nextGCHistory[vm.gcStats.nextGCCount++ % GC_HISTORY] = vm.nextGC;
+}
+
+static const char* typeNames[OBJ_TYPE_COUNT] = {
+    "string", "function", "native", "closure", "upvalue", "class", "instance", "boundMethod",
+    "weakRef", "weakMap",
+};
+
+const char* gcTypeName (int otype) {
+    return typeNames[otype];
+}
+
+static int stringCount () {
+    int count = 0;
+    for (int i = 0; i < vm.strings.capacity; i++) {
+        if (vm.strings.entries[i].key != NULL) count++;
+    }
+    return count;
+}
+
+static uint64_t pauseCount () {
+    uint64_t count = 0;
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++) count += vm.gcStats.pauses[i];
+    return count;
+}
+
+// a field of memoryStatus, read fresh
+#define memoryStat(field) (readMemory(), memoryLimited ? (double)(field) : 0)
+
+bool gcStat (const char* name, double* value) {
+    GcStats* stats = &vm.gcStats;
+
+    const char* space = strchr(name, ' ');
+    if (space != NULL) {
+        // "<what> <type>"
+        for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+            if (strcmp(space + 1, typeNames[i]) != 0) continue;
+
+            size_t length = space - name;
+            if (length == 4 && memcmp(name, "live", 4) == 0) {
+                *value = (double)(stats->objectsAllocated[i] - stats->objectsFreed[i]);
+            } else if (length == 9 && memcmp(name, "allocated", 9) == 0) {
+                *value = (double) stats->bytesAllocated[i];
+            } else if (length == 5 && memcmp(name, "freed", 5) == 0) {
+                *value = (double) stats->bytesFreed[i];
             } else {
-                previous->next = curr;
+                return false;
             }
-            freeObject(to_free);
-            continue;
+            return true;
         }
+        return false;
+    }
 
-        curr->isMarked = false;
-        previous = curr;
-        curr = curr -> next;
+    if (strcmp(name, "minorCollections") == 0) *value = (double) stats->minorCollections;
+    else if (strcmp(name, "fullCollections") == 0) *value = (double) stats->fullCollections;
+    else if (strcmp(name, "compactions") == 0) *value = (double) stats->compactions;
+    else if (strcmp(name, "regions") == 0) *value = (double) stats->regions;
+    else if (strcmp(name, "pauses") == 0) *value = (double) pauseCount();
+    else if (strcmp(name, "pauseTotal") == 0) *value = stats->pauseTotal;
+    else if (strcmp(name, "pauseMax") == 0) *value = stats->pauseMax;
+    else if (strcmp(name, "heapBytes") == 0) *value = (double) vm.bytesAlocated;
+    else if (strcmp(name, "nextGC") == 0) *value = (double) vm.nextGC;
+    else if (strcmp(name, "heapGrowth") == 0) *value = (double)(heapTarget() - vm.bytesAlocated);
+    else if (strcmp(name, "memoryLimit") == 0) *value = memoryStat(memoryStatus.limit);
+    else if (strcmp(name, "memoryUsage") == 0) *value = memoryStat(memoryStatus.usage);
+    else if (strcmp(name, "memoryPressure") == 0) *value = memoryStat(memoryStatus.pressure);
+    else if (strcmp(name, "strings") == 0) *value = (double) stringCount();
+    else if (strcmp(name, "live") == 0) {
+        uint64_t live = 0;
+        for (int i = 0; i < OBJ_TYPE_COUNT; i++) live += stats->objectsAllocated[i] - stats->objectsFreed[i];
+        *value = (double) live;
+    } else {
+        return false;
     }
+    return true;
 }
 
-void collectGarbage () {
+void printGcStats (FILE* out) {
+    GcStats* stats = &vm.gcStats;
+
+    fprintf(out, "== gc ==\n");
+    fprintf(out, "collections: %" PRIu64 " minor, %" PRIu64 " full, %" PRIu64 " compactions, %" PRIu64 " regions\n",
+            stats->minorCollections, stats->fullCollections, stats->compactions, stats->regions);
+    fprintf(out, "pauses: %" PRIu64 ", %.3f ms total, %.3f ms max\n",
+            pauseCount(), stats->pauseTotal * 1e3, stats->pauseMax * 1e3);
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+        if (stats->pauses[i] == 0) continue;
+        if (i < GC_PAUSE_BUCKETS - 1) fprintf(out, "  < %6d us: %" PRIu64 "\n", 1 << i, stats->pauses[i]);
+        else fprintf(out, "  >= %5d us: %" PRIu64 "\n", 1 << (i - 1), stats->pauses[i]);
+    }
+
+    fprintf(out, "%-13s %12s %14s %14s\n", "objects", "live", "allocated", "freed");
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+        if (stats->objectsAllocated[i] == 0) continue;
+        fprintf(out, "  %-11s %12" PRIu64 " %12" PRIu64 " B %12" PRIu64 " B\n", typeNames[i],
+                stats->objectsAllocated[i] - stats->objectsFreed[i],
+                stats->bytesAllocated[i], stats->bytesFreed[i]);
+    }
+
+    fprintf(out, "heap: %zu bytes, next gc at %zu\n", vm.bytesAlocated, vm.nextGC);
+    fprintf(out, "next gc history:");
+    uint64_t first = stats->nextGCCount > GC_HISTORY ? stats->nextGCCount - GC_HISTORY : 0;
+    for (uint64_t i = first; i < stats->nextGCCount; i++) {
+        fprintf(out, " %zu", stats->nextGCHistory[i % GC_HISTORY]);
+    }
+    fprintf(out, "\n");
+    fprintf(out, "string table: %d strings, %d slots\n", stringCount(), vm.strings.capacity);
+    if (memoryLimited) {
+        fprintf(out, "cgroup: %zu of %zu bytes used, %.2f%% pressure\n",
+                memoryStatus.usage, memoryStatus.limit, memoryStatus.pressure);
+    }
+}
+
+// ========= Compaction =========
+
+// with vm.gcCompact the end of every full sweep measures how much room the
+// object pages have left unused; past GC_FRAGMENTATION percent the next safe
+// point copies the objects of the sparse pages into the others (or fresh
+// ones), rewrites every reference through the forwarding pointer left in the
+// old cell and gives the emptied pages back
+#define GC_FRAGMENTATION 50 // percent of the object pages' room unused
+#define GC_COMPACT_SPARSE 50 // pages less full than this percent get evacuated
+#define GC_COMPACT_MIN_PAGES 4 // sparse pages needed to be worth the pause
+
+static int liveCells (HeapPage* page) {
+    int cells = 0;
+    for (int i = 0; i < HEAP_BITMAP_WORDS; i++) {
+        cells += __builtin_popcountll(page->live[i]);
+    }
+    return cells;
+}
+
+// objects allocated since the last sweep stay put, they are young anyway
+static bool isMovable (HeapPage* page) {
+    return page->cellSize <= HEAP_MAX_CELL && !page->hasYoung;
+}
+
+static bool isSparse (HeapPage* page) {
+    return liveCells(page) * 100 < heapPageCapacity(page) * GC_COMPACT_SPARSE;
+}
+
+static void checkFragmentation () {
+    size_t room = 0;
+    size_t unused = 0;
+    int sparse = 0;
+
+    for (HeapPage* page = heap.pages; page != NULL; page = page->next) {
+        if (!isMovable(page)) continue;
+
+        int capacity = heapPageCapacity(page);
+        room += (size_t) capacity * page->cellSize;
+        unused += (size_t)(capacity - liveCells(page)) * page->cellSize;
+        if (isSparse(page)) sparse++;
+    }
+
+#ifdef DEBUG_STRESS_GC
+    vm.gcCompactPending = sparse > 0;
+#else
+    vm.gcCompactPending = sparse >= GC_COMPACT_MIN_PAGES && unused * 100 > room * GC_FRAGMENTATION;
+#endif
+}
+
+// a copy of obj in a page that stays, obj's cell now holds where it went
+static void evacuate (Obj* obj) {
+    size_t cellSize = pageOf(obj)->cellSize;
+    Obj* copy = (Obj*) heapAllocate(cellSize);
+    memcpy(copy, obj, cellSize);
+    if (isOld(obj)) *HEAP_WORD(old, copy) |= HEAP_BIT(copy);
+
+    if (obj->otype == OBJ_UPVALUE) {
+        ObjUpvalue* upvalue = (ObjUpvalue*) obj;
+        if (upvalue->location == &upvalue->closed) {
+            ((ObjUpvalue*) copy)->location = &((ObjUpvalue*) copy)->closed;
+        }
+    } else if (obj->otype == OBJ_STRING) {
+        ObjString* string = (ObjString*) obj;
+        if (string->chars == string->inlineChars) {
+            ((ObjString*) copy)->chars = ((ObjString*) copy)->inlineChars;
+        }
+    }
+    *(Obj**) obj = copy;
+}
+
+// what blackenObject marks, an open upvalue's next is done with the list
+static void forwardFields (Obj* obj) {
+    switch (obj->otype)
+    {
+    case OBJ_UPVALUE:
+        forwardValue(&((ObjUpvalue*) obj)->closed);
+        break;
+
+    case OBJ_FUNCTION: {
+        ObjFunction* func = (ObjFunction*) obj;
+        func->name = REF(forwardObject(DEREF(Obj, func->name)));
+        for (int i = 0; i < func->chunk.constants.count; i++) {
+            forwardValue(&func->chunk.constants.values[i]);
+        }
+        forwardTraces(func->traces);
+        break;
+    }
+    case OBJ_CLOSURE: {
+        ObjClosure* closure = (ObjClosure*) obj;
+        closure->rawFunc = REF(forwardObject(DEREF(Obj, closure->rawFunc)));
+        for (int i = 0; i < closure->upvalueCount; i++) {
+            closure->upvalues[i] = (ObjUpvalue*) forwardObject((Obj*) closure->upvalues[i]);
+        }
+        break;
+    }
+    case OBJ_CLASS: {
+        ObjClass* clas = (ObjClass*) obj;
+        clas->name = REF(forwardObject(DEREF(Obj, clas->name)));
+        forwardHashMap(&clas->methods);
+        break;
+    }
+    case OBJ_INSTANCE: {
+        ObjInstance* instance = (ObjInstance*) obj;
+        instance->clas = REF(forwardObject(DEREF(Obj, instance->clas)));
+        forwardHashMap(&instance->fields);
+        break;
+    }
+    case OBJ_BOUND_METHOD: {
+        ObjBoundMethod* boundMethod = (ObjBoundMethod*) obj;
+        forwardValue(&boundMethod->receiver);
+        boundMethod->method = REF(forwardObject(DEREF(Obj, boundMethod->method)));
+        break;
+    }
+    case OBJ_WEAK_REF: {
+        ObjWeakRef* ref = (ObjWeakRef*) obj;
+        ref->target = REF(forwardObject(DEREF(Obj, ref->target)));
+        break;
+    }
+    case OBJ_WEAK_MAP: {
+        ObjWeakMap* map = (ObjWeakMap*) obj;
+        for (int i = 0; i < map->capacity; i++) {
+            WeakEntry* entry = &map->entries[i];
+            if (entry->key == NULL) continue;
+
+            Obj* key = forwardObject(entry->key);
+            if (key != entry->key) map->isStale = true; // hashed where it was
+            entry->key = key;
+            forwardValue(&entry->value);
+        }
+        break;
+    }
+    default: // strings and natives point at no objects
+        break;
+    }
+}
+
+// markRoots, plus the weak string table and the remembered set; the
+// compiler is never running at a safe point
+static void forwardRoots () {
+    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+        forwardValue(slot);
+    }
+
+    for (int i = 0; i < vm.frameCount; i++) {
+        vm.frames[i].closure = (ObjClosure*) forwardObject((Obj*) vm.frames[i].closure);
+    }
+
+    vm.openUpvalues = (ObjUpvalue*) forwardObject((Obj*) vm.openUpvalues);
+    for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = DEREF(ObjUpvalue, upvalue->next)) {
+        upvalue->next = REF(forwardObject(DEREF(Obj, upvalue->next)));
+    }
+
+    forwardValue(&vm.exception);
+    vm.initString = (ObjString*) forwardObject((Obj*) vm.initString);
+    forwardHashMap(&vm.globals);
+    forwardHashMap(&vm.strings);
+
+    for (int i = 0; i < vm.rememberedCount; i++) {
+        vm.remembered[i] = forwardObject(vm.remembered[i]);
+    }
+    for (int i = 0; i < vm.weakCount; i++) {
+        vm.weak[i] = forwardObject(vm.weak[i]);
+    }
+}
+
+void compactHeap () {
+    if (heap.inRegion) return; // stays pending, the copies would go into the region
+    vm.gcCompactPending = false;
+    if (vm.gcMarking || heap.unswept != NULL) return; // measured again at the end of this cycle
+
+    beginPause();
+    vm.gcStats.compactions++;
+
+    // the sparse pages take no more objects, the others take theirs
+    for (int i = 0; i < HEAP_CLASSES; i++) {
+        heap.available[i] = NULL;
+        heap.regionAvailable[i] = NULL;
+    }
+
+    int evacuated = 0;
+    for (HeapPage* page = heap.pages; page != NULL; page = page->next) {
+        page->isAvailable = false;
+        page->isEvacuating = isMovable(page) && isSparse(page);
+
+        if (page->isEvacuating) evacuated++;
+        else if (page->cellSize <= HEAP_MAX_CELL) heapPageSwept(page); // never empty here
+    }
+
+    // new pages go in front, the loop never sees them
+    for (HeapPage* page = heap.pages; page != NULL; page = page->next) {
+        if (!page->isEvacuating) continue;
+
+        for (int i = 0; i < HEAP_BITMAP_WORDS; i++) {
+            for (uint64_t cells = page->live[i]; cells != 0; cells &= cells - 1) {
+                evacuate((Obj*) cellAt(page, i, __builtin_ctzll(cells)));
+            }
+        }
+    }
+
+    forwardRoots();
+    for (HeapPage* page = heap.pages; page != NULL; page = page->next) {
+        if (page->isEvacuating) continue;
+
+        for (int i = 0; i < HEAP_BITMAP_WORDS; i++) {
+            for (uint64_t cells = page->live[i]; cells != 0; cells &= cells - 1) {
+                forwardFields((Obj*) cellAt(page, i, __builtin_ctzll(cells)));
+            }
+        }
+    }
+
+    // what the old cells owned went with the copies
+    HeapPage* page = heap.pages;
+    while (page != NULL) {
+        HeapPage* next = page->next;
+        if (page->isEvacuating) heapReleasePage(page);
+        page = next;
+    }
+
+#ifdef DEBUG_LOG_GC
+    printf("-- compact: %d pages evacuated\n", evacuated);
+#else
+    (void) evacuated;
+#endif
+    endPause();
+}
+
+// ========= Collection =========
+
+// a full collection is an incremental cycle: the roots are grayed up front,
+// allocations then blacken a few gray objects each, and a final pause
+// rescans the roots and every object written to since the cycle began
+static void startCycle () {
 #ifdef DEBUG_LOG_GC
     printf("-- gc begin\n");
 #endif
 
-    // mark and sweep implementation
+    beginPause();
+    finishSweep();
+    vm.gcCompactPending = false; // the cycle measures again
+    vm.gcMarking = true;
+    if (!vm.gcConcurrent) {
+        markRoots();
+        endPause();
+        return;
+    }
 
+    // the marker thread never sees what the mutator could be changing right
+    // now, those roots get scanned in this pause
+    markStackRoots();
+    int roots = vm.grayCount;
+    for (int i = 0; i < roots; i++) {
+        Obj* obj = vm.grayStack[i];
+        blackenObject(obj);
+        claimScan(obj);
+        scanDone(obj);
+    }
+    vm.grayCount -= roots;
+    memmove(vm.grayStack, vm.grayStack + roots, vm.grayCount * sizeof(Obj*));
+
+    markObject((Obj*)vm.initString);
+    markHashMap(&vm.globals);
+    startMarker();
+    endPause();
+}
+
+// true once the gray stack is empty
+static bool markStep (int budget) {
+    if (vm.gcConcurrentMarking) return markerDone();
+
+    while (vm.grayCount > 0 && budget-- > 0) {
+        Obj* obj = vm.grayStack[--vm.grayCount];
+        blackenObject(obj);
+    }
+    return vm.grayCount == 0;
+}
+
+static void finishCycle () {
     size_t before = vm.bytesAlocated;
 
+    beginPause();
+    vm.gcStats.fullCollections++;
+    stopMarker(false);
     markRoots();
+    markRemembered();
     traceReferences();
+    processWeak();
     hashMapRemoveWhite(&vm.strings);
-    sweep();
 
-    vm.nextGC = vm.bytesAlocated * GC_HEAP_GROW_FACTOR;
+    resetRemembered(); // dead entries are only freed by the sweep
+    startSweep();
+    vm.gcMarking = false;
+
+    // garbage included until the sweep is over
+    vm.nextGC = heapTarget();
+    recordNextGC();
+    vm.nurseryBytes = 0;
+    endPause();
 
 #ifdef DEBUG_LOG_GC
     printf("-- gc end\n");
     printf("   collected %zu bytes (from %zu to %zu) next at %zu\n", before - vm.bytesAlocated, before, vm.bytesAlocated, vm.nextGC);
+#else
+    (void) before;
 #endif
 }
+
+// runs a whole cycle, or what is left of the current one, in one pause
+void collectGarbage () {
+    beginPause();
+    if (!vm.gcMarking) startCycle();
+    finishCycle();
+    endPause();
+}
+
+bool collectIdle (double budget) {
+    double start = now();
+
+    if (vm.gcCompactPending) {
+        compactHeap(); // nothing outside the vm points into the heap while idle
+        return false;
+    }
+
+    if (heap.unswept != NULL) {
+        while (!sweepStep(GC_SWEEP_STEP)) {
+            if (now() - start >= budget) return true;
+        }
+        return false;
+    }
+
+    if (!vm.gcMarking) {
+        if (vm.bytesAlocated < vm.nextGC / 2) return false; // not worth a cycle yet
+        startCycle();
+    }
+
+    while (!markStep(GC_MARK_STEP)) {
+        if (now() - start >= budget) return true;
+        if (vm.gcConcurrentMarking) sched_yield();
+    }
+    finishCycle();
+    return false;
+}
+
+// minor collection: traces only the objects allocated since the last
+// collection, reached from the roots and the remembered set
+void collectNursery () {
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc begin\n");
+    size_t before = vm.bytesAlocated;
+#endif
+
+    beginPause();
+    vm.gcStats.minorCollections++;
+    vm.gcMinor = true;
+    markRoots();
+    markRemembered();
+    traceReferences();
+    processWeak();
+    resetRemembered();
+    sweepYoung();
+    vm.gcMinor = false;
+
+    vm.nurseryBytes = 0;
+    endPause();
+
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc end\n");
+    printf("   collected %zu bytes (from %zu to %zu)\n", before - vm.bytesAlocated, before, vm.bytesAlocated);
+#endif
+}
+
+void enterRegion () {
+    if (vm.regionDepth++ == 0) heapOpenRegion();
+}
+
+void exitRegion () {
+    if (vm.regionDepth == 0 || --vm.regionDepth > 0) return;
+
+    heapCloseRegion();
+    vm.gcStats.regions++;
+    // a cycle that is marking keeps everything allocated since it began,
+    // its own sweep gets the region's pages
+    if (!vm.gcMarking) collectNursery();
+}
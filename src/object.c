@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "alloctrace.h"
 #include "object.h"
 #include "memory.h"
 #include "value.h"
@@ -20,12 +21,12 @@ static uint32_t hashString(const char* key, int length) {
     (type*)allocateObject(sizeof(type), objectType)
 
 static Obj* allocateObject(size_t size, ObjType otype) {
-    Obj* object = (Obj*)reallocate(NULL, 0, size);
+    Obj* object = allocateCell(size);
     object->otype = otype; 
-    object->isMarked = false;
-
-    object->next = vm.objects;
-    vm.objects = object;
+    object->isRemembered = false;
+    vm.gcStats.objectsAllocated[otype]++;
+    vm.gcStats.bytesAllocated[otype] += heapCellSize(size);
+    if (vm.allocTrace) traceAllocation(otype, heapCellSize(size));
 
 #ifdef DEBUG_LOG_GC
     printf("%p allocate %zu for %d\n", (void*) object, size, otype);
@@ -34,11 +35,27 @@ static Obj* allocateObject(size_t size, ObjType otype) {
     return object;
 }
 
-static ObjString* allocateString(char* chars, int length, uint32_t hash) {
-    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+ObjString* allocateString (int length) {
+    bool isInline = length <= MAX_INLINE_STRING;
+    size_t size = offsetof(ObjString, inlineChars) + (isInline ? length + 1 : 0);
+    ObjString* string = (ObjString*)allocateObject(size, OBJ_STRING);
+
+    string -> length = length;
+    string -> chars = string -> inlineChars;
+    string -> hash = 0;
+    string -> intrinsic = NO_INTRINSIC;
+
+    if (!isInline) {
+        string -> chars = NULL;
+        push(OBJ_VAL(string));
+        string -> chars = ALLOCATE(char, length + 1);
+        pop();
+    }
+    string -> chars[length] = '\0';
+    return string;
+}
 
-    string-> length = length;
-    string -> chars = chars;
+static ObjString* internString (ObjString* string, uint32_t hash) {
     string -> hash = hash;
 
     push(OBJ_VAL(string));
@@ -54,40 +71,41 @@ ObjString* copyString (const char* chars, int length) {
 
     if (interned != NULL) return interned;
 
-    char* heapChars = ALLOCATE(char, length + 1);
+    ObjString* string = allocateString(length);
+    memcpy(string -> chars, chars, length);
 
-    memcpy(heapChars, chars, length + 1);
-    heapChars[length] = '\0';
-
-    return allocateString(heapChars, length, hash);
+    return internString(string, hash);
 }
 
-ObjString* takeString(char* chars, int length) {
-    uint32_t hash = hashString(chars, length);
+// an equal string already interned wins, string is left for the nursery
+ObjString* takeString(ObjString* string) {
+    uint32_t hash = hashString(string -> chars, string -> length);
 
-    ObjString* interned = hashMapFindString(&vm.strings, chars, length, hash);
+    ObjString* interned = hashMapFindString(&vm.strings, string -> chars, string -> length, hash);
 
-    if (interned != NULL) {
-        FREE_ARRAY(char, chars, length + 1);
-        return interned;
-    }
+    if (interned != NULL) return interned;
 
-    return allocateString(chars, length, hash);
+    return internString(string, hash);
 }
 
 static void printFunction (ObjFunction* func) {
-    if (func -> name == NULL) {
+    ObjString* name = DEREF(ObjString, func -> name);
+    if (name == NULL) {
         printf("<script>");
         return;
     }
-    printf("<fn %s>", func -> name -> chars);
+    printf("<fn %s>", name -> chars);
 }
 
 ObjFunction* newFunction () {
     ObjFunction* func = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
     func -> arity = 0;
     func -> upValuesCount = 0;
-    func -> name = NULL;
+    func -> name = REF(NULL);
+    func -> hotness = 0;
+    func -> jit = NULL;
+    func -> traces = NULL;
+    func -> aot = NULL;
     initChunk(&func -> chunk);
     return func;
 }
@@ -108,7 +126,7 @@ ObjClosure* newClosure (ObjFunction* func) {
     }
 
     ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
-    closure -> rawFunc = func;
+    closure -> rawFunc = REF(func);
 
     closure ->upvalueCount = func -> upValuesCount;
     closure -> upvalues = upvalues;
@@ -119,21 +137,21 @@ ObjClosure* newClosure (ObjFunction* func) {
 ObjUpvalue* newUpvalue (Value* slot) {
     ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
     upvalue ->location = slot;
-    upvalue -> next = NULL;
+    upvalue -> next = REF(NULL);
     upvalue->closed = NIL_VAL;
     return upvalue;
 }
 //
 ObjClass* newCLass (ObjString* name) {
     ObjClass* clas = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
-    clas ->name = name;
+    clas ->name = REF(name);
     initHashMap(&clas->methods);
     return clas;
 }
 
 ObjInstance* newInstance (ObjClass* clas) {
     ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
-    instance->clas = clas;
+    instance->clas = REF(clas);
     initHashMap(&instance->fields);
     return instance;
 }
@@ -141,10 +159,27 @@ ObjInstance* newInstance (ObjClass* clas) {
 ObjBoundMethod* newBoundMethod (Value receiver, ObjClosure* method) {
     ObjBoundMethod* boundMethod = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
     boundMethod->receiver = receiver;
-    boundMethod->method = method;
+    boundMethod->method = REF(method);
     return boundMethod;
 }
 
+ObjWeakRef* newWeakRef (Obj* target) {
+    ObjWeakRef* ref = ALLOCATE_OBJ(ObjWeakRef, OBJ_WEAK_REF);
+    ref->target = REF(target);
+    registerWeak((Obj*) ref);
+    return ref;
+}
+
+ObjWeakMap* newWeakMap () {
+    ObjWeakMap* map = ALLOCATE_OBJ(ObjWeakMap, OBJ_WEAK_MAP);
+    map->isStale = false;
+    map->count = 0;
+    map->capacity = 0;
+    map->entries = NULL;
+    registerWeak((Obj*) map);
+    return map;
+}
+
 void printObject(Value value) {
     switch (OBJ_TYPE(value)) {
         case OBJ_STRING:
@@ -157,19 +192,26 @@ void printObject(Value value) {
             printf("<native fn: %d args>", AS_FUNCTION(value) -> arity);
             break;
         case OBJ_CLOSURE:
-            printFunction(AS_CLOSURE(value) -> rawFunc);
+            printFunction(DEREF(ObjFunction, AS_CLOSURE(value) -> rawFunc));
             break;
         case OBJ_UPVALUE:
             printf("upvalue");
             break;
         case OBJ_CLASS:
-            printf("<class: %s>", AS_CLASS(value)->name->chars);
+            printf("<class: %s>", DEREF(ObjString, AS_CLASS(value)->name)->chars);
             break;
         case OBJ_INSTANCE:
-            printf("<instance of class: %s>", AS_INSTANCE(value)->clas->name->chars);
+            printf("<instance of class: %s>", DEREF(ObjString, DEREF(ObjClass, AS_INSTANCE(value)->clas)->name)->chars);
             break;
         case OBJ_BOUND_METHOD: {
-            printFunction(AS_BOUNDMETHOD(value)->method -> rawFunc);
+            printFunction(DEREF(ObjFunction, DEREF(ObjClosure, AS_BOUNDMETHOD(value)->method) -> rawFunc));
+            break;
         }
+        case OBJ_WEAK_REF:
+            printf("<weak ref>");
+            break;
+        case OBJ_WEAK_MAP:
+            printf("<weak map>");
+            break;
     }
 }
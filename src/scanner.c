@@ -51,6 +51,10 @@ static bool isDigit (char c) {
     return c >= '0' && c <= '9';
 }
 
+static bool isHexDigit (char c) {
+    return isDigit(c) || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
 static bool isAlpha (char c) {
     return (c >= 'a' && c <= 'z') || 
            (c >= 'A' && c <= 'Z') || 
@@ -85,6 +89,13 @@ static Token string () {
 }
 
 static Token number () {
+    // 0x hex integers
+    if (scanner.start[0] == '0' && (peek() == 'x' || peek() == 'X') && isHexDigit(peekNext())) {
+        advance();
+        while (isHexDigit(peek())) advance();
+        return makeToken(TOKEN_NUMBER);
+    }
+
     while (isDigit(peek())) advance();
 
     //frac part
@@ -119,6 +130,7 @@ static TokenType indentifyType () {
         case 'c':
             if (scanner.current - scanner.start > 1) {
                 switch (scanner.start[1]) {
+                    case 'a': return checkKeyword(2, 3, "tch", TOKEN_CATCH);
                     case 'l': return checkKeyword(2, 3, "ass", TOKEN_CLASS);
                     case 'o': return checkKeyword(2, 6, "ntinue", TOKEN_CONTINUE);
 
@@ -147,15 +159,32 @@ static TokenType indentifyType () {
         case 'n': return checkKeyword(1, 2, "il", TOKEN_NIL);
         case 'o': return checkKeyword(1, 1, "r", TOKEN_OR);
         case 'p': return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-        case 'r': return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
+        case 'r':
+            if (scanner.current - scanner.start > 2 && scanner.start[1] == 'e') {
+                switch (scanner.start[2]) {
+                    case 't': return checkKeyword(3, 3, "urn", TOKEN_RETURN);
+                    case 'g': return checkKeyword(3, 3, "ion", TOKEN_REGION);
+
+                    default: break;
+                }
+            }
+            break;
         case 's': return checkKeyword(1, 4, "uper", TOKEN_SUPER);
         
         case 't': 
             if (scanner.current - scanner.start > 1) {
                 switch (scanner.start[1])
                 {
-                    case 'h': return checkKeyword(2, 2, "is", TOKEN_THIS);
-                    case 'r': return checkKeyword(2, 2, "ue", TOKEN_TRUE);
+                    case 'h':
+                        if (scanner.current - scanner.start > 2 && scanner.start[2] == 'r') {
+                            return checkKeyword(3, 2, "ow", TOKEN_THROW);
+                        }
+                        return checkKeyword(2, 2, "is", TOKEN_THIS);
+                    case 'r':
+                        if (scanner.current - scanner.start > 2 && scanner.start[2] == 'y') {
+                            return checkKeyword(3, 0, "", TOKEN_TRY);
+                        }
+                        return checkKeyword(2, 2, "ue", TOKEN_TRUE);
                 }
             }
             break;
@@ -226,6 +255,10 @@ Token scanToken () {
     case '+': return makeToken(TOKEN_PLUS);
     case '*': return makeToken(TOKEN_STAR);
     case '/': return makeToken(TOKEN_SLASH);
+    case '%': return makeToken(TOKEN_PERCENT);
+    case '&': return makeToken(TOKEN_AMPERSAND);
+    case '|': return makeToken(TOKEN_PIPE);
+    case '^': return makeToken(TOKEN_CARET);
 
     case '(': return makeToken(TOKEN_LEFT_PAREN);
     case ')': return makeToken(TOKEN_RIGHT_PAREN);
@@ -243,8 +276,10 @@ Token scanToken () {
     case '=':
         return makeToken(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
     case '<':
+        if (match('<')) return makeToken(TOKEN_LESS_LESS);
         return makeToken(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
     case '>':
+        if (match('>')) return makeToken(TOKEN_GREATER_GREATER);
         return makeToken(match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
 
     case '"': 
@@ -0,0 +1,708 @@
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS with -std=c99
+#endif
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "chunk.h"
+#include "jit.h"
+#include "memory.h"
+#include "object.h"
+#include "trace.h"
+#include "value.h"
+#include "vm.h"
+
+#ifdef JIT_SUPPORTED
+
+#include "assembler.h"
+
+#define CC_AE 0x3
+
+typedef struct {
+    uint8_t* ip;
+    Chunk* chunk; // of the function the instruction belongs to
+    uint8_t op;
+    int depth; // inlined frames above the loop's frame
+    bool taken; // conditional jumps: the condition was falsey
+    ValueType seen; // type of the top of the stack before the instruction
+    bool generic; // arithmetic on mixed numbers, through jitArithmetic
+    int callee; // OP_CALL: index into trace -> callees
+} TraceStep;
+
+typedef struct {
+    TraceStep* steps;
+    int count;
+    int capacity;
+} Recording;
+
+static void addStep (Recording* rec, TraceStep step) {
+    if (rec -> capacity < rec -> count + 1) {
+        rec -> capacity = GROW_CAPACITY(rec -> capacity);
+        rec -> steps = (TraceStep*)realloc(rec -> steps, rec -> capacity * sizeof(TraceStep));
+        if (rec -> steps == NULL) exit(1);
+    }
+    rec -> steps[rec -> count++] = step;
+}
+
+static Trace* findTrace (ObjFunction* function, uint8_t* header) {
+    for (Trace* trace = function -> traces; trace != NULL; trace = trace -> next) {
+        if (trace -> header == header) return trace;
+    }
+
+    Trace* trace = (Trace*)malloc(sizeof(Trace));
+    if (trace == NULL) exit(1);
+
+    trace -> header = header;
+    trace -> hotness = 0;
+    trace -> aborts = 0;
+    trace -> code = NULL;
+    trace -> size = 0;
+    trace -> start = 0;
+    trace -> calleeCount = 0;
+
+    trace -> next = function -> traces;
+    function -> traces = trace;
+    return trace;
+}
+
+static int addCallee (Trace* trace, ObjFunction* function) {
+    for (int i = 0; i < trace -> calleeCount; i++) {
+        if (trace -> callees[i] == function) return i;
+    }
+    if (trace -> calleeCount == TRACE_MAX_CALLEES) return -1;
+
+    trace -> callees[trace -> calleeCount] = function;
+    return trace -> calleeCount++;
+}
+
+static int readShort (uint8_t* ip) {
+    return (ip[1] << 8) | ip[2];
+}
+
+// ========= Recording =========
+
+static bool isNumberOp (uint8_t op) {
+    switch (op) {
+        case OP_ADD: case OP_SUBTRACT: case OP_MULTIPLY: case OP_DIVIDE:
+        case OP_GREATER: case OP_LESS:
+        case OP_ADD_NUM: case OP_SUBTRACT_NUM: case OP_MULTIPLY_NUM: case OP_DIVIDE_NUM:
+        case OP_GREATER_NUM: case OP_LESS_NUM:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool isRegisterOp (uint8_t op) {
+    return op >= OP_ADD_RR && op <= OP_LESS_RK;
+}
+
+static bool isDivide (uint8_t op) {
+    return op == OP_DIVIDE || op == OP_DIVIDE_NUM || op == OP_DIVIDE_RR || op == OP_DIVIDE_RK;
+}
+
+static Value integerOp (uint8_t op, int64_t a, int64_t b) {
+    // unsigned for the wrap around
+    switch (op) {
+        case OP_ADD: case OP_ADD_RR: case OP_ADD_RK:
+            return INT_VAL((int64_t)((uint64_t) a + (uint64_t) b));
+        case OP_SUBTRACT: case OP_SUBTRACT_RR: case OP_SUBTRACT_RK:
+            return INT_VAL((int64_t)((uint64_t) a - (uint64_t) b));
+        case OP_MULTIPLY: case OP_MULTIPLY_RR: case OP_MULTIPLY_RK:
+            return INT_VAL((int64_t)((uint64_t) a * (uint64_t) b));
+        case OP_GREATER: case OP_GREATER_RR: case OP_GREATER_RK:
+            return BOOL_VAL(a > b);
+        default:
+            return BOOL_VAL(a < b);
+    }
+}
+
+static Value numberOp (uint8_t op, double a, double b) {
+    switch (op) {
+        case OP_ADD: case OP_ADD_NUM: case OP_ADD_RR: case OP_ADD_RK:
+            return NUMBER_VAL(a + b);
+        case OP_SUBTRACT: case OP_SUBTRACT_NUM: case OP_SUBTRACT_RR: case OP_SUBTRACT_RK:
+            return NUMBER_VAL(a - b);
+        case OP_MULTIPLY: case OP_MULTIPLY_NUM: case OP_MULTIPLY_RR: case OP_MULTIPLY_RK:
+            return NUMBER_VAL(a * b);
+        case OP_DIVIDE: case OP_DIVIDE_NUM: case OP_DIVIDE_RR: case OP_DIVIDE_RK:
+            return NUMBER_VAL(a / b);
+        case OP_GREATER: case OP_GREATER_NUM: case OP_GREATER_RR: case OP_GREATER_RK:
+            return BOOL_VAL(a > b);
+        default:
+            return BOOL_VAL(a < b);
+    }
+}
+
+// executes one iteration of the loop for real while writing down what
+// happened, stops (returning false) before the first instruction it can't
+// trace so the interpreter can pick up from there
+static bool record (Trace* trace, CallFrame* frame, Recording* rec) {
+    int depth = 0;
+    trace -> calleeCount = 0;
+
+    for (;;) {
+        if (rec -> count >= TRACE_MAX_LENGTH) return false;
+
+        uint8_t* ip = frame -> ip;
+        Chunk* chunk = &DEREF(ObjFunction, frame -> closure -> rawFunc) -> chunk;
+        Value* constants = chunk -> constants.values;
+
+        TraceStep step;
+        step.ip = ip;
+        step.chunk = chunk;
+        step.op = *ip;
+        step.depth = depth;
+        step.taken = false;
+        step.seen = vm.stackTop[-1].vtype;
+        step.generic = false;
+        step.callee = -1;
+
+        switch (*ip) {
+            case OP_CONSTANT: push(constants[ip[1]]); frame -> ip += 2; break;
+            case OP_NIL: push(NIL_VAL); frame -> ip++; break;
+            case OP_TRUE: push(BOOL_VAL(true)); frame -> ip++; break;
+            case OP_FALSE: push(BOOL_VAL(false)); frame -> ip++; break;
+            case OP_POP: pop(); frame -> ip++; break;
+
+            case OP_GET_LOCAL: push(frame -> slots[ip[1]]); frame -> ip += 2; break;
+            case OP_SET_LOCAL: frame -> slots[ip[1]] = vm.stackTop[-1]; frame -> ip += 2; break;
+
+            case OP_GET_UPVALUE:
+                push(*frame -> closure -> upvalues[ip[1]] -> location);
+                frame -> ip += 2;
+                break;
+            case OP_SET_UPVALUE:
+                beforeWrite((Obj*) frame -> closure -> upvalues[ip[1]]);
+                *frame -> closure -> upvalues[ip[1]] -> location = vm.stackTop[-1];
+                writeBarrier((Obj*) frame -> closure -> upvalues[ip[1]]);
+                frame -> ip += 2;
+                break;
+
+            case OP_GET_GLOBAL:
+                if (!jitGetGlobal(&constants[ip[1]])) return false;
+                frame -> ip += 2;
+                break;
+            case OP_SET_GLOBAL:
+                if (!jitSetGlobal(&constants[ip[1]])) return false;
+                frame -> ip += 2;
+                break;
+            case OP_GET_PROPERTY:
+                if (!jitGetProperty(&constants[ip[1]])) return false;
+                frame -> ip += 2;
+                break;
+            case OP_SET_PROPERTY:
+                if (!jitSetProperty(&constants[ip[1]])) return false;
+                frame -> ip += 2;
+                break;
+
+            case OP_MODULO: case OP_BIT_AND: case OP_BIT_OR: case OP_BIT_XOR:
+            case OP_SHIFT_LEFT: case OP_SHIFT_RIGHT:
+                if (!jitArithmetic(*ip)) return false;
+                step.generic = true;
+                frame -> ip++;
+                break;
+
+            case OP_INTRINSIC:
+                if (!jitIntrinsic(ip)) return false;
+                frame -> ip += 4;
+                break;
+
+            case OP_EQUAL: jitEqual(); frame -> ip++; break;
+            case OP_PRINT: jitPrint(); frame -> ip++; break;
+            case OP_NOT: {
+                bool falsey = isFalsey(pop());
+                push(BOOL_VAL(falsey));
+                frame -> ip++;
+                break;
+            }
+
+            case OP_NEGATE:
+                if (IS_INT(vm.stackTop[-1])) {
+                    vm.stackTop[-1] = INT_VAL((int64_t)(0 - (uint64_t) AS_INT(vm.stackTop[-1])));
+                    frame -> ip++;
+                    break;
+                }
+                // fall through
+            case OP_NEGATE_NUM:
+                if (!IS_NUMBER(vm.stackTop[-1])) return false;
+                vm.stackTop[-1] = NUMBER_VAL(-AS_NUMBER(vm.stackTop[-1]));
+                frame -> ip++;
+                break;
+
+            case OP_CHECK_NUM:
+                if (!IS_NUMBER(vm.stackTop[-1])) return false;
+                frame -> ip++;
+                break;
+            case OP_CHECK_NUM_LOCAL:
+                if (!IS_NUMBER(frame -> slots[ip[1]])) return false;
+                frame -> ip += 2;
+                break;
+
+            case OP_MOVE:
+                frame -> slots[ip[1]] = frame -> slots[ip[2]];
+                frame -> ip += 3;
+                break;
+            case OP_LOAD_CONSTANT:
+                frame -> slots[ip[1]] = constants[ip[2]];
+                frame -> ip += 3;
+                break;
+
+            case OP_JUMP:
+                frame -> ip += 3 + readShort(ip);
+                break;
+            case OP_JUMP_IF_FALSE:
+                step.taken = isFalsey(vm.stackTop[-1]);
+                frame -> ip += 3 + (step.taken ? readShort(ip) : 0);
+                break;
+            case OP_JUMP_BACK:
+                frame -> ip = ip + 3 - readShort(ip);
+                if (depth == 0 && frame -> ip == trace -> header) {
+                    addStep(rec, step);
+                    return true;
+                }
+                break; // inner back edges are just jumps on a linear trace
+
+            case OP_CALL: {
+                int argCount = ip[1];
+                Value callee = vm.stackTop[-1 - argCount];
+                if (!IS_CLOSURE(callee)) return false;
+
+                ObjClosure* closure = AS_CLOSURE(callee);
+                ObjFunction* function = DEREF(ObjFunction, closure -> rawFunc);
+                if (function -> arity != argCount) return false;
+                if (depth == TRACE_MAX_DEPTH || vm.frameCount == MAX_FRAMES) return false;
+
+                step.callee = addCallee(trace, function);
+                if (step.callee < 0) return false;
+
+                frame -> ip += 2;
+                frame = &vm.frames[vm.frameCount++];
+                frame -> closure = closure;
+                frame -> ip = function -> chunk.code;
+                frame -> slots = vm.stackTop - argCount - 1;
+                depth++;
+                break;
+            }
+
+            case OP_RETURN: {
+                if (depth == 0) return false; // leaving the loop's function
+
+                Value result = pop();
+                closeUpvalues(frame -> slots);
+                vm.frameCount--;
+                vm.stackTop = frame -> slots;
+                push(result);
+                frame = &vm.frames[vm.frameCount - 1];
+                depth--;
+                break;
+            }
+
+            default:
+                if (isRegisterOp(*ip)) {
+                    Value a = frame -> slots[ip[2]];
+                    Value b = *ip >= OP_ADD_RK ? constants[ip[3]] : frame -> slots[ip[3]];
+                    Value result;
+                    if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                        result = numberOp(*ip, AS_NUMBER(a), AS_NUMBER(b));
+                    } else if (IS_INT(a) && IS_INT(b) && !isDivide(*ip)) {
+                        result = integerOp(*ip, AS_INT(a), AS_INT(b));
+                    } else {
+                        return false;
+                    }
+
+                    if (ip[1] == REG_STACK) push(result);
+                    else frame -> slots[ip[1]] = result;
+                    frame -> ip += 4;
+                    break;
+                }
+
+                if (!isNumberOp(*ip)) return false;
+                Value b = vm.stackTop[-1];
+                Value a = vm.stackTop[-2];
+
+                if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                    vm.stackTop--;
+                    vm.stackTop[-1] = numberOp(*ip, AS_NUMBER(a), AS_NUMBER(b));
+                } else if (IS_INT(a) && IS_INT(b) && !isDivide(*ip)) {
+                    vm.stackTop--;
+                    vm.stackTop[-1] = integerOp(*ip, AS_INT(a), AS_INT(b));
+                } else {
+                    // only the checked forms get here, the _NUM ones never see ints
+                    if (!jitArithmetic(*ip)) return false;
+                    step.generic = true;
+                }
+                frame -> ip++;
+                break;
+        }
+
+        addStep(rec, step);
+    }
+}
+
+// ========= Compiling =========
+
+static void emitInlinedCall (Assembler* as, Trace* trace, TraceStep* step) {
+    int argCount = step -> ip[1];
+    int32_t callee = SLOT(argCount + 1);
+
+    // guard: same closure'd function as recorded, room for one more frame
+    guardTag(as, STACK_TOP, callee, VAL_OBJ, step -> ip);
+    movLoad(as, RAX, STACK_TOP, callee + PAYLOAD);
+
+    emit8(as, 0x80);
+    modrmMem(as, 7, RAX, (int32_t) offsetof(Obj, otype));
+    emit8(as, OBJ_CLOSURE); // cmp byte [rax + otype], OBJ_CLOSURE
+    int isClosure = jccForward(as, CC_E);
+    emitExit(as, step -> ip);
+    patchHere(as, isClosure);
+
+    movImm64(as, RDX, (uint64_t)(uintptr_t) &trace -> callees[step -> callee]);
+#ifdef COMPRESSED_REFS
+    // a reference is the low half of the address
+    rex(as, false, RCX, RAX);
+    emit8(as, 0x8b);
+    modrmMem(as, RCX, RAX, (int32_t) offsetof(ObjClosure, rawFunc)); // mov ecx, [rax + rawFunc]
+    rex(as, false, RCX, RDX);
+    emit8(as, 0x3b);
+    modrmMem(as, RCX, RDX, 0); // cmp ecx, [rdx]
+#else
+    movLoad(as, RCX, RAX, (int32_t) offsetof(ObjClosure, rawFunc));
+    rex(as, true, RCX, RDX);
+    emit8(as, 0x3b);
+    modrmMem(as, RCX, RDX, 0); // cmp rcx, [rdx]
+#endif
+    int sameFunction = jccForward(as, CC_E);
+    emitExit(as, step -> ip);
+    patchHere(as, sameFunction);
+
+    movImm64(as, RDX, (uint64_t)(uintptr_t) &vm.frameCount);
+    rex(as, false, 0, RDX);
+    emit8(as, 0x81);
+    modrmMem(as, 7, RDX, 0);
+    emit32(as, MAX_FRAMES); // cmp dword [rdx], MAX_FRAMES
+    int overflow = jccForward(as, CC_AE);
+
+    // push the frame for real so any exit inside the callee is a plain exit
+    movImm64(as, RCX, (uint64_t)(uintptr_t)(step -> ip + 2));
+    movStore(as, FRAME, (int32_t) offsetof(CallFrame, ip), RCX);
+    addImm(as, FRAME, (int32_t) sizeof(CallFrame));
+    movStore(as, FRAME, (int32_t) offsetof(CallFrame, closure), RAX);
+    lea(as, SLOTS, STACK_TOP, callee);
+    movStore(as, FRAME, (int32_t) offsetof(CallFrame, slots), SLOTS);
+
+    rex(as, false, 0, RDX);
+    emit8(as, 0x83);
+    modrmMem(as, 0, RDX, 0);
+    emit8(as, 1); // add dword [rdx], 1
+
+    int done = jmpForward(as);
+    patchHere(as, overflow);
+    emitExit(as, step -> ip);
+    patchHere(as, done);
+}
+
+static void emitInlinedReturn (Assembler* as) {
+    movImm64(as, RDX, (uint64_t)(uintptr_t) &vm.openUpvalues);
+    rex(as, true, 0, RDX);
+    emit8(as, 0x83);
+    modrmMem(as, 7, RDX, 0);
+    emit8(as, 0); // cmp qword [rdx], 0
+    int noUpvalues = jccForward(as, CC_E);
+    movReg(as, RDI, SLOTS);
+    callHelper(as, (void*) closeUpvalues);
+    patchHere(as, noUpvalues);
+
+    copyValue(as, SLOTS, 0, STACK_TOP, SLOT(1));
+    lea(as, STACK_TOP, SLOTS, VALUE_SIZE);
+
+    movImm64(as, RDX, (uint64_t)(uintptr_t) &vm.frameCount);
+    rex(as, false, 0, RDX);
+    emit8(as, 0x83);
+    modrmMem(as, 5, RDX, 0);
+    emit8(as, 1); // sub dword [rdx], 1
+
+    subImm(as, FRAME, (int32_t) sizeof(CallFrame));
+    movLoad(as, SLOTS, FRAME, (int32_t) offsetof(CallFrame, slots));
+}
+
+// exits when the condition doesn't go the way it went while recording
+static void emitBranchGuard (Assembler* as, TraceStep* step) {
+    if (step -> seen == VAL_BOOL) {
+        guardTag(as, STACK_TOP, SLOT(1), VAL_BOOL, step -> ip);
+        rex(as, false, 0, STACK_TOP);
+        emit8(as, 0x80);
+        modrmMem(as, 7, STACK_TOP, SLOT(1) + PAYLOAD);
+        emit8(as, 0); // cmp byte [r12 - 8], 0 -> ZF when false
+        int same = jccForward(as, step -> taken ? CC_E : CC_NE);
+        emitExit(as, step -> ip);
+        patchHere(as, same);
+        return;
+    }
+
+    lea(as, RDI, STACK_TOP, SLOT(1));
+    callHelper(as, (void*) jitFalsey);
+    testAl(as); // ZF when truthy
+    int same = jccForward(as, step -> taken ? CC_NE : CC_E);
+    emitExit(as, step -> ip);
+    patchHere(as, same);
+}
+
+static void emitStep (Assembler* as, Trace* trace, TraceStep* step, int start) {
+    uint8_t* ip = step -> ip;
+    Value* constants = step -> chunk -> constants.values;
+
+    switch (step -> op) {
+        case OP_CONSTANT:
+            movImm64(as, RAX, (uint64_t)(uintptr_t) &constants[ip[1]]);
+            copyValue(as, STACK_TOP, 0, RAX, 0);
+            addImm(as, STACK_TOP, VALUE_SIZE);
+            break;
+        case OP_NIL:
+            storeTag(as, STACK_TOP, 0, VAL_NIL);
+            storePayloadImm(as, STACK_TOP, 0, 0);
+            addImm(as, STACK_TOP, VALUE_SIZE);
+            break;
+        case OP_TRUE:
+        case OP_FALSE:
+            storeTag(as, STACK_TOP, 0, VAL_BOOL);
+            storePayloadImm(as, STACK_TOP, 0, step -> op == OP_TRUE);
+            addImm(as, STACK_TOP, VALUE_SIZE);
+            break;
+        case OP_POP:
+            subImm(as, STACK_TOP, VALUE_SIZE);
+            break;
+
+        case OP_GET_LOCAL:
+            copyValue(as, STACK_TOP, 0, SLOTS, ip[1] * VALUE_SIZE);
+            addImm(as, STACK_TOP, VALUE_SIZE);
+            break;
+        case OP_SET_LOCAL:
+            copyValue(as, SLOTS, ip[1] * VALUE_SIZE, STACK_TOP, SLOT(1));
+            break;
+        case OP_GET_UPVALUE:
+            emitUpvalueLocation(as, ip[1]);
+            copyValue(as, STACK_TOP, 0, RAX, 0);
+            addImm(as, STACK_TOP, VALUE_SIZE);
+            break;
+        case OP_SET_UPVALUE:
+            emitSetUpvalue(as, ip[1]);
+            break;
+
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY: {
+            void* helper = step -> op == OP_GET_GLOBAL ? (void*) jitGetGlobal
+                         : step -> op == OP_SET_GLOBAL ? (void*) jitSetGlobal
+                         : step -> op == OP_GET_PROPERTY ? (void*) jitGetProperty
+                         : (void*) jitSetProperty;
+            movImm64(as, RDI, (uint64_t)(uintptr_t) &constants[ip[1]]);
+            emitStackHelper(as, helper, true, ip);
+            break;
+        }
+
+        case OP_INTRINSIC:
+            movImm64(as, RDI, (uint64_t)(uintptr_t) ip);
+            emitStackHelper(as, (void*) jitIntrinsic, true, ip);
+            break;
+
+        case OP_EQUAL: emitStackHelper(as, (void*) jitEqual, false, ip); break;
+        case OP_PRINT: emitStackHelper(as, (void*) jitPrint, false, ip); break;
+        case OP_NOT: emitNot(as); break;
+
+        case OP_NEGATE:
+            if (step -> seen == VAL_INT) {
+                guardTag(as, STACK_TOP, SLOT(1), VAL_INT, ip);
+                emitIntNegate(as);
+                break;
+            }
+            guardTag(as, STACK_TOP, SLOT(1), VAL_NUMBER, ip);
+            emitNegate(as);
+            break;
+        case OP_NEGATE_NUM:
+            emitNegate(as);
+            break;
+
+        case OP_CHECK_NUM:
+            guardTag(as, STACK_TOP, SLOT(1), VAL_NUMBER, ip);
+            break;
+        case OP_CHECK_NUM_LOCAL:
+            guardTag(as, SLOTS, ip[1] * VALUE_SIZE, VAL_NUMBER, ip);
+            break;
+
+        case OP_MODULO: case OP_BIT_AND: case OP_BIT_OR: case OP_BIT_XOR:
+        case OP_SHIFT_LEFT: case OP_SHIFT_RIGHT:
+            movImm64(as, RDI, step -> op);
+            emitStackHelper(as, (void*) jitArithmetic, true, ip);
+            break;
+
+        case OP_ADD: case OP_SUBTRACT: case OP_MULTIPLY: case OP_DIVIDE:
+        case OP_GREATER: case OP_LESS:
+            if (step -> generic) {
+                movImm64(as, RDI, step -> op);
+                emitStackHelper(as, (void*) jitArithmetic, true, ip);
+                break;
+            }
+            if (step -> seen == VAL_INT) {
+                guardTag(as, STACK_TOP, SLOT(1), VAL_INT, ip);
+                guardTag(as, STACK_TOP, SLOT(2), VAL_INT, ip);
+                switch (step -> op) {
+                    case OP_ADD: emitIntOp(as, INT_ADD); break;
+                    case OP_SUBTRACT: emitIntOp(as, INT_SUB); break;
+                    case OP_MULTIPLY: emitIntOp(as, INT_IMUL); break;
+                    case OP_GREATER: emitIntCompare(as, true); break;
+                    default: emitIntCompare(as, false); break;
+                }
+                break;
+            }
+            guardTag(as, STACK_TOP, SLOT(1), VAL_NUMBER, ip);
+            guardTag(as, STACK_TOP, SLOT(2), VAL_NUMBER, ip);
+            // fall through to the unchecked version
+        case OP_ADD_NUM: case OP_SUBTRACT_NUM: case OP_MULTIPLY_NUM: case OP_DIVIDE_NUM:
+        case OP_GREATER_NUM: case OP_LESS_NUM:
+            switch (step -> op) {
+                case OP_ADD: case OP_ADD_NUM: emitNumberOp(as, ADDSD); break;
+                case OP_SUBTRACT: case OP_SUBTRACT_NUM: emitNumberOp(as, SUBSD); break;
+                case OP_MULTIPLY: case OP_MULTIPLY_NUM: emitNumberOp(as, MULSD); break;
+                case OP_DIVIDE: case OP_DIVIDE_NUM: emitNumberOp(as, DIVSD); break;
+                case OP_GREATER: case OP_GREATER_NUM: emitNumberCompare(as, true); break;
+                default: emitNumberCompare(as, false); break;
+            }
+            break;
+
+        case OP_ADD_RR: case OP_SUBTRACT_RR: case OP_MULTIPLY_RR: case OP_DIVIDE_RR:
+        case OP_GREATER_RR: case OP_LESS_RR:
+            emitRegisterOp(as, ip, NULL);
+            break;
+        case OP_ADD_RK: case OP_SUBTRACT_RK: case OP_MULTIPLY_RK: case OP_DIVIDE_RK:
+        case OP_GREATER_RK: case OP_LESS_RK:
+            emitRegisterOp(as, ip, &constants[ip[3]]);
+            break;
+        case OP_MOVE:
+            copyValue(as, SLOTS, ip[1] * VALUE_SIZE, SLOTS, ip[2] * VALUE_SIZE);
+            break;
+        case OP_LOAD_CONSTANT:
+            movImm64(as, RAX, (uint64_t)(uintptr_t) &constants[ip[2]]);
+            copyValue(as, SLOTS, ip[1] * VALUE_SIZE, RAX, 0);
+            break;
+
+        case OP_JUMP_IF_FALSE:
+            emitBranchGuard(as, step);
+            break;
+        case OP_JUMP:
+            break; // the trace already follows it
+        case OP_JUMP_BACK:
+            if (step -> depth == 0 && ip + 3 - readShort(ip) == trace -> header) {
+                emitFuel(as, ip);
+                emit8(as, 0xe9);
+                emit32(as, (uint32_t)(start - (as -> count + 4))); // around the loop
+            }
+            break;
+
+        case OP_CALL: emitInlinedCall(as, trace, step); break;
+        case OP_RETURN: emitInlinedReturn(as); break;
+
+        default:
+            break; // the recorder never keeps anything else
+    }
+}
+
+static bool compileTrace (Trace* trace, Recording* rec) {
+    if (sizeof(Value) != 16) return false; // templates assume {tag, 8 byte payload}
+
+    Assembler as;
+    initAssembler(&as);
+
+    emitPrologue(&as);
+    int start = as.count;
+
+    for (int i = 0; i < rec -> count; i++) {
+        emitStep(&as, trace, &rec -> steps[i], start);
+    }
+
+    trace -> code = finishCode(&as, &trace -> size);
+    trace -> start = (uint32_t) start;
+    freeAssembler(&as);
+    return trace -> code != NULL;
+}
+
+static void enterTrace (Trace* trace, CallFrame* frame) {
+    JitEntry entry = (JitEntry) trace -> code;
+    entry(frame, trace -> code + trace -> start);
+}
+
+void traceLoop (CallFrame* frame) {
+    ObjFunction* function = DEREF(ObjFunction, frame -> closure -> rawFunc);
+    beforeWrite((Obj*) function); // its trace list and callees change
+    Trace* trace = findTrace(function, frame -> ip);
+
+    if (trace -> code != NULL) {
+        enterTrace(trace, frame);
+        return;
+    }
+
+    if (trace -> hotness == JIT_NEVER) return;
+    if (++trace -> hotness < TRACE_HOT_LOOPS) return;
+    trace -> hotness = 0;
+
+    Recording rec;
+    rec.steps = NULL;
+    rec.count = 0;
+    rec.capacity = 0;
+
+    bool recorded = record(trace, frame, &rec);
+    writeBarrier((Obj*) function); // owns the recorded callees
+    bool compiled = recorded && compileTrace(trace, &rec);
+    free(rec.steps);
+
+    if (!compiled) {
+        trace -> calleeCount = 0;
+        if (!recorded && ++trace -> aborts < TRACE_MAX_ABORTS) return;
+        trace -> hotness = JIT_NEVER;
+        return;
+    }
+
+    // recording ran one iteration and stopped back at the header
+    enterTrace(trace, frame);
+}
+
+void freeTraces (Trace* traces) {
+    while (traces != NULL) {
+        Trace* next = traces -> next;
+        if (traces -> code != NULL) munmap(traces -> code, traces -> size);
+        free(traces);
+        traces = next;
+    }
+}
+
+#else
+
+void traceLoop (CallFrame* frame) {
+}
+
+void freeTraces (Trace* traces) {
+}
+
+#endif
+
+void markTraces (Trace* traces) {
+    for (Trace* trace = traces; trace != NULL; trace = trace -> next) {
+        for (int i = 0; i < trace -> calleeCount; i++) {
+            markObject((Obj*) trace -> callees[i]);
+        }
+    }
+}
+
+// the guards load the callees from here, moving them needs no new code
+void forwardTraces (Trace* traces) {
+    for (Trace* trace = traces; trace != NULL; trace = trace -> next) {
+        for (int i = 0; i < trace -> calleeCount; i++) {
+            trace -> callees[i] = (ObjFunction*) forwardObject((Obj*) trace -> callees[i]);
+        }
+    }
+}
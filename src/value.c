@@ -1,3 +1,4 @@
+#include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -37,6 +38,7 @@ void printValue (Value value) {
         break;
     case VAL_NIL: printf("nil"); break;
     case VAL_NUMBER: printf("%g", value.as.number); break;
+    case VAL_INT: printf("%" PRId64, value.as.integer); break;
     case VAL_OBJ: printObject(value); break;
     default:
         break;
@@ -44,12 +46,16 @@ void printValue (Value value) {
 }
 
 bool valuesEqual (Value a, Value b) {
-    if (a.vtype != b.vtype) return false;
+    if (a.vtype != b.vtype) {
+        // 1 == 1.0
+        return IS_NUMERIC(a) && IS_NUMERIC(b) && AS_DOUBLE(a) == AS_DOUBLE(b);
+    }
 
     switch (a.vtype) {
         case VAL_BOOL: return a.as.boolean == b.as.boolean;
         case VAL_NIL: return true;
         case VAL_NUMBER: return a.as.number == b.as.number;
+        case VAL_INT: return a.as.integer == b.as.integer;
         case VAL_OBJ: return a.as.obj == b.as.obj;
         default: return false; // unreachable
     }
@@ -1,9 +1,12 @@
+#include <inttypes.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#include "alloctrace.h"
 #include "chunk.h"
 #include "hashmap.h"
 #include "vm.h"
@@ -11,8 +14,11 @@
 #include "common.h"
 #include "debug.h"
 #include "compiler.h"
+#include "jit.h"
+#include "trace.h"
 #include "value.h"
 #include "object.h"
+#include "weakmap.h"
 
 VM vm;
 
@@ -20,59 +26,305 @@ static Value clockNative (int argCount, Value* args) {
     return NUMBER_VAL((double) clock() / CLOCKS_PER_SEC);
 }
 
+// gcStat("fullCollections"), gcStat("live instance"), names in memory.c
+static Value gcStatNative (int argCount, Value* args) {
+    double value;
+    if (!IS_STRING(args[0])) {
+        runtimeError("gcStat takes a string");
+    } else if (!gcStat(AS_CSTRING(args[0]), &value)) {
+        runtimeError("Unknown gc statistic '%s'", AS_CSTRING(args[0]));
+    } else {
+        return NUMBER_VAL(value);
+    }
+    return NIL_VAL;
+}
+
+// weakRef(object), weakGet(ref) is the object or nil once it was collected
+static Value weakRefNative (int argCount, Value* args) {
+    if (!IS_OBJ(args[0])) {
+        runtimeError("weakRef takes an object");
+        return NIL_VAL;
+    }
+    return OBJ_VAL(newWeakRef(AS_OBJ(args[0])));
+}
+
+static Value weakGetNative (int argCount, Value* args) {
+    if (!IS_WEAK_REF(args[0])) {
+        runtimeError("weakGet takes a weak ref");
+        return NIL_VAL;
+    }
+    Obj* target = DEREF(Obj, AS_WEAK_REF(args[0])->target);
+    return target == NULL ? NIL_VAL : OBJ_VAL(target);
+}
+
+// weakMap(), then weakMapGet(map, key) (nil when missing), weakMapSet(map,
+// key, value), weakMapHas(map, key) and weakMapDelete(map, key); keys are
+// objects, compared by identity
+static Value weakMapNative (int argCount, Value* args) {
+    return OBJ_VAL(newWeakMap());
+}
+
+static bool checkWeakMap (const char* native, Value* args) {
+    if (!IS_WEAK_MAP(args[0])) {
+        runtimeError("%s takes a weak map", native);
+        return false;
+    }
+    if (!IS_OBJ(args[1])) {
+        runtimeError("Weak map keys must be objects");
+        return false;
+    }
+    return true;
+}
+
+static Value weakMapGetNative (int argCount, Value* args) {
+    Value value;
+    if (!checkWeakMap("weakMapGet", args)) return NIL_VAL;
+    if (!weakMapGet(AS_WEAK_MAP(args[0]), AS_OBJ(args[1]), &value)) return NIL_VAL;
+    return value;
+}
+
+static Value weakMapSetNative (int argCount, Value* args) {
+    if (!checkWeakMap("weakMapSet", args)) return NIL_VAL;
+
+    ObjWeakMap* map = AS_WEAK_MAP(args[0]);
+    beforeWrite((Obj*) map);
+    weakMapSet(map, AS_OBJ(args[1]), args[2]);
+    writeBarrier((Obj*) map);
+    return args[2];
+}
+
+static Value weakMapHasNative (int argCount, Value* args) {
+    Value value;
+    if (!checkWeakMap("weakMapHas", args)) return NIL_VAL;
+    return BOOL_VAL(weakMapGet(AS_WEAK_MAP(args[0]), AS_OBJ(args[1]), &value));
+}
+
+static Value weakMapDeleteNative (int argCount, Value* args) {
+    if (!checkWeakMap("weakMapDelete", args)) return NIL_VAL;
+
+    ObjWeakMap* map = AS_WEAK_MAP(args[0]);
+    beforeWrite((Obj*) map);
+    return BOOL_VAL(weakMapDelete(map, AS_OBJ(args[1])));
+}
+
+// allocBudget(objects, bytes) up to the matching allocCheck(), which raises
+// the error if more was allocated; nil for no limit
+static bool budgetLimit (Value value, double* limit) {
+    if (IS_NIL(value)) {
+        *limit = -1;
+        return true;
+    }
+    if (IS_NUMBER(value)) *limit = AS_NUMBER(value);
+    else if (IS_INT(value)) *limit = (double) AS_INT(value);
+    else return false;
+    return *limit >= 0;
+}
+
+static Value allocBudgetNative (int argCount, Value* args) {
+    double maxObjects;
+    double maxBytes;
+    if (!budgetLimit(args[0], &maxObjects) || !budgetLimit(args[1], &maxBytes)) {
+        runtimeError("allocBudget takes two limits, numbers or nil");
+    } else if (!openAllocBudget(maxObjects, maxBytes)) {
+        runtimeError("Too many allocation budgets open");
+    }
+    return NIL_VAL;
+}
+
+static Value allocCheckNative (int argCount, Value* args) {
+    closeAllocBudget();
+    return NIL_VAL;
+}
+
 static void resetStack () {
     vm.stackTop = vm.stack;
     vm.frameCount = 0;
     vm.openUpvalues = NULL;
+    dropAllocBudgets(-1, 0, 0);
+    if (vm.regionBase != NULL) {
+        vm.regionBase = NULL;
+        exitRegion();
+    }
 }
 
-static void runtimeError (const char* format, ...) {
+// raises the formatted message as a string exception, the caller unwinds
+void runtimeError (const char* format, ...) {
     // ! way of getting variable number of arguments to function
+    char message[256];
     va_list args;
     va_start(args, format);
-    vfprintf(stderr, format, args);
+    int length = vsnprintf(message, sizeof(message), format, args);
     va_end(args);
 
-    fputs("\n", stderr);
+    if (length >= (int) sizeof(message)) length = sizeof(message) - 1;
+    vm.exception = OBJ_VAL(copyString(message, length));
+}
+
+// nobody caught it: message and stack trace, then a clean vm
+void reportException () {
+    Value exception = vm.exception;
+    if (IS_STRING(exception)) {
+        fprintf(stderr, "%s\n", AS_CSTRING(exception));
+    } else if (IS_NUMBER(exception)) {
+        fprintf(stderr, "Uncaught exception: %g\n", AS_NUMBER(exception));
+    } else if (IS_INT(exception)) {
+        fprintf(stderr, "Uncaught exception: %" PRId64 "\n", AS_INT(exception));
+    } else if (IS_INSTANCE(exception)) {
+        ObjClass* clas = DEREF(ObjClass, AS_INSTANCE(exception) -> clas);
+        fprintf(stderr, "Uncaught exception: <instance of class: %s>\n", DEREF(ObjString, clas -> name) -> chars);
+    } else {
+        fprintf(stderr, "Uncaught exception.\n");
+    }
 
     for (int i = vm.frameCount - 1; i >= 0; i--) {
         CallFrame* frame = &vm.frames[i];
-        ObjFunction* func = frame ->closure->rawFunc;
+        ObjFunction* func = DEREF(ObjFunction, frame ->closure->rawFunc);
         size_t instruction = frame -> ip - func->chunk.code - 1;
         fprintf(stderr, "[line %d] in ", func -> chunk.lines[instruction]);
-        if (func->name == NULL) {
+        ObjString* name = DEREF(ObjString, func -> name);
+        if (name == NULL) {
             fprintf(stderr, "script\n");
         } else {
-            fprintf(stderr, "%s()\n", func -> name ->chars);
+            fprintf(stderr, "%s()\n", name ->chars);
         }
     }
+    vm.exception = NIL_VAL;
     resetStack();
 }
 
+// the governor found vm.fuel at 0: the heap went over its limit, raised as
+// an error, or the fuel ran out, which no handler gets to catch
+static bool govern () {
+    if (!vm.outOfMemory) {
+        runtimeError("Out of fuel.");
+        reportException();
+        return false;
+    }
+
+    runtimeError("Out of memory."); // allocates, still flagged so it doesn't collect again
+    vm.outOfMemory = false;
+    vm.fuel = vm.fuelSaved;
+    return true;
+}
+
+// hands vm.exception to the frame if one of its try blocks covers the
+// instruction that threw (or the call that did), dropping the frames above
+bool handleException (CallFrame* frame) {
+    Chunk* chunk = &DEREF(ObjFunction, frame -> closure -> rawFunc) -> chunk;
+    int offset = (int)(frame -> ip - chunk -> code) - 1;
+
+    for (int i = 0; i < chunk -> handlerCount; i++) {
+        ExceptionHandler* handler = &chunk -> handlers[i];
+        if (offset < handler -> start || offset >= handler -> end) continue;
+
+        Value* top = frame -> slots + handler -> stackDepth;
+        closeUpvalues(top);
+        dropAllocBudgets((int)(frame - vm.frames), handler -> start, handler -> end);
+        vm.frameCount = (int)(frame - vm.frames) + 1;
+        vm.stackTop = top;
+        push(vm.exception);
+        vm.exception = NIL_VAL;
+        frame -> ip = chunk -> code + handler -> handler;
+        return true;
+    }
+    return false;
+}
+
+// unwinds vm.frames to the innermost handler, false once it was reported
+static bool throwException () {
+    for (int i = vm.frameCount - 1; i >= 0; i--) {
+        if (handleException(&vm.frames[i])) return true;
+    }
+    reportException();
+    return false;
+}
+
 static Value peek (int distance) {
     return vm.stackTop[-1 - distance];
 }
 
-static bool isFalsey (Value value) {
+bool isFalsey (Value value) {
     // zero is falsey
     if (IS_NUMBER(value)) return AS_NUMBER(value) == 0;
+    if (IS_INT(value)) return AS_INT(value) == 0;
     if (IS_NIL(value)) return true;
 
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
+// everything but two doubles for the arithmetic, comparison and bitwise
+// opcodes (register forms pass the stack opcode): two ints stay exact and
+// wrap at 64 bits except under '/', an int meeting a double becomes a
+// double, bitwise operators take ints only; false after raising an error
+bool numericOp (uint8_t op, Value a, Value b, Value* result) {
+    if (IS_INT(a) && IS_INT(b)) {
+        // unsigned so overflow wraps instead of being undefined
+        uint64_t x = (uint64_t) AS_INT(a);
+        uint64_t y = (uint64_t) AS_INT(b);
+        switch (op) {
+            case OP_ADD: *result = INT_VAL((int64_t)(x + y)); return true;
+            case OP_SUBTRACT: *result = INT_VAL((int64_t)(x - y)); return true;
+            case OP_MULTIPLY: *result = INT_VAL((int64_t)(x * y)); return true;
+            case OP_DIVIDE: *result = NUMBER_VAL((double) AS_INT(a) / (double) AS_INT(b)); return true;
+            case OP_MODULO:
+                if (y == 0) {
+                    runtimeError("Modulo by zero.");
+                    return false;
+                }
+                // INT64_MIN % -1 traps on x86
+                *result = INT_VAL(AS_INT(b) == -1 ? 0 : AS_INT(a) % AS_INT(b));
+                return true;
+            case OP_GREATER: *result = BOOL_VAL(AS_INT(a) > AS_INT(b)); return true;
+            case OP_LESS: *result = BOOL_VAL(AS_INT(a) < AS_INT(b)); return true;
+            case OP_BIT_AND: *result = INT_VAL((int64_t)(x & y)); return true;
+            case OP_BIT_OR: *result = INT_VAL((int64_t)(x | y)); return true;
+            case OP_BIT_XOR: *result = INT_VAL((int64_t)(x ^ y)); return true;
+            case OP_SHIFT_LEFT: *result = INT_VAL((int64_t)(x << (y & 63))); return true;
+            default: *result = INT_VAL(AS_INT(a) >> (y & 63)); return true; // sign extending
+        }
+    }
+
+    if (!IS_NUMERIC(a) || !IS_NUMERIC(b)) {
+        runtimeError(op == OP_ADD ? "Operands must be two numbers or two strings."
+                                  : "Operands must be numbers.");
+        return false;
+    }
+
+    double x = AS_DOUBLE(a);
+    double y = AS_DOUBLE(b);
+    switch (op) {
+        case OP_ADD: *result = NUMBER_VAL(x + y); return true;
+        case OP_SUBTRACT: *result = NUMBER_VAL(x - y); return true;
+        case OP_MULTIPLY: *result = NUMBER_VAL(x * y); return true;
+        case OP_DIVIDE: *result = NUMBER_VAL(x / y); return true;
+        case OP_MODULO: *result = NUMBER_VAL(fmod(x, y)); return true;
+        case OP_GREATER: *result = BOOL_VAL(x > y); return true;
+        case OP_LESS: *result = BOOL_VAL(x < y); return true;
+        default:
+            runtimeError("Operands must be integers.");
+            return false;
+    }
+}
+
 void concatenate () {
     ObjString* b = AS_STRING(peek(0));
     ObjString* a = AS_STRING(peek(1));
 
     int out_length = a ->length + b -> length;
-
-    char* out = ALLOCATE(char, out_length + 1);
-    memcpy(out, a -> chars, a -> length);
-    memcpy(out + a -> length, b -> chars, b -> length);
-    out[out_length] = '\0';
-
-    ObjString* out_string = takeString(out, out_length);
+    ObjString* out_string;
+
+    if (out_length <= MAX_INLINE_STRING) {
+        // looked up before anything is allocated, most results are interned already
+        char out[MAX_INLINE_STRING + 1];
+        memcpy(out, a -> chars, a -> length);
+        memcpy(out + a -> length, b -> chars, b -> length);
+        out_string = copyString(out, out_length);
+    } else {
+        ObjString* out = allocateString(out_length);
+        memcpy(out -> chars, a -> chars, a -> length);
+        memcpy(out -> chars + a -> length, b -> chars, b -> length);
+        out_string = takeString(out);
+    }
 
     pop();
     pop();
@@ -91,8 +343,9 @@ Value pop () {
 }
 
 static bool call(ObjClosure* closure, int argCount) {
-    if (argCount != closure -> rawFunc ->arity) {
-        runtimeError("Expected %d arguments but got %d", closure->rawFunc->arity, argCount);
+    ObjFunction* func = DEREF(ObjFunction, closure -> rawFunc);
+    if (argCount != func ->arity) {
+        runtimeError("Expected %d arguments but got %d", func->arity, argCount);
         return false;
     }
 
@@ -103,19 +356,19 @@ static bool call(ObjClosure* closure, int argCount) {
 
     CallFrame* frame = &vm.frames[vm.frameCount++]; // initialize new call frame
     frame -> closure = closure;
-    frame -> ip = closure->rawFunc -> chunk.code;
+    frame -> ip = func -> chunk.code;
     frame -> slots = vm.stackTop - argCount - 1;
     return true;
 }
 
-static bool callValue (Value callee, int argCount) {
+bool callValue (Value callee, int argCount) {
     if (IS_OBJ(callee)) {
         switch (OBJ_TYPE(callee))
         {
         case OBJ_BOUND_METHOD: {
             ObjBoundMethod* bound = AS_BOUNDMETHOD(callee);
             vm.stackTop[-argCount - 1] = bound->receiver;
-            return call(bound->method, argCount);
+            return call(DEREF(ObjClosure, bound->method), argCount);
         }
         case OBJ_CLOSURE:
                 return call(AS_CLOSURE(callee), argCount);
@@ -127,6 +380,7 @@ static bool callValue (Value callee, int argCount) {
             }
 
             Value res = native ->func(argCount, vm.stackTop - argCount);
+            if (!IS_NIL(vm.exception)) return false; // raised by the native
             vm.stackTop -= argCount + 1;
             push(res);
             return true;
@@ -159,12 +413,46 @@ static void defineNative (const char* name, NativeFn func, int arity) {
     pop();
 }
 
-static ObjUpvalue* captureUpvalue (Value* local) {
+// OP_INTRINSIC fast path, false without touching the stack when the call
+// has to go through the global (rebound, wrong arity, not numbers)
+bool runIntrinsic (uint8_t id, int argCount) {
+    if (vm.intrinsicRebound[id] || argCount != intrinsics[id].arity) return false;
+
+    Value* args = vm.stackTop - argCount;
+    if (!IS_NUMERIC(args[0])) return false;
+    double b = 0;
+    if (argCount == 2) {
+        if (!IS_NUMERIC(args[1])) return false;
+        b = AS_DOUBLE(args[1]);
+    }
+
+    args[0] = NUMBER_VAL(applyIntrinsic(id, AS_DOUBLE(args[0]), b));
+    vm.stackTop = args + 1;
+    return true;
+}
+
+// calls the global name with the arguments on top of the stack, the
+// callee slot OP_INTRINSIC left out goes in below them
+bool callGlobal (ObjString* name, int argCount) {
+    Value callee;
+    if (!hashMapGet(&vm.globals, name, &callee)) {
+        runtimeError("Undefined variable '%s'.", name -> chars);
+        return false;
+    }
+
+    Value* args = vm.stackTop - argCount;
+    memmove(args + 1, args, sizeof(Value) * argCount);
+    args[0] = callee;
+    vm.stackTop++;
+    return callValue(callee, argCount);
+}
+
+ObjUpvalue* captureUpvalue (Value* local) {
     ObjUpvalue* prevUpvalue = NULL;
     ObjUpvalue* upvalue = vm.openUpvalues;
     while (upvalue != NULL && upvalue -> location > local) {
         prevUpvalue = upvalue;
-        upvalue = prevUpvalue->next;
+        upvalue = DEREF(ObjUpvalue, prevUpvalue->next);
     }
 
     if (upvalue!= NULL && upvalue->location == local) {
@@ -172,34 +460,54 @@ static ObjUpvalue* captureUpvalue (Value* local) {
     }
 
     ObjUpvalue* createdUpvalue = newUpvalue(local);
-    createdUpvalue->next = upvalue;
+    createdUpvalue->next = REF(upvalue);
 
     if (prevUpvalue == NULL) {
         vm.openUpvalues = createdUpvalue;
     } else {
-        prevUpvalue->next = createdUpvalue;
+        prevUpvalue->next = REF(createdUpvalue);
     }
     return createdUpvalue;
 }
 
-static void closeUpvalues (Value* last) {
+void closeUpvalues (Value* last) {
     while (vm.openUpvalues != NULL &&
         vm.openUpvalues -> location >= last) {
             ObjUpvalue* upvalue = vm.openUpvalues;
+            beforeWrite((Obj*) upvalue);
             upvalue -> closed = *upvalue->location;
             upvalue->location = &upvalue -> closed;
-            vm.openUpvalues = upvalue->next;
+            writeBarrier((Obj*) upvalue);
+            vm.openUpvalues = DEREF(ObjUpvalue, upvalue->next);
+    }
+
+    // the region block's slot goes too, however the stack got unwound
+    if (vm.regionBase != NULL && vm.regionBase >= last) {
+        vm.regionBase = NULL;
+        exitRegion();
     }
 }
 
-static void defineMethod (ObjString* name) {
+// OP_REGION: only the outermost region block opens a region, the ones
+// inside it share it
+void openRegion () {
+    if (vm.regionBase == NULL) {
+        vm.regionBase = vm.stackTop;
+        enterRegion();
+    }
+    push(NIL_VAL);
+}
+
+void defineMethod (ObjString* name) {
     Value method = peek(0);
     ObjClass* clas = AS_CLASS(peek(1));
+    beforeWrite((Obj*) clas);
     hashMapSet(&clas->methods, name, method);
+    writeBarrier((Obj*) clas);
     pop();
 }
 
-static bool bindMethod (ObjClass* clas, ObjString* name) {
+bool bindMethod (ObjClass* clas, ObjString* name) {
     Value method;
     if (!hashMapGet(&clas->methods, name, &method)) {
         runtimeError("Undefined property %s", name->chars);
@@ -213,7 +521,7 @@ static bool bindMethod (ObjClass* clas, ObjString* name) {
     return true;
 }
 
-static bool invokeFromClass (ObjClass* clas, ObjString* name, int argcount) {
+bool invokeFromClass (ObjClass* clas, ObjString* name, int argcount) {
     Value method;
     if (!hashMapGet(&clas->methods, name, &method)) {
         runtimeError("Only instances have methods.");
@@ -222,7 +530,7 @@ static bool invokeFromClass (ObjClass* clas, ObjString* name, int argcount) {
     return call(AS_CLOSURE(method), argcount);
 }
 
-static bool invoke (ObjString* name, int argCount) {
+bool invoke (ObjString* name, int argCount) {
     Value receiver = peek(argCount);
 
     if (!IS_INSTANCE(receiver)) {
@@ -238,7 +546,7 @@ static bool invoke (ObjString* name, int argCount) {
         return callValue(value, argCount);
     }
 
-    return invokeFromClass(instance->clas, name, argCount);
+    return invokeFromClass(DEREF(ObjClass, instance->clas), name, argCount);
 }
 
 static InterpretResult run () {
@@ -246,22 +554,95 @@ static InterpretResult run () {
     CallFrame* frame = &vm.frames[vm.frameCount - 1];
 
     #define READ_BYTE() (*(frame -> ip++))
-    #define READ_CONSTANT() (frame->closure->rawFunc -> chunk.constants.values[READ_BYTE()])
+    #define READ_CONSTANT() (DEREF(ObjFunction, frame->closure->rawFunc) -> chunk.constants.values[READ_BYTE()])
     #define READ_SHORT() \
         (frame -> ip += 2, \
         (uint16_t)((frame -> ip[-2] << 8) | frame -> ip[-1]))
     #define READ_STRING() AS_STRING(READ_CONSTANT())
-    #define BINARY_OP(valueType, op) \
+    // give the (possibly jitted) function of the new frame a chance to run natively
+    #define ENTER_JIT() \
+        do { \
+            if (vm.jitEnabled) jitRun(frame); \
+        } while (false)
+    // objects may move here: everything run holds is reached through vm.frames
+    #define SAFE_POINT() \
+        do { \
+            if (vm.gcCompactPending) compactHeap(); \
+        } while (false)
+    // fuel and the heap limit, at back edges and calls
+    #define GOVERN() \
+        do { \
+            if (vm.fuel == 0) { \
+                if (!govern()) return INTERPRET_OUT_OF_FUEL; \
+                goto unwind; \
+            } \
+            vm.fuel--; \
+        } while (false)
+    // two doubles or two ints inline, mixed operands through numericOp
+    #define BINARY_OP(valueType, op, opcode) \
         do { \
-            if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-                runtimeError("Operands must be numbers."); \
-                return INTERPRET_RUNTIME_ERROR; \
+            Value b = peek(0); \
+            Value a = peek(1); \
+            if (IS_NUMBER(a) && IS_NUMBER(b)) { \
+                vm.stackTop[-2] = valueType(AS_NUMBER(a) op AS_NUMBER(b)); \
+            } else if ((opcode) != OP_DIVIDE && IS_INT(a) && IS_INT(b)) { \
+                vm.stackTop[-2] = INT_OP_##valueType(AS_INT(a), op, AS_INT(b)); \
+            } else if (!numericOp(opcode, a, b, &vm.stackTop[-2])) { \
+                goto unwind; \
             } \
-            double b = AS_NUMBER(pop()); \
-            double a = AS_NUMBER(pop()); \
-            push(valueType(a op b)); \
+            vm.stackTop--; \
+        } while (false)
+    // operands proven numbers by the compiler, result written in place
+    #define NUMBER_OP(valueType, op) \
+        do { \
+            double b = AS_NUMBER(vm.stackTop[-1]); \
+            double a = AS_NUMBER(vm.stackTop[-2]); \
+            vm.stackTop--; \
+            vm.stackTop[-1] = valueType(a op b); \
         } while (false)
         /* *(vm.stackTop - 1) = *(vm.stackTop - 1) op b; \ */
+    // three-address register instruction, b read by the caller's operand
+    #define REGISTER_OP(valueType, op, opcode, operandB) \
+        do { \
+            uint8_t dst = READ_BYTE(); \
+            Value a = frame -> slots[READ_BYTE()]; \
+            Value b = operandB; \
+            Value result; \
+            if (IS_NUMBER(a) && IS_NUMBER(b)) { \
+                result = valueType(AS_NUMBER(a) op AS_NUMBER(b)); \
+            } else if ((opcode) != OP_DIVIDE && IS_INT(a) && IS_INT(b)) { \
+                result = INT_OP_##valueType(AS_INT(a), op, AS_INT(b)); \
+            } else if (!numericOp(opcode, a, b, &result)) { \
+                goto unwind; \
+            } \
+            if (dst == REG_STACK) push(result); \
+            else frame -> slots[dst] = result; \
+        } while (false)
+    #define REGISTER_ADD(operandB) \
+        do { \
+            uint8_t dst = READ_BYTE(); \
+            Value a = frame -> slots[READ_BYTE()]; \
+            Value b = operandB; \
+            if (IS_NUMBER(a) && IS_NUMBER(b)) { \
+                Value result = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)); \
+                if (dst == REG_STACK) push(result); \
+                else frame -> slots[dst] = result; \
+            } else if (IS_INT(a) && IS_INT(b)) { \
+                Value result = INT_OP_NUMBER_VAL(AS_INT(a), +, AS_INT(b)); \
+                if (dst == REG_STACK) push(result); \
+                else frame -> slots[dst] = result; \
+            } else if (IS_STRING(a) && IS_STRING(b)) { \
+                push(a); \
+                push(b); \
+                concatenate(); \
+                if (dst != REG_STACK) frame -> slots[dst] = pop(); \
+            } else { \
+                Value result; \
+                if (!numericOp(OP_ADD, a, b, &result)) goto unwind; \
+                if (dst == REG_STACK) push(result); \
+                else frame -> slots[dst] = result; \
+            } \
+        } while (false)
     for (;;) {
 
 #ifdef DEBUG_TRACE_EXECUTION
@@ -272,8 +653,8 @@ static InterpretResult run () {
             printf(" ]");
         }
         printf("\n");
-        disassembleInstruction(&frame->closure->rawFunc -> chunk, \
-            (int)(frame -> ip - frame->closure->rawFunc -> chunk.code));
+        disassembleInstruction(&DEREF(ObjFunction, frame->closure->rawFunc) -> chunk, \
+            (int)(frame -> ip - DEREF(ObjFunction, frame->closure->rawFunc) -> chunk.code));
 #endif
 
         uint8_t instruction;
@@ -283,8 +664,8 @@ static InterpretResult run () {
             case OP_RETURN: {
 
                 // exit -> to change later with functions and multiple chunks
+                closeUpvalues(frame->slots); // can collect, the result is still on the stack
                 Value res = pop();
-                closeUpvalues(frame->slots);
                 vm.frameCount--;
 
                 if (vm.frameCount == 0) {
@@ -295,6 +676,8 @@ static InterpretResult run () {
                 vm.stackTop = frame->slots;
                 push(res);
                 frame = &vm.frames[vm.frameCount - 1];
+                SAFE_POINT();
+                ENTER_JIT();
                 break;
             }
             case OP_CONSTANT:
@@ -311,31 +694,95 @@ static InterpretResult run () {
             case OP_ADD: {
                 if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
                     concatenate();
-                } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    double b = AS_NUMBER(pop());
-                    double a = AS_NUMBER(pop());
-                    push(NUMBER_VAL(a + b));
                 } else {
-                    runtimeError("Operands must be two numbers or two strings.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    BINARY_OP(NUMBER_VAL, +, OP_ADD);
                 }
                 break;
             }
-            case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-            case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-            case OP_DIVIDE: BINARY_OP(NUMBER_VAL, /); break;
+            case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -, OP_SUBTRACT); break;
+            case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *, OP_MULTIPLY); break;
+            case OP_DIVIDE: BINARY_OP(NUMBER_VAL, /, OP_DIVIDE); break;
+
+            case OP_MODULO:
+            case OP_BIT_AND:
+            case OP_BIT_OR:
+            case OP_BIT_XOR:
+            case OP_SHIFT_LEFT:
+            case OP_SHIFT_RIGHT:
+                if (!numericOp(instruction, peek(1), peek(0), &vm.stackTop[-2])) goto unwind;
+                vm.stackTop--;
+                break;
 
             case OP_NEGATE:
             { // switched to in place negation
+                if (IS_INT(peek(0))) {
+                    vm.stackTop[-1] = INT_VAL((int64_t)(0 - (uint64_t) AS_INT(peek(0))));
+                    break;
+                }
                 if (!IS_NUMBER(peek(0))) {
                     runtimeError ("Operand must be a number.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    goto unwind;
                 }
                 push(NUMBER_VAL(-AS_NUMBER(pop())));
                 // *(vm.stackTop - 1) = - *(vm.stackTop - 1);
                 break;
             }
 
+            case OP_ADD_NUM: NUMBER_OP(NUMBER_VAL, +); break;
+            case OP_SUBTRACT_NUM: NUMBER_OP(NUMBER_VAL, -); break;
+            case OP_MULTIPLY_NUM: NUMBER_OP(NUMBER_VAL, *); break;
+            case OP_DIVIDE_NUM: NUMBER_OP(NUMBER_VAL, /); break;
+            case OP_LESS_NUM: NUMBER_OP(BOOL_VAL, <); break;
+            case OP_GREATER_NUM: NUMBER_OP(BOOL_VAL, >); break;
+            case OP_NEGATE_NUM:
+                vm.stackTop[-1] = NUMBER_VAL(-AS_NUMBER(vm.stackTop[-1]));
+                break;
+
+            case OP_ADD_RR: REGISTER_ADD(frame -> slots[READ_BYTE()]); break;
+            case OP_SUBTRACT_RR: REGISTER_OP(NUMBER_VAL, -, OP_SUBTRACT, frame -> slots[READ_BYTE()]); break;
+            case OP_MULTIPLY_RR: REGISTER_OP(NUMBER_VAL, *, OP_MULTIPLY, frame -> slots[READ_BYTE()]); break;
+            case OP_DIVIDE_RR: REGISTER_OP(NUMBER_VAL, /, OP_DIVIDE, frame -> slots[READ_BYTE()]); break;
+            case OP_GREATER_RR: REGISTER_OP(BOOL_VAL, >, OP_GREATER, frame -> slots[READ_BYTE()]); break;
+            case OP_LESS_RR: REGISTER_OP(BOOL_VAL, <, OP_LESS, frame -> slots[READ_BYTE()]); break;
+            case OP_ADD_RK: REGISTER_ADD(READ_CONSTANT()); break;
+            case OP_SUBTRACT_RK: REGISTER_OP(NUMBER_VAL, -, OP_SUBTRACT, READ_CONSTANT()); break;
+            case OP_MULTIPLY_RK: REGISTER_OP(NUMBER_VAL, *, OP_MULTIPLY, READ_CONSTANT()); break;
+            case OP_DIVIDE_RK: REGISTER_OP(NUMBER_VAL, /, OP_DIVIDE, READ_CONSTANT()); break;
+            case OP_GREATER_RK: REGISTER_OP(BOOL_VAL, >, OP_GREATER, READ_CONSTANT()); break;
+            case OP_LESS_RK: REGISTER_OP(BOOL_VAL, <, OP_LESS, READ_CONSTANT()); break;
+
+            case OP_MOVE: {
+                uint8_t dst = READ_BYTE();
+                frame -> slots[dst] = frame -> slots[READ_BYTE()];
+                break;
+            }
+            case OP_LOAD_CONSTANT: {
+                uint8_t dst = READ_BYTE();
+                frame -> slots[dst] = READ_CONSTANT();
+                break;
+            }
+
+            // 'num' is a double, ints get promoted on the way in
+            case OP_CHECK_NUM: {
+                if (IS_INT(peek(0))) vm.stackTop[-1] = NUMBER_VAL((double) AS_INT(peek(0)));
+                if (!IS_NUMBER(peek(0))) {
+                    runtimeError("Type annotation 'num' violated: expected a number.");
+                    goto unwind;
+                }
+                break;
+            }
+
+            case OP_CHECK_NUM_LOCAL: {
+                uint8_t index = READ_BYTE();
+                Value* slot = &frame -> slots[index];
+                if (IS_INT(*slot)) *slot = NUMBER_VAL((double) AS_INT(*slot));
+                if (!IS_NUMBER(*slot)) {
+                    runtimeError("Type annotation 'num' violated: expected a number.");
+                    goto unwind;
+                }
+                break;
+            }
+
             case OP_FALSE: push(BOOL_VAL(false)); break;
             case OP_TRUE: push(BOOL_VAL(true)); break;
             case OP_NIL: push(NIL_VAL); break;
@@ -352,8 +799,8 @@ static InterpretResult run () {
                 break;
             }
 
-            case OP_LESS: BINARY_OP(BOOL_VAL, <); break;
-            case OP_GREATER: BINARY_OP(BOOL_VAL, >); break;
+            case OP_LESS: BINARY_OP(BOOL_VAL, <, OP_LESS); break;
+            case OP_GREATER: BINARY_OP(BOOL_VAL, >, OP_GREATER); break;
 
             case OP_PRINT: {
                 printValue(pop());
@@ -365,6 +812,7 @@ static InterpretResult run () {
 
             case OP_DEFINE_GLOBAL: {
                 ObjString* name = READ_STRING();
+                GUARD_INTRINSIC(name);
                 hashMapSet(&vm.globals, name, peek(0));
                 pop();
                 break;
@@ -375,7 +823,7 @@ static InterpretResult run () {
                 Value value;
                 if (!hashMapGet(&vm.globals, name, &value)) {
                     runtimeError("Undefined variable '%s'.", name -> chars);
-                    return INTERPRET_RUNTIME_ERROR;
+                    goto unwind;
                 }
                 push(value);
                 break;
@@ -383,12 +831,13 @@ static InterpretResult run () {
 
             case OP_SET_GLOBAL: {
                 ObjString* name = READ_STRING();
+                GUARD_INTRINSIC(name);
 
                 // a new key
                 if (hashMapSet(&vm.globals, name, peek(0))) {
                     hashMapDelete(&vm.globals, name);
                     runtimeError("Undefined variable '%s'.", name -> chars);
-                    return INTERPRET_RUNTIME_ERROR;
+                    goto unwind;
                 }
                 break;
             }
@@ -423,16 +872,38 @@ static InterpretResult run () {
             case OP_JUMP_BACK: {
                 uint16_t offset = (uint16_t)READ_BYTE() << 8;
                 offset = offset | READ_BYTE();
+                GOVERN();
                 frame -> ip -= offset;
+                SAFE_POINT();
+                if (vm.traceEnabled) {
+                    // the trace may leave us inside a function it inlined
+                    traceLoop(frame);
+                    frame = &vm.frames[vm.frameCount - 1];
+                }
                 break;
             }
             case OP_CALL: {
                 int argCount = READ_BYTE();
+                GOVERN();
 
                 if (!callValue(peek(argCount), argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
+                    goto unwind;
                 }
                 frame = &vm.frames[vm.frameCount - 1];
+                ENTER_JIT();
+                break;
+            }
+
+            case OP_INTRINSIC: {
+                ObjString* name = READ_STRING();
+                int argCount = READ_BYTE();
+                uint8_t id = READ_BYTE();
+                if (runIntrinsic(id, argCount)) break;
+
+                GOVERN();
+                if (!callGlobal(name, argCount)) goto unwind;
+                frame = &vm.frames[vm.frameCount - 1];
+                ENTER_JIT();
                 break;
             }
 
@@ -450,6 +921,7 @@ static InterpretResult run () {
                         closure -> upvalues[i] = frame->closure->upvalues[index];
                     }
                 }
+                writeBarrier((Obj*) closure); // capturing can collect
 
                 break;
             }
@@ -468,7 +940,9 @@ static InterpretResult run () {
 
             case OP_SET_UPVALUE: {
                 uint8_t slot = READ_BYTE();
+                beforeWrite((Obj*) frame->closure->upvalues[slot]);
                 *frame ->closure->upvalues[slot]->location = peek(0);
+                writeBarrier((Obj*) frame->closure->upvalues[slot]);
                 break;
             }
 
@@ -482,12 +956,14 @@ static InterpretResult run () {
                 Value superClass = peek(1);
                 if (!IS_CLASS(superClass)) {
                     runtimeError("Can only inherit from classes.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    goto unwind;
                 }
 
                 ObjClass* subclass = AS_CLASS(peek(0));
 
+                beforeWrite((Obj*) subclass);
                 hashMapAddAll(&AS_CLASS(superClass)->methods, &subclass-> methods);
+                writeBarrier((Obj*) subclass);
                 pop();
                 break;
             }
@@ -495,12 +971,14 @@ static InterpretResult run () {
             case OP_SUPER_INVOKE : {
                 ObjString* method = READ_STRING();
                 int argcount = READ_BYTE();
+                GOVERN();
                 ObjClass* superclass = AS_CLASS(pop());
                 if (!invokeFromClass(superclass, method, argcount)) {
-                    return INTERPRET_RUNTIME_ERROR;
+                    goto unwind;
                 }
 
                 frame = &vm.frames[vm.frameCount - 1];
+                ENTER_JIT();
                 break;
             }
 
@@ -509,7 +987,7 @@ static InterpretResult run () {
                 ObjClass* superClass = AS_CLASS(pop());
 
                 if (!bindMethod(superClass, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
+                    goto unwind;
                 }
 
                 break;
@@ -519,7 +997,7 @@ static InterpretResult run () {
 
                 if (!IS_INSTANCE(peek(0))) {
                     runtimeError("Only instances have properties.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    goto unwind;
                 }
 
                 ObjInstance* instance = AS_INSTANCE(peek(0));
@@ -532,20 +1010,22 @@ static InterpretResult run () {
                     break;
                 }
 
-                if (!bindMethod(instance->clas, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
+                if (!bindMethod(DEREF(ObjClass, instance->clas), name)) {
+                    goto unwind;
                 }
                 break;
             }
             case OP_SET_PROPERTY: {
                 if (!IS_INSTANCE(peek(1))) {
                     runtimeError("Only instance have field.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    goto unwind;
                 }
 
                 ObjInstance* instance = AS_INSTANCE(peek(1));
                 ObjString* name = READ_STRING();
+                beforeWrite((Obj*) instance);
                 hashMapSet(&instance->fields, name, peek(0));
+                writeBarrier((Obj*) instance);
                 Value val = pop();
                 pop();
                 push(val);
@@ -558,19 +1038,41 @@ static InterpretResult run () {
             case OP_INVOKE: {
                 ObjString* method = READ_STRING();
                 int argCount = READ_BYTE();
+                GOVERN();
                 if (!invoke(method, argCount )) {
-                    return INTERPRET_RUNTIME_ERROR;
+                    goto unwind;
                 }
                 frame = &vm.frames[vm.frameCount - 1];
+                ENTER_JIT();
                 break;
             }
+            case OP_THROW:
+                vm.exception = pop();
+                goto unwind;
+
+            case OP_REGION:
+                openRegion();
+                break;
+
             default:
                 break;
         }
+        continue;
+
+    unwind:
+        // runtime errors and 'throw' both land here
+        if (!throwException()) return INTERPRET_RUNTIME_ERROR;
+        frame = &vm.frames[vm.frameCount - 1];
     }
     return INTERPRET_OK;
 
 #undef READ_BYYE
+#undef ENTER_JIT
+#undef SAFE_POINT
+#undef GOVERN
+#undef NUMBER_OP
+#undef REGISTER_OP
+#undef REGISTER_ADD
 #undef READ_SHORT
 #undef READ_STRING
 #undef READ_CONSTANT
@@ -578,16 +1080,75 @@ static InterpretResult run () {
 
 void initVM () {
 
+    vm.regionDepth = 0;
+    vm.regionBase = NULL;
     resetStack();
 
-    vm.objects = NULL;
-
     vm.grayCapacity = 0;
     vm.grayCount = 0;
     vm.grayStack = NULL;
 
+    vm.rememberedCapacity = 0;
+    vm.rememberedCount = 0;
+    vm.remembered = NULL;
+
+    vm.weakCount = 0;
+    vm.weakCapacity = 0;
+    vm.weak = NULL;
+
     vm.bytesAlocated = 0;
     vm.nextGC = 1024 * 1024;
+    memset(&vm.gcStats, 0, sizeof(vm.gcStats));
+    recordNextGC();
+    vm.nurseryBytes = 0;
+    vm.gcMinor = false;
+    vm.gcMarking = false;
+#ifdef CONCURRENT_GC
+    vm.gcConcurrent = true;
+#else
+    vm.gcConcurrent = false;
+#endif
+    vm.gcConcurrentMarking = false;
+#ifdef GC_THREADS
+    vm.gcThreads = GC_THREADS;
+#else
+    vm.gcThreads = 1;
+#endif
+    vm.gcParallelMarking = false;
+#ifdef GC_COMPACT
+    vm.gcCompact = true;
+#else
+    vm.gcCompact = false;
+#endif
+    vm.gcCompactPending = false;
+
+    vm.exception = NIL_VAL;
+
+#ifdef HEAP_LIMIT
+    vm.heapLimit = HEAP_LIMIT;
+#else
+    vm.heapLimit = 0;
+#endif
+#ifdef FUEL
+    vm.fuel = FUEL;
+#else
+    vm.fuel = UINT64_MAX;
+#endif
+    vm.outOfMemory = false;
+    vm.fuelSaved = 0;
+
+    vm.jitEnabled = false;
+    vm.traceEnabled = false;
+#ifdef REGISTER_CODE
+    vm.registerCode = true;
+#else
+    vm.registerCode = false;
+#endif
+#ifdef ALLOC_TRACE
+    vm.allocTrace = true;
+#else
+    vm.allocTrace = false;
+#endif
 
     initHashMap(&vm.strings);
     initHashMap(&vm.globals);
@@ -596,9 +1157,32 @@ void initVM () {
     vm.initString = copyString("init", 4);
 
     defineNative("clock", clockNative, 0);
+    defineNative("gcStat", gcStatNative, 1);
+    defineNative("weakRef", weakRefNative, 1);
+    defineNative("weakGet", weakGetNative, 1);
+    defineNative("weakMap", weakMapNative, 0);
+    defineNative("weakMapGet", weakMapGetNative, 2);
+    defineNative("weakMapSet", weakMapSetNative, 3);
+    defineNative("weakMapHas", weakMapHasNative, 2);
+    defineNative("weakMapDelete", weakMapDeleteNative, 2);
+    defineNative("allocBudget", allocBudgetNative, 2);
+    defineNative("allocCheck", allocCheckNative, 0);
+
+    for (int i = 0; i < INTRINSIC_COUNT; i++) {
+        const IntrinsicInfo* info = &intrinsics[i];
+        defineNative(info -> name, info -> native, info -> arity);
+        copyString(info -> name, (int) strlen(info -> name)) -> intrinsic = (uint8_t) i;
+        vm.intrinsicRebound[i] = false;
+    }
 }
 
 InterpretResult interpret (const char* source) {
+    if (vm.outOfMemory) {
+        // the last script ended before raising it, this one gets checked afresh
+        vm.outOfMemory = false;
+        vm.fuel = vm.fuelSaved;
+    }
+
     ObjFunction* func = compile(source);
 
     if (func == NULL) return INTERPRET_COMPILE_ERROR;
@@ -621,4 +1205,7 @@ void freeVM () {
     vm.initString = NULL;
 
     free(vm.grayStack);
+    free(vm.remembered);
+    free(vm.weak);
+    freeAllocTrace();
 }
@@ -0,0 +1,106 @@
+#include "memory.h"
+#include "vm.h"
+#include "weakmap.h"
+
+#define WEAK_MAP_MAX_LOAD 0.75
+
+// keys hash by address, compaction marks the maps whose keys it moved stale
+static uint32_t hashObject (Obj* obj) {
+    uint64_t x = (uint64_t)(uintptr_t) obj;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return (uint32_t) x;
+}
+
+static WeakEntry* findEntry (WeakEntry* entries, int capacity, Obj* key) {
+    uint32_t index = hashObject(key) & (capacity - 1);
+    WeakEntry* tombstone = NULL;
+
+    for (;;) {
+        WeakEntry* entry = &entries[index];
+        if (entry->key == NULL) {
+            if (IS_NIL(entry->value)) return tombstone != NULL ? tombstone : entry;
+            if (tombstone == NULL) tombstone = entry;
+        } else if (entry->key == key) {
+            return entry;
+        }
+        index = (index + 1) & (capacity - 1);
+    }
+}
+
+static void adjustCapacity (ObjWeakMap* map, int capacity) {
+    // may collect, which only ever turns entries of the old table into tombstones
+    WeakEntry* entries = ALLOCATE(WeakEntry, capacity);
+    for (int i = 0; i < capacity; i++) {
+        entries[i].key = NULL;
+        entries[i].value = NIL_VAL;
+    }
+
+    map->count = 0;
+    for (int i = 0; i < map->capacity; i++) {
+        WeakEntry* entry = &map->entries[i];
+        if (entry->key == NULL) continue;
+
+        WeakEntry* dest = findEntry(entries, capacity, entry->key);
+        dest->key = entry->key;
+        dest->value = entry->value;
+        map->count++;
+    }
+
+    FREE_ARRAY(WeakEntry, map->entries, map->capacity);
+    map->entries = entries;
+    map->capacity = capacity;
+    map->isStale = false;
+}
+
+// rehashing frees the entries, reads of a stale map write it too
+static void refresh (ObjWeakMap* map) {
+    if (!map->isStale) return;
+    beforeWrite((Obj*) map);
+    adjustCapacity(map, map->capacity);
+}
+
+bool weakMapGet (ObjWeakMap* map, Obj* key, Value* value) {
+    if (map->count == 0) return false;
+    refresh(map);
+
+    WeakEntry* entry = findEntry(map->entries, map->capacity, key);
+    if (entry->key == NULL) return false;
+    *value = entry->value;
+    return true;
+}
+
+bool weakMapSet (ObjWeakMap* map, Obj* key, Value value) {
+    refresh(map);
+    if (map->count + 1 > map->capacity * WEAK_MAP_MAX_LOAD) {
+        adjustCapacity(map, GROW_CAPACITY(map->capacity));
+    }
+
+    WeakEntry* entry = findEntry(map->entries, map->capacity, key);
+    bool isNewKey = entry->key == NULL;
+    if (isNewKey && IS_NIL(entry->value)) map->count++;
+
+    entry->key = key;
+    entry->value = value;
+    return isNewKey;
+}
+
+bool weakMapDelete (ObjWeakMap* map, Obj* key) {
+    if (map->count == 0) return false;
+    refresh(map);
+
+    WeakEntry* entry = findEntry(map->entries, map->capacity, key);
+    if (entry->key == NULL) return false;
+
+    entry->key = NULL;
+    entry->value = BOOL_VAL(true);
+    return true;
+}
+
+void freeWeakMap (ObjWeakMap* map) {
+    FREE_ARRAY(WeakEntry, map->entries, map->capacity);
+    map->entries = NULL;
+    map->capacity = 0;
+    map->count = 0;
+}